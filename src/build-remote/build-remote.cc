@@ -5,6 +5,8 @@
 #include <memory>
 #include <tuple>
 #include <iomanip>
+#include <chrono>
+#include <limits>
 #if __APPLE__
 #include <sys/time.h>
 #endif
@@ -22,6 +24,7 @@
 #include "local-store.hh"
 #include "legacy.hh"
 #include "experimental-features.hh"
+#include "names.hh"
 
 using namespace nix;
 using std::cin;
@@ -42,12 +45,184 @@ static AutoCloseFD openSlotLock(const Machine & m, uint64_t slot)
     return openLockFile(fmt("%s/%s-%d", currentLoad, escapeUri(m.storeUri.render()), slot), true);
 }
 
+static AutoCloseFD openUploadSlotLock(const std::string & storeUri, unsigned int slot)
+{
+    auto suffix = slot ? fmt(".upload-lock-%d", slot) : ".upload-lock";
+    try {
+        return openLockFile(currentLoad + "/" + escapeUri(storeUri) + suffix, true);
+    } catch (SysError & e) {
+        if (e.errNo != ENAMETOOLONG) throw;
+        // Try again hashing the store URL so we have a shorter path
+        auto h = hashString(HashAlgorithm::MD5, storeUri);
+        return openLockFile(currentLoad + "/" + h.to_string(HashFormat::Base64, false) + suffix, true);
+    }
+}
+
 static bool allSupportedLocally(Store & store, const std::set<std::string>& requiredFeatures) {
     for (auto & feature : requiredFeatures)
         if (!store.systemFeatures.get().count(feature)) return false;
     return true;
 }
 
+/* Statistics used to predict how long a build takes on each machine.
+   They are kept in the current-load directory, so they are shared by
+   all build hook instances, and are updated as moving averages. */
+
+/* Assumed build time (in seconds on a machine with speed factor 1)
+   of derivations we haven't seen before. */
+static constexpr double defaultBuildTime = 60;
+
+/* Assumed upload speed (in bytes per second) to machines we haven't
+   uploaded to before. */
+static constexpr double defaultUploadSpeed = 10 * 1024 * 1024;
+
+/* The maximum number of store paths that we remember a machine to
+   have. Beyond that, the oldest half is forgotten. */
+static constexpr size_t maxKnownPaths = 100000;
+
+static Path buildTimePath(const StorePath & drvPath)
+{
+    /* Ignore the version, so that updates of a package use the build
+       times of previous versions. */
+    return currentLoad + "/build-times/" + DrvName(drvPath.name()).name;
+}
+
+static Path uploadSpeedPath(const std::string & storeUri)
+{
+    return currentLoad + "/" + escapeUri(storeUri) + ".upload-speed";
+}
+
+static std::optional<double> readStat(const Path & path)
+{
+    try {
+        return string2Float<double>(trim(readFile(path)));
+    } catch (SysError &) {
+        return std::nullopt;
+    }
+}
+
+static void updateStat(const Path & path, double sample)
+{
+    try {
+        auto old = readStat(path);
+        auto value = old ? 0.7 * *old + 0.3 * sample : sample;
+        createDirs(dirOf(path));
+        auto tmp = fmt("%s.tmp-%d", path, getpid());
+        writeFile(tmp, fmt("%f", value));
+        std::filesystem::rename(tmp, path);
+    } catch (std::exception & e) {
+        debug("cannot update '%s': %s", path, e.what());
+    }
+}
+
+/* The hash parts of the store paths that a machine is known to have,
+   because we uploaded them or it said it had them, one per line. This
+   lets us compare machines without connecting to them. Paths that
+   have since been garbage-collected on the machine make its estimate
+   too optimistic, but only until the next build on it. */
+static Path knownPathsPath(const std::string & storeUri)
+{
+    return currentLoad + "/" + escapeUri(storeUri) + ".known-paths";
+}
+
+static std::unordered_set<std::string> readKnownPaths(const std::string & storeUri)
+{
+    std::unordered_set<std::string> known;
+    try {
+        for (auto & line : tokenizeString<std::vector<std::string>>(readFile(knownPathsPath(storeUri)), "\n"))
+            known.insert(line);
+    } catch (SysError &) {
+    }
+    return known;
+}
+
+static void addKnownPaths(const std::string & storeUri, const StorePathSet & paths)
+{
+    auto path = knownPathsPath(storeUri);
+    try {
+        std::string s;
+        for (auto & p : paths)
+            s += std::string(p.hashPart()) + "\n";
+
+        /* Appends of a few kilobytes are atomic in practice, so
+           concurrent build hooks don't corrupt the file. */
+        AutoCloseFD fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+        if (!fd) throw SysError("opening '%s'", path);
+        writeFull(fd.get(), s);
+
+        struct stat st;
+        if (fstat(fd.get(), &st) == -1) throw SysError("getting status of '%s'", path);
+        fd.close();
+
+        if ((size_t) st.st_size > maxKnownPaths * (StorePath::HashLen + 1)) {
+            auto lines = tokenizeString<std::vector<std::string>>(readFile(path), "\n");
+            auto tmp = fmt("%s.tmp-%d", path, getpid());
+            writeFile(tmp, concatStringsSep("\n",
+                std::ranges::subrange(lines.begin() + lines.size() / 2, lines.end())) + "\n");
+            std::filesystem::rename(tmp, path);
+        }
+    } catch (std::exception & e) {
+        debug("cannot update '%s': %s", path, e.what());
+    }
+}
+
+/* Return the number of uploads to a machine that are in progress. */
+static unsigned int countUploads(const std::string & storeUri, unsigned int maxUploads)
+{
+    unsigned int uploads = 0;
+    for (unsigned int slot = 0; slot < maxUploads; ++slot) {
+        auto slotLock = openUploadSlotLock(storeUri, slot);
+        if (!lockFile(slotLock.get(), ltWrite, false))
+            ++uploads;
+    }
+    return uploads;
+}
+
+/* Return the closure of the inputs of a derivation, insofar as they
+   are valid in the local store. */
+static StorePathSet getInputClosure(Store & store, const StorePath & drvPath)
+{
+    StorePathSet inputs, closure;
+    try {
+        auto drv = store.readDerivation(drvPath);
+        inputs = drv.inputSrcs;
+        for (auto & [inputDrv, inputNode] : drv.inputDrvs.map)
+            for (auto & [outputName, outputPath] : store.queryPartialDerivationOutputMap(inputDrv))
+                if (inputNode.value.count(outputName) && outputPath && store.isValidPath(*outputPath))
+                    inputs.insert(*outputPath);
+        store.computeFSClosure(inputs, closure);
+    } catch (Error & e) {
+        debug("cannot determine the inputs of '%s': %s", store.printStorePath(drvPath), e.msg());
+    }
+    return closure;
+}
+
+/* A machine that has a free slot for the build. */
+struct Candidate
+{
+    Machine * machine;
+    AutoCloseFD slotLock;
+    uint64_t load;
+
+    /**
+     * Expected time (in seconds) until the build is finished.
+     */
+    double cost = 0;
+
+    /**
+     * Expected number of bytes of inputs that the machine is missing.
+     */
+    uint64_t missingBytes = 0;
+};
+
+static bool betterCandidate(const Candidate & a, const Candidate & b)
+{
+    if (a.cost != b.cost) return a.cost < b.cost;
+    if (a.machine->speedFactor != b.machine->speedFactor)
+        return a.machine->speedFactor > b.machine->speedFactor;
+    return a.load < b.load;
+}
+
 static int main_build_remote(int argc, char * * argv)
 {
     {
@@ -91,6 +266,8 @@ static int main_build_remote(int argc, char * * argv)
 
         std::shared_ptr<Store> sshStore;
         AutoCloseFD bestSlotLock;
+        Machine * bestMachine = nullptr;
+        unsigned int maxUploads = std::max(1U, settings.buildersMaxUploads.get());
 
         auto machines = getMachines();
         debug("got %d remote builders", machines.size());
@@ -127,15 +304,20 @@ static int main_build_remote(int argc, char * * argv)
             /* Error ignored here, will be caught later */
             mkdir(currentLoad.c_str(), 0777);
 
+            /* The inputs are only needed to compare machines. */
+            StorePathSet inputClosure;
+            if (machines.size() > 1)
+                inputClosure = getInputClosure(*store, *drvPath);
+
             while (true) {
                 bestSlotLock = -1;
+                bestMachine = nullptr;
                 AutoCloseFD lock = openLockFile(currentLoad + "/main-lock", true);
                 lockFile(lock.get(), ltWrite, true);
 
                 bool rightType = false;
 
-                Machine * bestMachine = nullptr;
-                uint64_t bestLoad = 0;
+                std::vector<Candidate> candidates;
                 for (auto & m : machines) {
                     debug("considering building on remote machine '%s'", m.storeUri.render());
 
@@ -160,29 +342,15 @@ static int main_build_remote(int argc, char * * argv)
                         if (!free) {
                             continue;
                         }
-                        bool best = false;
-                        if (!bestSlotLock) {
-                            best = true;
-                        } else if (load / m.speedFactor < bestLoad / bestMachine->speedFactor) {
-                            best = true;
-                        } else if (load / m.speedFactor == bestLoad / bestMachine->speedFactor) {
-                            if (m.speedFactor > bestMachine->speedFactor) {
-                                best = true;
-                            } else if (m.speedFactor == bestMachine->speedFactor) {
-                                if (load < bestLoad) {
-                                    best = true;
-                                }
-                            }
-                        }
-                        if (best) {
-                            bestLoad = load;
-                            bestSlotLock = std::move(free);
-                            bestMachine = &m;
-                        }
+                        candidates.push_back(Candidate {
+                            .machine = &m,
+                            .slotLock = std::move(free),
+                            .load = load,
+                        });
                     }
                 }
 
-                if (!bestSlotLock) {
+                if (candidates.empty()) {
                     if (rightType && !canBuildLocally)
                         std::cerr << "# postpone\n";
                     else
@@ -225,6 +393,35 @@ static int main_build_remote(int argc, char * * argv)
                     break;
                 }
 
+                /* Estimate when the build would finish on each machine.
+                   The running builds compete with ours for the machine,
+                   and concurrent uploads share its bandwidth. We don't
+                   connect to the machines for this, but estimate which
+                   inputs they are missing from what we know about
+                   previous builds on them. */
+                auto buildTime = readStat(buildTimePath(*drvPath)).value_or(defaultBuildTime);
+                for (auto & c : candidates) {
+                    c.cost = (c.load + 1) * buildTime / c.machine->speedFactor;
+                    if (inputClosure.empty()) continue;
+                    auto uri = c.machine->storeUri.render();
+                    auto known = readKnownPaths(uri);
+                    for (auto & path : inputClosure)
+                        if (!known.count(std::string(path.hashPart())))
+                            c.missingBytes += store->queryPathInfo(path)->narSize;
+                    auto uploadSpeed = readStat(uploadSpeedPath(uri)).value_or(defaultUploadSpeed);
+                    c.cost += c.missingBytes * (countUploads(uri, maxUploads) + 1) / uploadSpeed;
+                    debug("expected build time on '%s' is %.1f s, missing about %d bytes of inputs",
+                        uri, c.cost, c.missingBytes);
+                }
+
+                std::sort(candidates.begin(), candidates.end(), betterCandidate);
+
+                /* This releases the slots of the other machines. */
+                auto & best = candidates[0];
+                bestMachine = best.machine;
+                bestSlotLock = std::move(best.slotLock);
+                candidates.clear();
+
 #if __APPLE__
                 futimes(bestSlotLock.get(), NULL);
 #else
@@ -233,9 +430,9 @@ static int main_build_remote(int argc, char * * argv)
 
                 lock = -1;
 
-                try {
-                    storeUri = bestMachine->storeUri.render();
+                storeUri = bestMachine->storeUri.render();
 
+                try {
                     Activity act(*logger, lvlTalkative, actUnknown, fmt("connecting to '%s'", storeUri));
 
                     sshStore = bestMachine->openStore();
@@ -260,31 +457,45 @@ connected:
 
         std::cerr << "# accept\n" << storeUri << "\n";
 
-        auto inputs = readStrings<PathSet>(source);
+        auto inputs = store->parseStorePathSet(readStrings<PathSet>(source));
         auto wantedOutputs = readStrings<StringSet>(source);
 
-        AutoCloseFD uploadLock;
-        {
-            auto setUpdateLock = [&](auto && fileName){
-                uploadLock = openLockFile(currentLoad + "/" + escapeUri(fileName) + ".upload-lock", true);
-            };
+        /* Find out which inputs the machine is missing, to measure the
+           upload speed and to remember what it has for the next
+           choice between machines. */
+        std::optional<uint64_t> missingBytes;
+        if (machines.size() > 1) {
             try {
-                setUpdateLock(storeUri);
-            } catch (SysError & e) {
-                if (e.errNo != ENAMETOOLONG) throw;
-                // Try again hashing the store URL so we have a shorter path
-                auto h = hashString(HashAlgorithm::MD5, storeUri);
-                setUpdateLock(h.to_string(HashFormat::Base64, false));
+                auto valid = sshStore->queryValidPaths(inputs);
+                addKnownPaths(storeUri, valid);
+                uint64_t missing = 0;
+                for (auto & path : inputs)
+                    if (!valid.count(path))
+                        missing += store->queryPathInfo(path)->narSize;
+                missingBytes = missing;
+            } catch (Error & e) {
+                debug("cannot query the inputs on '%s': %s", storeUri, e.msg());
             }
         }
 
-        {
+        /* Allow a limited number of concurrent uploads to the same
+           machine. */
+        AutoCloseFD uploadLock;
+        for (unsigned int slot = 0; slot < maxUploads && !uploadLock; ++slot) {
+            auto slotLock = openUploadSlotLock(storeUri, slot);
+            if (lockFile(slotLock.get(), ltWrite, false))
+                uploadLock = std::move(slotLock);
+        }
+
+        if (!uploadLock) {
             Activity act(*logger, lvlTalkative, actUnknown, fmt("waiting for the upload lock to '%s'", storeUri));
 
+            uploadLock = openUploadSlotLock(storeUri, getpid() % maxUploads);
+
             auto old = signal(SIGALRM, handleAlarm);
             alarm(15 * 60);
             if (!lockFile(uploadLock.get(), ltWrite, true))
-                printError("somebody is hogging the upload lock for '%s', continuing...");
+                printError("somebody is hogging the upload lock for '%s', continuing...", storeUri);
             alarm(0);
             signal(SIGALRM, old);
         }
@@ -293,15 +504,26 @@ connected:
 
         {
             Activity act(*logger, lvlTalkative, actUnknown, fmt("copying dependencies to '%s'", storeUri));
-            copyPaths(*store, *sshStore, store->parseStorePathSet(inputs), NoRepair, NoCheckSigs, substitute);
+            auto before = std::chrono::steady_clock::now();
+            copyPaths(*store, *sshStore, inputs, NoRepair, NoCheckSigs, substitute);
+            auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - before).count();
+            /* Short uploads are dominated by latency, so they don't tell
+               us much about the bandwidth. */
+            if (missingBytes && !substitute && seconds >= 1)
+                updateStat(uploadSpeedPath(storeUri), *missingBytes / seconds);
         }
 
+        if (machines.size() > 1)
+            addKnownPaths(storeUri, inputs);
+
         uploadLock = -1;
 
         auto drv = store->readDerivation(*drvPath);
 
         std::optional<BuildResult> optResult;
 
+        auto buildStart = std::chrono::steady_clock::now();
+
         // If we don't know whether we are trusted (e.g. `ssh://`
         // stores), we assume we are. This is necessary for backwards
         // compat.
@@ -326,7 +548,7 @@ connected:
             // 2. Changing the `inputSrcs` set changes the associated
             //    output ids, which break CA derivations
             if (!drv.inputDrvs.map.empty())
-                drv.inputSrcs = store->parseStorePathSet(inputs);
+                drv.inputSrcs = inputs;
             optResult = sshStore->buildDerivation(*drvPath, (const BasicDerivation &) drv);
             auto & result = *optResult;
             if (!result.success())
@@ -344,6 +566,21 @@ connected:
             optResult = std::move(res[0]);
         }
 
+        /* Remember how long the build took, normalised to a machine
+           with speed factor 1. */
+        if (optResult->success())
+            updateStat(buildTimePath(*drvPath),
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count()
+                * bestMachine->speedFactor);
+
+        /* The outputs are often inputs of the next build. */
+        if (optResult->success() && machines.size() > 1) {
+            StorePathSet outputs;
+            for (auto & [_, realisation] : optResult->builtOutputs)
+                outputs.insert(realisation.outPath);
+            addKnownPaths(storeUri, outputs);
+        }
+
 
         auto outputHashes = staticOutputHashes(*store, drv);
         std::set<Realisation> missingRealisations;
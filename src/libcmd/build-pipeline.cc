@@ -0,0 +1,132 @@
+#include "build-pipeline.hh"
+#include "finally.hh"
+#include "shared.hh"
+#include "signals.hh"
+
+#include <chrono>
+
+namespace nix {
+
+BuildPipeline::BuildPipeline(
+    ref<Store> store,
+    BuildMode bMode,
+    std::shared_ptr<Store> evalStore)
+    : store(store)
+    , bMode(bMode)
+    , evalStore(evalStore)
+{
+    state_.lock()->running = true;
+    thread = std::thread(&BuildPipeline::run, this);
+}
+
+BuildPipeline::~BuildPipeline()
+{
+    if (thread.joinable()) {
+        cancel = true;
+        stop();
+    }
+}
+
+void BuildPipeline::add(const std::vector<DerivedPath> & paths)
+{
+    if (paths.empty()) return;
+    {
+        auto state(state_.lock());
+        state->pending.emplace(state->nextBatch++, paths);
+    }
+    wakeup.notify_all();
+}
+
+void BuildPipeline::stop()
+{
+    state_.lock()->done = true;
+    wakeup.notify_all();
+
+#ifndef _WIN32
+    if (cancel) {
+        /* The build may be blocked in poll() or in a read from the
+           daemon, where it doesn't check `cancel`. So interrupt those
+           system calls the way ReceiveInterrupts does, until the
+           thread has noticed. */
+        auto state(state_.lock());
+        while (state->running) {
+            pthread_kill(thread.native_handle(), SIGUSR1);
+            state.wait_for(wakeup, std::chrono::milliseconds(100));
+        }
+    }
+#endif
+
+    thread.join();
+}
+
+std::vector<KeyedBuildResult> BuildPipeline::finish()
+{
+    stop();
+
+    auto state(state_.lock());
+    if (state->exception)
+        std::rethrow_exception(state->exception);
+    std::vector<KeyedBuildResult> results;
+    for (auto & [_, batchResults] : state->results)
+        for (auto & result : batchResults)
+            results.push_back(std::move(result));
+    return results;
+}
+
+void BuildPipeline::run()
+{
+    ReceiveInterrupts receiveInterrupts;
+
+#ifndef _WIN32 // Does Windows need anything similar for async exit handling?
+    /* Make the builds in this thread stop when we're cancelled. */
+    unix::interruptCheck = [&]() { return (bool) cancel; };
+#endif
+
+    Finally exited([&]() {
+        state_.lock()->running = false;
+        wakeup.notify_all();
+    });
+
+    while (true) {
+        /* Take all pending batches, so that batches that were added
+           while the previous build was running are built together. */
+        size_t first;
+        std::vector<DerivedPath> batch;
+        {
+            auto state(state_.lock());
+            while (state->pending.empty() && !state->done && !state->failed)
+                state.wait(wakeup);
+            if (state->pending.empty() || state->failed) return;
+            first = state->pending.begin()->first;
+            for (auto & [_, paths] : state->pending)
+                batch.insert(batch.end(), paths.begin(), paths.end());
+            state->pending.clear();
+        }
+
+        try {
+            if (settings.printMissing)
+                printMissing(store, batch, lvlInfo);
+
+            auto results = store->buildPathsWithResults(batch, bMode, evalStore);
+
+            bool failed = false;
+            for (auto & result : results)
+                if (!result.success()) failed = true;
+
+            auto state(state_.lock());
+            state->results.emplace(first, std::move(results));
+            if (failed && !settings.keepGoing) {
+                state->failed = true;
+                wakeup.notify_all();
+            }
+        } catch (...) {
+            auto state(state_.lock());
+            if (!state->exception)
+                state->exception = std::current_exception();
+            state->failed = true;
+            wakeup.notify_all();
+        }
+    }
+}
+
+}
@@ -0,0 +1,91 @@
+#pragma once
+///@file
+
+#include "store-api.hh"
+#include "build-result.hh"
+#include "sync.hh"
+
+#include <atomic>
+#include <map>
+#include <thread>
+
+namespace nix {
+
+/**
+ * Builds derived paths in a background thread as they become known,
+ * so that building overlaps with evaluation. The thread builds the
+ * paths of the first call to `add()` right away; the paths added
+ * while it's busy are merged and built together once it's done. So
+ * only one build of these paths runs at a time, and `max-jobs` is
+ * respected as if they were built together.
+ */
+class BuildPipeline
+{
+public:
+
+    BuildPipeline(
+        ref<Store> store,
+        BuildMode bMode = bmNormal,
+        std::shared_ptr<Store> evalStore = nullptr);
+
+    /**
+     * Cancels the running builds if finish() hasn't been called,
+     * e.g. because evaluation failed.
+     */
+    ~BuildPipeline();
+
+    void add(const std::vector<DerivedPath> & paths);
+
+    /**
+     * Wait until all added paths have been built, and return their
+     * results in the order in which they were added. Unless
+     * `keep-going` is set, no batches are started after one that
+     * failed, so results for later paths may be missing.
+     */
+    std::vector<KeyedBuildResult> finish();
+
+private:
+
+    ref<Store> store;
+    BuildMode bMode;
+    std::shared_ptr<Store> evalStore;
+
+    struct State
+    {
+        /**
+         * The batches that haven't been started yet, keyed by their
+         * sequence number.
+         */
+        std::map<size_t, std::vector<DerivedPath>> pending;
+        size_t nextBatch = 0;
+
+        /**
+         * The results of the finished batches, keyed by the sequence
+         * number of their first batch.
+         */
+        std::map<size_t, std::vector<KeyedBuildResult>> results;
+
+        bool done = false;
+        bool failed = false;
+        std::exception_ptr exception;
+
+        /**
+         * Whether the thread hasn't exited yet.
+         */
+        bool running = false;
+    };
+
+    Sync<State> state_;
+
+    std::condition_variable wakeup;
+
+    std::atomic_bool cancel{false};
+
+    std::thread thread;
+
+    void run();
+
+    void stop();
+};
+
+}
@@ -1,5 +1,6 @@
 #include "globals.hh"
 #include "installables.hh"
+#include "build-pipeline.hh"
 #include "installable-derived-path.hh"
 #include "installable-attr-path.hh"
 #include "installable-flake.hh"
@@ -609,7 +610,7 @@ std::vector<BuiltPathWithResult> Installable::build(
     return res;
 }
 
-static void throwBuildErrors(
+void throwBuildErrors(
     std::vector<KeyedBuildResult> & buildResults,
     const Store & store)
 {
@@ -659,11 +660,21 @@ std::vector<std::pair<ref<Installable>, BuiltPathWithResult>> Installable::build
     std::vector<DerivedPath> pathsToBuild;
     std::map<DerivedPath, std::vector<Aux>> backmap;
 
+    /* If there are several installables, start building the paths
+       of each one while the next ones are being evaluated. */
+    std::optional<BuildPipeline> pipeline;
+    if (mode == Realise::Outputs && installables.size() > 1)
+        pipeline.emplace(store, bMode, evalStore);
+
     for (auto & i : installables) {
+        std::vector<DerivedPath> paths;
         for (auto b : i->toDerivedPaths()) {
+            paths.push_back(b.path);
             pathsToBuild.push_back(b.path);
             backmap[b.path].push_back({.info = b.info, .installable = i});
         }
+        if (pipeline)
+            pipeline->add(paths);
     }
 
     std::vector<std::pair<ref<Installable>, BuiltPathWithResult>> res;
@@ -698,10 +709,14 @@ std::vector<std::pair<ref<Installable>, BuiltPathWithResult>> Installable::build
         break;
 
     case Realise::Outputs: {
-        if (settings.printMissing)
-            printMissing(store, pathsToBuild, lvlInfo);
-
-        auto buildResults = store->buildPathsWithResults(pathsToBuild, bMode, evalStore);
+        std::vector<KeyedBuildResult> buildResults;
+        if (pipeline)
+            buildResults = pipeline->finish();
+        else {
+            if (settings.printMissing)
+                printMissing(store, pathsToBuild, lvlInfo);
+            buildResults = store->buildPathsWithResults(pathsToBuild, bMode, evalStore);
+        }
         throwBuildErrors(buildResults, *store);
         for (auto & buildResult : buildResults) {
             for (auto & aux : backmap[buildResult.path]) {
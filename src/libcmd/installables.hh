@@ -201,4 +201,12 @@ struct Installable
         const Installables & installables);
 };
 
+/**
+ * Throw an error if any of the builds failed. If several failed,
+ * their errors are logged and a summary is thrown.
+ */
+void throwBuildErrors(
+    std::vector<KeyedBuildResult> & buildResults,
+    const Store & store);
+
 }
@@ -89,6 +89,7 @@ void EvalState::forceValue(Value & v, const PosIdx pos)
         Env * env = v.payload.thunk.env;
         assert(env || v.isBlackhole());
         Expr * expr = v.payload.thunk.expr;
+        nrThunksForced++;
         try {
             v.mkBlackhole();
             //checkInterrupt();
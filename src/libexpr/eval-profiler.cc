@@ -0,0 +1,245 @@
+#include "eval-profiler.hh"
+#include "eval.hh"
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+
+namespace nix {
+
+EvalProfiler::EvalProfiler(unsigned int frequency)
+    : nodes(1)
+{
+    auto interval = std::chrono::microseconds(1000000 / std::max(frequency, 1U));
+
+    timerThread = std::thread([this, interval]() {
+        auto quit(quit_.lock());
+        while (!*quit) {
+            if (quit.wait_for(quitCV, interval) == std::cv_status::timeout)
+                pendingSamples.fetch_add(1, std::memory_order_relaxed);
+        }
+    });
+}
+
+EvalProfiler::~EvalProfiler()
+{
+    *quit_.lock() = true;
+    quitCV.notify_all();
+    timerThread.join();
+}
+
+void EvalProfiler::takeSample()
+{
+    /* If the evaluator didn't call or return from a function for a
+       while, several samples are pending. They all belong to the
+       current stack. */
+    auto samples = pendingSamples.exchange(0, std::memory_order_relaxed);
+
+    size_t node = 0;
+    for (auto & frame : stack) {
+        auto [i, inserted] = nodes[node].children.emplace(frame, nodes.size());
+        if (inserted) nodes.emplace_back();
+        node = i->second;
+    }
+
+    nodes[node].samples += samples;
+}
+
+void EvalProfiler::writeFoldedStacks(EvalState & state, std::ostream & str)
+{
+    auto showFrame = [&](const Frame & frame) {
+        std::string s;
+        if (frame.primOp) {
+            auto & name = frame.primOp->name;
+            s = "builtins." + (name.starts_with("__") ? name.substr(2) : name);
+        } else {
+            auto & lambda = *frame.lambda;
+            s = fmt("%s at %s",
+                lambda.name ? std::string(state.symbols[lambda.name]) : "«lambda»",
+                state.positions[lambda.pos]);
+        }
+        /* Semicolons separate frames and the final space separates
+           the sample count. */
+        std::replace(s.begin(), s.end(), ';', ',');
+        return s;
+    };
+
+    std::vector<std::string> path;
+
+    std::function<void(size_t)> visit;
+    visit = [&](size_t node) {
+        auto & n = nodes[node];
+        if (n.samples && !path.empty())
+            str << concatStringsSep(";", path) << " " << n.samples << "\n";
+        for (auto & [frame, child] : n.children) {
+            path.push_back(showFrame(frame));
+            visit(child);
+            path.pop_back();
+        }
+    };
+
+    visit(0);
+}
+
+EvalCostTracker::Cost & EvalCostTracker::Cost::operator += (const Cost & other)
+{
+    time += other.time;
+    thunks += other.thunks;
+    bytes += other.bytes;
+    return *this;
+}
+
+EvalCostTracker::Cost EvalCostTracker::Cost::operator - (const Cost & other) const
+{
+    return {
+        .time = time - other.time,
+        .thunks = thunks - other.thunks,
+        .bytes = bytes - other.bytes,
+    };
+}
+
+EvalCostTracker::EvalCostTracker(const EvalState & state)
+    : state(state)
+    , last(now())
+{
+}
+
+EvalCostTracker::Cost EvalCostTracker::now() const
+{
+    return {
+        .time = (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count(),
+        .thunks = state.nrThunksForced,
+        .bytes =
+            state.nrEnvs * sizeof(Env) + state.nrValuesInEnvs * sizeof(Value *)
+            + state.nrListElems * sizeof(Value *)
+            + state.nrValues * sizeof(Value)
+            + state.nrAttrsets * sizeof(Bindings) + state.nrAttrsInAttrsets * sizeof(Attr),
+    };
+}
+
+EvalCostTracker::Cost EvalCostTracker::charge()
+{
+    auto cur = now();
+    auto cost = cur - last;
+    if (stack.empty())
+        unattributed += cost;
+    else
+        stack.back().costs->self += cost;
+    last = cur;
+    return cur;
+}
+
+void EvalCostTracker::enter(EvalProfiler::Frame frame)
+{
+    auto cur = charge();
+    auto & costs = frames[frame];
+    costs.calls++;
+    costs.active++;
+    stack.push_back({&costs, cur});
+}
+
+void EvalCostTracker::leave()
+{
+    auto cur = charge();
+    auto & frame = stack.back();
+    if (--frame.costs->active == 0)
+        frame.costs->total += cur - frame.start;
+    stack.pop_back();
+}
+
+void EvalCostTracker::enterAttr(const std::string & attrPath)
+{
+    auto & costs = attrs[attrPath];
+    costs.calls++;
+    costs.active++;
+    attrStack.push_back({&costs, now()});
+}
+
+void EvalCostTracker::leaveAttr()
+{
+    auto & scope = attrStack.back();
+    if (--scope.costs->active == 0)
+        scope.costs->total += now() - scope.start;
+    attrStack.pop_back();
+}
+
+static nlohmann::json costToJSON(const EvalCostTracker::Cost & cost)
+{
+    return {
+        {"time", cost.time / 1e9},
+        {"thunks", cost.thunks},
+        {"bytes", cost.bytes},
+    };
+}
+
+nlohmann::json EvalCostTracker::toJSON(const EvalState & state) const
+{
+    using nlohmann::json;
+
+    auto functions = json::array();
+    auto primops = json::array();
+    std::map<std::string, Cost> files;
+
+    /* Sort by self time, most expensive first, so that the report
+       is useful when read directly. */
+    std::vector<std::pair<EvalProfiler::Frame, const Costs *>> sorted;
+    for (auto & [frame, costs] : frames)
+        sorted.emplace_back(frame, &costs);
+    std::sort(sorted.begin(), sorted.end(), [](auto & a, auto & b) {
+        return a.second->self.time > b.second->self.time;
+    });
+
+    for (auto & [frame, costs] : sorted) {
+        json obj = json::object();
+        if (frame.primOp) {
+            obj["name"] = frame.primOp->name;
+        } else {
+            auto & lambda = *frame.lambda;
+            if (lambda.name)
+                obj["name"] = (std::string_view) state.symbols[lambda.name];
+            else
+                obj["name"] = nullptr;
+            if (auto pos = state.positions[lambda.pos]) {
+                if (auto path = std::get_if<SourcePath>(&pos.origin)) {
+                    obj["file"] = path->to_string();
+                    files[path->to_string()] += costs->self;
+                }
+                obj["line"] = pos.line;
+                obj["column"] = pos.column;
+            }
+        }
+        obj["calls"] = costs->calls;
+        obj["self"] = costToJSON(costs->self);
+        obj["total"] = costToJSON(costs->total);
+        (frame.primOp ? primops : functions).push_back(std::move(obj));
+    }
+
+    auto filesJSON = json::array();
+    for (auto & [file, cost] : files)
+        filesJSON.push_back({{"file", file}, {"self", costToJSON(cost)}});
+
+    auto attrsJSON = json::array();
+    for (auto & [attrPath, costs] : attrs)
+        attrsJSON.push_back({
+            {"attrPath", attrPath},
+            {"count", costs.calls},
+            {"total", costToJSON(costs.total)},
+        });
+
+    return {
+        {"functions", std::move(functions)},
+        {"primops", std::move(primops)},
+        {"files", std::move(filesJSON)},
+        {"attributes", std::move(attrsJSON)},
+        {"unattributed", costToJSON(unattributed)},
+    };
+}
+
+EvalAttrCostScope::EvalAttrCostScope(EvalState & state, const std::string & attrPath)
+    : tracker(attrPath.empty() ? nullptr : state.costs.get())
+{
+    if (tracker) tracker->enterAttr(attrPath);
+}
+
+}
@@ -0,0 +1,268 @@
+#pragma once
+///@file
+
+#include "sync.hh"
+
+#include <nlohmann/json_fwd.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <ostream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace nix {
+
+class EvalState;
+struct ExprLambda;
+struct PrimOp;
+
+/**
+ * A sampling profiler for the evaluator.
+ *
+ * The evaluator maintains a shadow stack of the lambdas and primops
+ * that are being called. A timer thread periodically requests a
+ * sample, which is taken at the next function call or return by
+ * adding the current stack to an aggregated call tree. So the cost
+ * per call is a push, a pop and a relaxed atomic load.
+ */
+class EvalProfiler
+{
+public:
+
+    /**
+     * A stack frame: a call to either a lambda or a primop.
+     */
+    struct Frame
+    {
+        const ExprLambda * lambda = nullptr;
+        const PrimOp * primOp = nullptr;
+
+        auto operator<=>(const Frame &) const = default;
+    };
+
+    /**
+     * @param frequency Number of samples per second.
+     */
+    EvalProfiler(unsigned int frequency);
+
+    ~EvalProfiler();
+
+    void enter(Frame frame)
+    {
+        maybeSample();
+        stack.push_back(frame);
+    }
+
+    void leave()
+    {
+        maybeSample();
+        stack.pop_back();
+    }
+
+    /**
+     * Write the samples in the "folded stacks" format used by
+     * `flamegraph.pl` and compatible tools: one line per distinct
+     * stack, listing the frames from the outermost inwards,
+     * separated by semicolons, followed by the number of samples.
+     */
+    void writeFoldedStacks(EvalState & state, std::ostream & str);
+
+private:
+
+    std::vector<Frame> stack;
+
+    /**
+     * Number of samples requested by the timer thread and not taken
+     * yet.
+     */
+    std::atomic<uint64_t> pendingSamples{0};
+
+    struct Node
+    {
+        std::map<Frame, size_t> children;
+        uint64_t samples = 0;
+    };
+
+    /**
+     * The aggregated call tree. `nodes[0]` is the root.
+     */
+    std::vector<Node> nodes;
+
+    Sync<bool> quit_{false};
+    std::condition_variable quitCV;
+    std::thread timerThread;
+
+    void maybeSample()
+    {
+        if (pendingSamples.load(std::memory_order_relaxed)) [[unlikely]]
+            takeSample();
+    }
+
+    void takeSample();
+};
+
+/**
+ * Record a call in the profiler, if any, for the lifetime of this
+ * object.
+ */
+struct EvalProfilerFrame
+{
+    EvalProfiler * profiler;
+
+    EvalProfilerFrame(EvalProfiler * profiler, EvalProfiler::Frame frame)
+        : profiler(profiler)
+    {
+        if (profiler) profiler->enter(frame);
+    }
+
+    ~EvalProfilerFrame()
+    {
+        if (profiler) profiler->leave();
+    }
+};
+
+/**
+ * Attributes the cost of evaluation (wall time, thunks forced and
+ * bytes allocated) to the lambdas and primops in which it was
+ * incurred, and to attribute paths whose evaluation was requested
+ * (see `EvalAttrCostScope`). Enabled by `NIX_COUNT_COSTS`.
+ */
+class EvalCostTracker
+{
+public:
+
+    struct Cost
+    {
+        /**
+         * Wall time in nanoseconds.
+         */
+        uint64_t time = 0;
+        uint64_t thunks = 0;
+        uint64_t bytes = 0;
+
+        Cost & operator += (const Cost & other);
+        Cost operator - (const Cost & other) const;
+    };
+
+    struct Costs
+    {
+        /**
+         * Cost incurred in a frame itself, not counting the functions
+         * it called.
+         */
+        Cost self;
+
+        /**
+         * Cost including the functions it called. Recursive calls are
+         * only counted once.
+         */
+        Cost total;
+
+        uint64_t calls = 0;
+
+        /**
+         * Number of active frames or scopes.
+         */
+        size_t active = 0;
+    };
+
+    EvalCostTracker(const EvalState & state);
+
+    void enter(EvalProfiler::Frame frame);
+
+    void leave();
+
+    void enterAttr(const std::string & attrPath);
+
+    void leaveAttr();
+
+    /**
+     * Return the costs per function, per primop, per file and per
+     * attribute path as a JSON object.
+     */
+    nlohmann::json toJSON(const EvalState & state) const;
+
+private:
+
+    const EvalState & state;
+
+    struct FrameHash
+    {
+        size_t operator () (const EvalProfiler::Frame & frame) const
+        {
+            return std::hash<const void *>()(frame.lambda)
+                ^ std::hash<const void *>()(frame.primOp);
+        }
+    };
+
+    std::unordered_map<EvalProfiler::Frame, Costs, FrameHash> frames;
+
+    std::map<std::string, Costs> attrs;
+
+    /**
+     * Cost incurred outside of any function.
+     */
+    Cost unattributed;
+
+    struct ActiveFrame
+    {
+        Costs * costs;
+        Cost start;
+    };
+
+    std::vector<ActiveFrame> stack, attrStack;
+
+    /**
+     * The counters at the last call or return.
+     */
+    Cost last;
+
+    Cost now() const;
+
+    /**
+     * Charge the cost since the last call or return to the current
+     * frame.
+     */
+    Cost charge();
+};
+
+/**
+ * Record a call in the cost tracker, if any, for the lifetime of this
+ * object.
+ */
+struct EvalCostFrame
+{
+    EvalCostTracker * tracker;
+
+    EvalCostFrame(EvalCostTracker * tracker, EvalProfiler::Frame frame)
+        : tracker(tracker)
+    {
+        if (tracker) tracker->enter(frame);
+    }
+
+    ~EvalCostFrame()
+    {
+        if (tracker) tracker->leave();
+    }
+};
+
+/**
+ * Attribute the cost of evaluation during the lifetime of this object
+ * to the attribute path `attrPath`, if cost tracking is enabled.
+ */
+struct EvalAttrCostScope
+{
+    EvalCostTracker * tracker;
+
+    EvalAttrCostScope(EvalState & state, const std::string & attrPath);
+
+    ~EvalAttrCostScope()
+    {
+        if (tracker) tracker->leaveAttr();
+    }
+};
+
+}
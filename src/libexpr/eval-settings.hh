@@ -190,6 +190,28 @@ struct EvalSettings : Config
           `flamegraph.pl`.
         )"};
 
+    Setting<Path> evalProfileFile{this, "", "eval-profile-file",
+        R"(
+          If set, Nix periodically samples the stack of function calls of
+          the evaluator, and writes the result to the specified file when
+          evaluation finishes. The file uses the "folded stacks" format
+          understood by tools such as `flamegraph.pl`,
+          [inferno](https://github.com/jonhoo/inferno) and
+          [speedscope](https://www.speedscope.app/): each line lists the
+          functions on the stack from the outermost inwards, separated by
+          `;`, followed by the number of samples with that stack. Lambdas
+          are shown with their position, builtins as `builtins.<name>`.
+
+          Unlike [`trace-function-calls`](#conf-trace-function-calls),
+          this has little impact on evaluation time.
+        )"};
+
+    Setting<unsigned int> evalProfilerFrequency{this, 99, "eval-profiler-frequency",
+        R"(
+          The number of samples per second taken by the profiler enabled
+          by [`eval-profile-file`](#conf-eval-profile-file).
+        )"};
+
     Setting<bool> useEvalCache{this, true, "eval-cache",
         R"(
             Whether to use the flake evaluation cache.
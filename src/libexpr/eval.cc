@@ -11,6 +11,7 @@
 #include "eval-inline.hh"
 #include "filetransfer.hh"
 #include "function-trace.hh"
+#include "eval-profiler.hh"
 #include "profiles.hh"
 #include "print.hh"
 #include "filtering-source-accessor.hh"
@@ -313,6 +314,12 @@ EvalState::EvalState(
 
     countCalls = getEnv("NIX_COUNT_CALLS").value_or("0") != "0";
 
+    if (settings.evalProfileFile.get() != "")
+        profiler = std::make_unique<EvalProfiler>(settings.evalProfilerFrequency);
+
+    if (getEnv("NIX_COUNT_COSTS").value_or("0") != "0")
+        costs = std::make_unique<EvalCostTracker>(*this);
+
     assertGCInitialized();
 
     static_assert(sizeof(Env) <= 16, "environment must be <= 16 bytes");
@@ -1599,6 +1606,8 @@ void EvalState::callFunction(Value & fun, std::span<Value *> args, Value & vRes,
             if (countCalls) incrFunctionCall(&lambda);
 
             /* Evaluate the body. */
+            EvalProfilerFrame profilerFrame(profiler.get(), {.lambda = &lambda});
+            EvalCostFrame costFrame(costs.get(), {.lambda = &lambda});
             try {
                 auto dts = debugRepl
                     ? makeDebugTraceStacker(
@@ -1642,6 +1651,8 @@ void EvalState::callFunction(Value & fun, std::span<Value *> args, Value & vRes,
                 nrPrimOpCalls++;
                 if (countCalls) primOpCalls[fn->name]++;
 
+                EvalProfilerFrame profilerFrame(profiler.get(), {.primOp = fn});
+                EvalCostFrame costFrame(costs.get(), {.primOp = fn});
                 try {
                     fn->fun(*this, vCur.determinePos(noPos), args.data(), vCur);
                 } catch (Error & e) {
@@ -1686,6 +1697,8 @@ void EvalState::callFunction(Value & fun, std::span<Value *> args, Value & vRes,
                 nrPrimOpCalls++;
                 if (countCalls) primOpCalls[fn->name]++;
 
+                EvalProfilerFrame profilerFrame(profiler.get(), {.primOp = fn});
+                EvalCostFrame costFrame(costs.get(), {.primOp = fn});
                 try {
                     // TODO:
                     // 1. Unify this and above code. Heavily redundant.
@@ -2837,6 +2850,18 @@ void EvalState::maybePrintStats()
 #endif
         printStatistics();
     }
+
+    if (profiler) {
+        auto file = settings.evalProfileFile.get();
+        std::ofstream str(file);
+        profiler->writeFoldedStacks(*this, str);
+        str.close();
+        /* Don't throw, since this is called from destructors. */
+        if (!str)
+            warn("could not write evaluation profile to '%s'", file);
+        else
+            notice("wrote evaluation profile to '%s'", file);
+    }
 }
 
 void EvalState::printStatistics()
@@ -2918,6 +2943,7 @@ void EvalState::printStatistics()
     topObj["nrLookups"] = nrLookups;
     topObj["nrPrimOpCalls"] = nrPrimOpCalls;
     topObj["nrFunctionCalls"] = nrFunctionCalls;
+    topObj["nrThunksForced"] = nrThunksForced;
 #if HAVE_BOEHMGC
     topObj["gc"] = {
         {"heapSize", heapSize},
@@ -2964,6 +2990,9 @@ void EvalState::printStatistics()
         }
     }
 
+    if (costs)
+        topObj["costs"] = costs->toJSON(*this);
+
     if (getEnv("NIX_SHOW_SYMBOLS").value_or("0") != "0") {
         // XXX: overrides earlier assignment
         topObj["symbols"] = json::array();
@@ -33,6 +33,8 @@ class Store;
 namespace fetchers { struct Settings; }
 struct EvalSettings;
 class EvalState;
+class EvalProfiler;
+class EvalCostTracker;
 class StorePath;
 struct SingleDerivedPath;
 enum RepairFlag : bool;
@@ -790,7 +792,8 @@ public:
     void concatLists(Value & v, size_t nrLists, Value * const * lists, const PosIdx pos, std::string_view errorCtx);
 
     /**
-     * Print statistics, if enabled.
+     * Print statistics, if enabled, and write the evaluation profile,
+     * if enabled.
      *
      * Performs a full memory GC before printing the statistics, so that the
      * GC statistics are more accurate.
@@ -866,9 +869,20 @@ private:
     unsigned long nrListConcats = 0;
     unsigned long nrPrimOpCalls = 0;
     unsigned long nrFunctionCalls = 0;
+    unsigned long nrThunksForced = 0;
 
     bool countCalls;
 
+    /**
+     * The sampling profiler, if enabled (see `eval-profile-file`).
+     */
+    std::unique_ptr<EvalProfiler> profiler;
+
+    /**
+     * The cost tracker, if enabled (see `NIX_COUNT_COSTS`).
+     */
+    std::unique_ptr<EvalCostTracker> costs;
+
     typedef std::map<std::string, size_t> PrimOpCalls;
     PrimOpCalls primOpCalls;
 
@@ -894,6 +908,8 @@ private:
 
     friend struct Value;
     friend class ListBuilder;
+    friend class EvalCostTracker;
+    friend struct EvalAttrCostScope;
 };
 
 struct DebugTraceStacker {
@@ -1,5 +1,6 @@
 #include "get-drvs.hh"
 #include "eval-inline.hh"
+#include "eval-profiler.hh"
 #include "derivations.hh"
 #include "store-api.hh"
 #include "path-with-outputs.hh"
@@ -69,6 +70,7 @@ std::string PackageInfo::querySystem() const
 std::optional<StorePath> PackageInfo::queryDrvPath() const
 {
     if (!drvPath && attrs) {
+        EvalAttrCostScope costScope(*state, attrPath);
         if (auto i = attrs->get(state->sDrvPath)) {
             NixStringContext context;
             auto found = state->coerceToStorePath(i->pos, *i->value, context, "while evaluating the 'drvPath' attribute of a derivation");
@@ -97,6 +99,7 @@ StorePath PackageInfo::requireDrvPath() const
 StorePath PackageInfo::queryOutPath() const
 {
     if (!outPath && attrs) {
+        EvalAttrCostScope costScope(*state, attrPath);
         auto i = attrs->find(state->sOutPath);
         NixStringContext context;
         if (i != attrs->end())
@@ -380,6 +383,7 @@ static void getDerivations(EvalState & state, Value & vIn,
                 if (!std::regex_match(symbol.begin(), symbol.end(), attrRegex))
                     continue;
                 std::string pathPrefix2 = addToPath(pathPrefix, symbol);
+                EvalAttrCostScope costScope(state, pathPrefix2);
                 if (combineChannels)
                     getDerivations(state, *i->value, pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures);
                 else if (getDerivation(state, *i->value, pathPrefix2, drvs, done, ignoreAssertionFailures)) {
@@ -17,9 +17,11 @@ using namespace std::filesystem;
 
 class GitUtilsTest : public ::testing::Test
 {
+    std::unique_ptr<AutoDelete> delTmpDir;
+
+protected:
     // We use a single repository for all tests.
     fs::path tmpDir;
-    std::unique_ptr<AutoDelete> delTmpDir;
 
 public:
     void SetUp() override
@@ -98,6 +100,80 @@ TEST_F(GitUtilsTest, sink_basic)
     ASSERT_EQ(accessor->readFile(CanonPath("links/foo")), "hello world");
 };
 
+TEST_F(GitUtilsTest, sink_large_file)
+{
+    auto repo = openRepo();
+    auto sink = repo->getFileSystemObjectSink();
+
+    // Larger than what the sink buffers in memory, so it gets streamed.
+    std::string contents;
+    for (size_t n = 0; contents.size() < 3 * 1024 * 1024; ++n)
+        contents += std::to_string(n) + "\n";
+
+    sink->createDirectory(CanonPath("foo-1.1"));
+
+    sink->createRegularFile(CanonPath("foo-1.1/large"), [&](CreateRegularFileSink & fileSink) {
+        fileSink.isExecutable();
+        for (size_t pos = 0; pos < contents.size(); pos += 100000)
+            fileSink(std::string_view(contents).substr(pos, 100000));
+    });
+    sink->createRegularFile(CanonPath("foo-1.1/small"), [](CreateRegularFileSink & fileSink) {
+        writeString(fileSink, "small", false);
+    });
+
+    auto result = repo->dereferenceSingletonDirectory(sink->flush());
+    auto accessor = repo->getAccessor(result, false, getRepoName());
+    ASSERT_EQ(accessor->readFile(CanonPath("large")), contents);
+    ASSERT_TRUE(accessor->lstat(CanonPath("large")).isExecutable);
+    ASSERT_EQ(accessor->readFile(CanonPath("small")), "small");
+};
+
+TEST_F(GitUtilsTest, repack)
+{
+    auto repo = openRepo();
+
+    std::vector<Hash> trees;
+
+    // Every flush creates a packfile, so this exceeds the maximum number of packfiles.
+    for (size_t n = 0; n < 40; ++n) {
+        auto sink = repo->getFileSystemObjectSink();
+        sink->createDirectory(CanonPath("foo-1.1"));
+        sink->createRegularFile(CanonPath("foo-1.1/file"), [&](CreateRegularFileSink & fileSink) {
+            writeString(fileSink, "version " + std::to_string(n), false);
+        });
+        trees.push_back(repo->dereferenceSingletonDirectory(sink->flush()));
+    }
+
+    auto countPacks = [&]() {
+        size_t count = 0;
+        for (auto & entry : fs::directory_iterator(fs::path(tmpDir) / ".git" / "objects" / "pack"))
+            if (entry.path().extension() == ".pack")
+                ++count;
+        return count;
+    };
+
+    ASSERT_EQ(countPacks(), 40);
+
+    repo->maybeRepack();
+
+    /* The old packfiles are kept for the grace period, but don't
+       count towards the next repack. */
+    ASSERT_EQ(countPacks(), 41);
+
+    repo->maybeRepack();
+
+    ASSERT_EQ(countPacks(), 41);
+
+    repo->maybeRepack(std::chrono::seconds(0));
+
+    ASSERT_EQ(countPacks(), 1);
+
+    for (size_t n = 0; n < trees.size(); ++n) {
+        auto accessor = repo->getAccessor(trees[n], false, getRepoName());
+        ASSERT_EQ(accessor->readFile(CanonPath("file")), "version " + std::to_string(n));
+    }
+};
+
 TEST_F(GitUtilsTest, sink_hardlink)
 {
     auto repo = openRepo();
@@ -1,9 +1,82 @@
 #include "fetch-to-store.hh"
 #include "fetchers.hh"
 #include "cache.hh"
+#include "archive.hh"
+#include "signals.hh"
 
 namespace nix {
 
+#ifndef _WIN32
+
+/**
+ * Compute a fingerprint of the file system tree at `path` from the
+ * `lstat()` metadata of every file that `filter` lets through, like
+ * Git's index. This avoids having to read and hash every file in
+ * order to find out that a tree hasn't changed since the last time
+ * it was copied to the store. Returns nothing if some file isn't
+ * materialised in the file system, or if it was modified so recently
+ * that a subsequent change might not be visible in its timestamps
+ * ("racy" files in Git terminology).
+ */
+static std::optional<std::string> computeStatFingerprint(const SourcePath & path, PathFilter & filter)
+{
+    HashSink hashSink(HashAlgorithm::SHA256);
+
+    /* Files modified in the second before we started may be modified
+       again without a change in their timestamps. */
+    auto start = time(nullptr);
+
+    auto nsec = [](const struct timespec & ts) { return (long long) ts.tv_nsec; };
+
+    std::function<bool(const CanonPath & path)> walk;
+
+    walk = [&](const CanonPath & p) -> bool {
+        checkInterrupt();
+
+        auto physicalPath = path.accessor->getPhysicalPath(p);
+        if (!physicalPath) return false;
+
+        auto st = maybeLstat(physicalPath->string());
+        if (!st) return false;
+
+        if (st->st_mtime >= start - 1 || st->st_ctime >= start - 1) {
+            debug("not caching '%s' because it was modified too recently", path.accessor->showPath(p));
+            return false;
+        }
+
+        hashSink << p.abs()
+            << (uint64_t) st->st_dev << (uint64_t) st->st_ino
+            << (uint64_t) st->st_mode << (uint64_t) st->st_size
+            << (uint64_t) st->st_mtime << (uint64_t) st->st_ctime
+        #ifdef __APPLE__
+            << (uint64_t) nsec(st->st_mtimespec) << (uint64_t) nsec(st->st_ctimespec);
+        #else
+            << (uint64_t) nsec(st->st_mtim) << (uint64_t) nsec(st->st_ctim);
+        #endif
+
+        if (S_ISDIR(st->st_mode)) {
+            /* Use the accessor's view of the directory, since it may
+               hide some files (e.g. untracked files in a Git
+               working tree). */
+            for (auto & [name, type] : path.accessor->readDirectory(p)) {
+                /* `dumpPath()` filters on the unhacked names, so
+                   don't bother with this case. */
+                if (name.find(caseHackSuffix) != std::string::npos) return false;
+                if (!filter((p / name).abs())) continue;
+                if (!walk(p / name)) return false;
+            }
+        }
+
+        return true;
+    };
+
+    if (!walk(path.path)) return std::nullopt;
+
+    return "stat:" + hashSink.finish().first.to_string(HashFormat::Nix32, false);
+}
+
+#endif
+
 StorePath fetchToStore(
     Store & store,
     const SourcePath & path,
@@ -17,6 +90,21 @@ StorePath fetchToStore(
     // a `PosixSourceAccessor` pointing to a store path.
 
     std::optional<fetchers::Cache::Key> cacheKey;
+    fetchers::Attrs cacheValue;
+
+    /* The filter may be expensive (e.g. a Nix function), so remember
+       its result for every file we've already asked it about. */
+    std::unordered_map<std::string, bool> filterResults;
+
+    PathFilter filter2 = filter
+        ? PathFilter([&](const Path & p) {
+            auto i = filterResults.find(p);
+            if (i != filterResults.end()) return i->second;
+            auto res = (*filter)(p);
+            filterResults.emplace(p, res);
+            return res;
+        })
+        : defaultPathFilter;
 
     if (!filter && path.accessor->fingerprint) {
         cacheKey = fetchers::Cache::Key{"fetchToStore", {
@@ -29,14 +117,39 @@ StorePath fetchToStore(
             debug("store path cache hit for '%s'", path);
             return res->storePath;
         }
-    } else
+    }
+    #ifndef _WIN32
+    /* The accessor's contents are not immutable (e.g. a dirty Git
+       working tree or a `path:` flake), or we only copy a filtered
+       subset, so fall back to comparing file metadata. Note that the
+       fingerprint only covers the files that pass the filter. The
+       entry is keyed on the physical path rather than the
+       fingerprint, so that every change to the tree replaces the
+       previous entry instead of adding another one. */
+    else if (auto physicalPath = path.getPhysicalPath()) {
+        if (auto fingerprint = computeStatFingerprint(path, filter2)) {
+            cacheKey = fetchers::Cache::Key{"fetchToStoreStat", {
+                {"name", std::string{name}},
+                {"method", std::string{method.render()}},
+                {"physicalPath", physicalPath->string()}
+            }};
+            cacheValue.insert_or_assign("fingerprint", *fingerprint);
+            if (auto res = fetchers::getCache()->lookupStorePath(*cacheKey, store);
+                res && fetchers::maybeGetStrAttr(res->value, "fingerprint") == *fingerprint)
+            {
+                debug("store path cache hit for '%s'", path);
+                return res->storePath;
+            }
+        }
+    }
+    #endif
+
+    if (!cacheKey)
         debug("source path '%s' is uncacheable", path);
 
     Activity act(*logger, lvlChatty, actUnknown,
         fmt(mode == FetchMode::DryRun ? "hashing '%s'" : "copying '%s' to the store", path));
 
-    auto filter2 = filter ? *filter : defaultPathFilter;
-
     auto storePath =
         mode == FetchMode::DryRun
         ? store.computeStorePath(
@@ -47,7 +160,7 @@ StorePath fetchToStore(
     debug(mode == FetchMode::DryRun ? "hashed '%s'" : "copied '%s' to '%s'", path, store.printStorePath(storePath));
 
     if (cacheKey && mode == FetchMode::Copy)
-        fetchers::getCache()->upsert(*cacheKey, store, {}, storePath);
+        fetchers::getCache()->upsert(*cacheKey, store, cacheValue, storePath);
 
     return storePath;
 }
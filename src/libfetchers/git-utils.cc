@@ -7,6 +7,7 @@
 #include "users.hh"
 #include "fs-sink.hh"
 #include "sync.hh"
+#include "pathlocks.hh"
 
 #include <git2/attr.h>
 #include <git2/blob.h>
@@ -33,6 +34,8 @@
 #include <queue>
 #include <regex>
 #include <span>
+#include <mutex>
+#include <thread>
 
 namespace std {
 
@@ -256,6 +259,15 @@ struct GitRepoImpl : GitRepo, std::enable_shared_from_this<GitRepoImpl>
     void flush() override {
         checkInterrupt();
 
+        /* Objects are buffered in the in-memory pack of this
+           GitRepoImpl, so concurrent imports (e.g. of flake inputs
+           fetched by prefetchInputs()) each use their own. Only
+           writing them to the repository is serialised within this
+           process, like it is between processes by the atomic
+           creation of each packfile. */
+        static std::mutex flushMutex;
+        std::lock_guard<std::mutex> flushLock(flushMutex);
+
         git_buf buf = GIT_BUF_INIT;
         Finally _disposeBuf { [&] { git_buf_dispose(&buf); } };
         PackBuilder packBuilder;
@@ -309,6 +321,236 @@ struct GitRepoImpl : GitRepo, std::enable_shared_from_this<GitRepoImpl>
         checkInterrupt();
     }
 
+    /**
+     * Thresholds for `maybeRepack()`.
+     */
+    static constexpr size_t maxPacks = 32;
+    static constexpr size_t maxLooseObjects = 1024;
+
+    void maybeRepack(std::chrono::seconds gracePeriod) override
+    {
+        auto repoDir = std::filesystem::path(git_repository_path(repo.get()));
+        auto objectsDir = repoDir / "objects";
+        auto packDir = objectsDir / "pack";
+        auto supersededFile = repoDir / "nix-superseded";
+
+        /* Packfiles and loose objects that have been copied into a
+           new packfile, relative to `objectsDir`, with the time at
+           which that happened. They're only deleted after
+           `gracePeriod`, like `git gc` does, so that processes that
+           looked them up just before the repack can still read
+           them. */
+        auto readSuperseded = [&]()
+        {
+            std::map<std::string, time_t> superseded;
+            if (!pathExists(supersededFile.string())) return superseded;
+            for (auto & line : tokenizeString<std::vector<std::string>>(readFile(supersededFile.string()), "\n")) {
+                auto sp = line.find(' ');
+                if (sp == line.npos) continue;
+                if (auto time = string2Int<time_t>(line.substr(0, sp)))
+                    superseded.emplace(line.substr(sp + 1), *time);
+            }
+            return superseded;
+        };
+
+        auto writeSuperseded = [&](const std::map<std::string, time_t> & superseded)
+        {
+            std::string s;
+            for (auto & [name, time] : superseded)
+                s += fmt("%d %s\n", time, name);
+            auto tmpFile = supersededFile.string() + ".tmp";
+            writeFile(tmpFile, s);
+            std::filesystem::rename(tmpFile, supersededFile);
+        };
+
+        /* Returns the size of every packfile that is still in use. */
+        auto listPacks = [&](const std::map<std::string, time_t> & superseded)
+        {
+            std::map<std::string, uintmax_t> packs;
+            std::error_code ec;
+            for (auto & entry : std::filesystem::directory_iterator(packDir, ec)) {
+                auto name = entry.path().stem().string();
+                if (entry.path().extension() == ".pack" && !superseded.count("pack/" + name))
+                    packs.emplace(name, entry.file_size(ec));
+            }
+            return packs;
+        };
+
+        auto listLooseObjects = [&](const std::map<std::string, time_t> & superseded)
+        {
+            std::vector<std::string> objects;
+            std::error_code ec;
+            for (auto & dir : std::filesystem::directory_iterator(objectsDir, ec)) {
+                auto name = dir.path().filename().string();
+                if (name.size() != 2 || !isxdigit(name[0]) || !isxdigit(name[1])) continue;
+                for (auto & entry : std::filesystem::directory_iterator(dir.path(), ec)) {
+                    auto object = name + "/" + entry.path().filename().string();
+                    if (object.size() == 41 && !superseded.count(object))
+                        objects.push_back(object);
+                }
+            }
+            return objects;
+        };
+
+        auto now = time(nullptr);
+
+        auto hasExpired = [&](const std::map<std::string, time_t> & superseded)
+        {
+            return std::any_of(superseded.begin(), superseded.end(),
+                [&](const auto & i) { return i.second + gracePeriod.count() <= now; });
+        };
+
+        auto superseded = readSuperseded();
+
+        if (listPacks(superseded).size() <= maxPacks
+            && listLooseObjects(superseded).size() <= maxLooseObjects
+            && !hasExpired(superseded))
+            return;
+
+        /* Don't wait for another process that is already repacking. */
+        AutoCloseFD fdLock = openLockFile((repoDir / "nix-repack.lock").string(), true);
+        if (!lockFile(fdLock.get(), ltWrite, false)) return;
+
+        /* Another process may have repacked in the meantime. */
+        superseded = readSuperseded();
+
+        /* Delete what has been superseded for long enough. */
+        if (hasExpired(superseded)) {
+            std::error_code ec;
+            for (auto i = superseded.begin(); i != superseded.end(); ) {
+                if (i->second + gracePeriod.count() > now) { ++i; continue; }
+                if (hasPrefix(i->first, "pack/")) {
+                    for (auto ext : {".pack", ".idx", ".rev", ".mtimes", ".bitmap"})
+                        std::filesystem::remove(objectsDir / (i->first + ext), ec);
+                } else
+                    std::filesystem::remove(objectsDir / i->first, ec);
+                i = superseded.erase(i);
+            }
+            try {
+                writeSuperseded(superseded);
+            } catch (Error & e) {
+                warn("cannot prune Git repository %s: %s", path, e.msg());
+                return;
+            }
+        }
+
+        auto oldPacks = listPacks(superseded);
+        auto looseObjects = listLooseObjects(superseded);
+        if (oldPacks.size() <= maxPacks && looseObjects.size() <= maxLooseObjects) return;
+
+        /* Only combine the small packfiles, so that the cost of a
+           repack is proportional to the data written since the
+           previous one, rather than to the size of the repository.
+           A packfile is kept if it's at least twice as large as all
+           smaller packfiles together, so the large packfiles form a
+           geometric progression and there are only logarithmically
+           many of them. */
+        std::vector<std::pair<uintmax_t, std::string>> bySize;
+        for (auto & [pack, size] : oldPacks)
+            bySize.emplace_back(size, pack);
+        std::sort(bySize.begin(), bySize.end());
+
+        size_t nrSmallPacks = 0;
+        uintmax_t smallerSize = 0;
+        for (size_t i = 0; i < bySize.size(); ++i) {
+            if (bySize[i].first < 2 * smallerSize)
+                nrSmallPacks = i + 1;
+            smallerSize += bySize[i].first;
+        }
+
+        std::set<std::string> smallPacks;
+        for (size_t i = 0; i < nrSmallPacks; ++i)
+            if (!pathExists((packDir / (bySize[i].second + ".keep")).string()))
+                smallPacks.insert(bySize[i].second);
+
+        if (smallPacks.size() <= 1 && looseObjects.size() <= maxLooseObjects) return;
+
+        /* Failing to repack is not fatal, since the repository
+           remains valid. */
+        try {
+            Activity act(*logger, lvlTalkative, actUnknown, fmt("repacking Git repository %s", path));
+
+            ObjectDb odb;
+            if (git_repository_odb(Setter(odb), repo.get()))
+                throw Error("getting Git object database: %s", git_error_last()->message);
+
+            if (git_odb_refresh(odb.get()))
+                throw Error("refreshing Git object database: %s", git_error_last()->message);
+
+            /* An object database containing just the small packfiles,
+               to enumerate their objects. */
+            ObjectDb smallOdb;
+            if (git_odb_new(Setter(smallOdb)))
+                throw Error("creating Git object database: %s", git_error_last()->message);
+
+            for (auto & pack : smallPacks) {
+                git_odb_backend * backend;
+                if (git_odb_backend_one_pack(&backend, (packDir / (pack + ".idx")).string().c_str()))
+                    throw Error("opening Git packfile '%s': %s", pack, git_error_last()->message);
+                if (git_odb_add_backend(smallOdb.get(), backend, 1)) {
+                    backend->free(backend);
+                    throw Error("adding Git packfile '%s': %s", pack, git_error_last()->message);
+                }
+            }
+
+            PackBuilder packBuilder;
+            PackBuilderContext packBuilderContext;
+            if (git_packbuilder_new(Setter(packBuilder), *this))
+                throw Error("creating Git packfile builder: %s", git_error_last()->message);
+            git_packbuilder_set_callbacks(packBuilder.get(), PACKBUILDER_PROGRESS_CHECK_INTERRUPT, &packBuilderContext);
+            git_packbuilder_set_threads(packBuilder.get(), 0 /* autodetect */);
+
+            /* Objects that occur in several packfiles are only added
+               once by git_packbuilder_insert(). */
+            if (git_odb_foreach(smallOdb.get(),
+                    [](const git_oid * oid, void * payload)
+                    {
+                        return git_packbuilder_insert((git_packbuilder *) payload, oid, nullptr);
+                    },
+                    packBuilder.get()))
+                throw Error("listing Git objects: %s", git_error_last()->message);
+
+            for (auto & object : looseObjects) {
+                git_oid oid;
+                auto hex = object.substr(0, 2) + object.substr(3);
+                if (git_oid_fromstr(&oid, hex.c_str()))
+                    throw Error("parsing Git object ID '%s': %s", hex, git_error_last()->message);
+                if (git_packbuilder_insert(packBuilder.get(), &oid, nullptr))
+                    throw Error("adding Git object '%s' to packfile: %s", hex, git_error_last()->message);
+            }
+
+            checkInterrupt();
+
+            packBuilderContext.handleException(
+                "writing packfile",
+                git_packbuilder_write(packBuilder.get(), packDir.string().c_str(), 0, nullptr, nullptr)
+            );
+
+            /* Only retire the old packfiles if we actually wrote a new
+               one. Packfiles written concurrently by other processes
+               are not in `oldPacks`, so they're kept. */
+            auto newPacks = listPacks(superseded);
+            if (std::none_of(newPacks.begin(), newPacks.end(),
+                    [&](const auto & pack) { return !oldPacks.count(pack.first); }))
+                return;
+
+            /* Their objects are now in the new packfile, so they can
+               be deleted once the grace period has passed. */
+            for (auto & pack : smallPacks)
+                superseded.emplace("pack/" + pack, now);
+            for (auto & object : looseObjects)
+                superseded.emplace(object, now);
+            writeSuperseded(superseded);
+
+            git_odb_refresh(odb.get());
+
+            debug("repacked %d of %d packfiles and %d loose objects in %s",
+                smallPacks.size(), oldPacks.size(), looseObjects.size(), path);
+        } catch (Error & e) {
+            warn("cannot repack Git repository %s: %s", path, e.msg());
+        }
+    }
+
     uint64_t getRevCount(const Hash & rev) override
     {
         std::unordered_set<git_oid> done;
@@ -976,6 +1218,8 @@ struct GitFileSystemObjectSinkImpl : GitFileSystemObjectSink
 {
     ref<GitRepoImpl> repo;
 
+    static constexpr size_t maxBufferedBlobSize = 1024 * 1024;
+
     struct PendingDir
     {
         std::string name;
@@ -1070,19 +1314,39 @@ struct GitFileSystemObjectSinkImpl : GitFileSystemObjectSink
         auto pathComponents = tokenizeString<std::vector<std::string>>(path.rel(), "/");
         if (!prepareDirs(pathComponents, false)) return;
 
-        git_writestream * stream = nullptr;
-        if (git_blob_create_from_stream(&stream, *repo, nullptr))
-            throw Error("creating a blob stream object: %s", git_error_last()->message);
-
+        /* Small files are accumulated in memory and written to the
+           object database directly. Only large files are streamed,
+           since libgit2 streams blobs via a temporary file, which is
+           expensive for the tens of thousands of small files in a
+           typical source tarball. */
         struct CRF : CreateRegularFileSink {
             const CanonPath & path;
             GitFileSystemObjectSinkImpl & back;
-            git_writestream * stream;
+            git_writestream * stream = nullptr;
+            std::string buffer;
             bool executable = false;
-            CRF(const CanonPath & path, GitFileSystemObjectSinkImpl & back, git_writestream * stream)
-                : path(path), back(back), stream(stream)
+            CRF(const CanonPath & path, GitFileSystemObjectSinkImpl & back)
+                : path(path), back(back)
             {}
+            ~CRF()
+            {
+                if (stream) stream->free(stream);
+            }
             void operator () (std::string_view data) override
+            {
+                if (!stream && buffer.size() + data.size() <= maxBufferedBlobSize) {
+                    buffer.append(data);
+                    return;
+                }
+                if (!stream) {
+                    if (git_blob_create_from_stream(&stream, *back.repo, nullptr))
+                        throw Error("creating a blob stream object: %s", git_error_last()->message);
+                    write(buffer);
+                    buffer.clear();
+                }
+                write(data);
+            }
+            void write(std::string_view data)
             {
                 if (stream->write(stream, data.data(), data.size()))
                     throw Error("writing a blob for tarball member '%s': %s", path, git_error_last()->message);
@@ -1091,12 +1355,25 @@ struct GitFileSystemObjectSinkImpl : GitFileSystemObjectSink
             {
                 executable = true;
             }
-        } crf { path, *this, stream };
+            void preallocateContents(uint64_t size) override
+            {
+                if (size <= maxBufferedBlobSize)
+                    buffer.reserve(size);
+            }
+        } crf { path, *this };
         func(crf);
 
         git_oid oid;
-        if (git_blob_create_from_stream_commit(&oid, stream))
-            throw Error("creating a blob object for tarball member '%s': %s", path, git_error_last()->message);
+        if (crf.stream) {
+            /* git_blob_create_from_stream_commit() frees the stream. */
+            auto stream = crf.stream;
+            crf.stream = nullptr;
+            if (git_blob_create_from_stream_commit(&oid, stream))
+                throw Error("creating a blob object for tarball member '%s': %s", path, git_error_last()->message);
+        } else {
+            if (git_blob_create_from_buffer(&oid, *repo, crf.buffer.data(), crf.buffer.size()))
+                throw Error("creating a blob object for tarball member '%s': %s", path, git_error_last()->message);
+        }
 
         addToTree(*pathComponents.rbegin(), oid,
             crf.executable
@@ -1272,6 +1549,58 @@ ref<GitRepo> getTarballCache()
     return GitRepo::openRepo(repoDir, true, true);
 }
 
+void repackTarballCacheInBackground()
+{
+    struct State
+    {
+        bool running = false;
+        /* Whether more was written while the repack was running. */
+        bool again = false;
+        std::thread thread;
+    };
+
+    struct Repacker
+    {
+        Sync<State> state;
+
+        ~Repacker()
+        {
+            auto thread = std::move(state.lock()->thread);
+            if (thread.joinable()) thread.join();
+        }
+    };
+
+    static Repacker repacker;
+
+    auto state(repacker.state.lock());
+
+    if (state->running) {
+        state->again = true;
+        return;
+    }
+
+    if (state->thread.joinable()) state->thread.join();
+
+    state->running = true;
+    state->thread = std::thread([]() {
+        while (true) {
+            try {
+                getTarballCache()->maybeRepack();
+            } catch (Interrupted &) {
+                /* We're exiting. */
+            } catch (...) {
+                ignoreExceptionExceptInterrupt();
+            }
+            auto state(repacker.state.lock());
+            if (!state->again) {
+                state->running = false;
+                break;
+            }
+            state->again = false;
+        }
+    });
+}
+
 GitRepo::WorkdirInfo GitRepo::getCachedWorkdirInfo(const std::filesystem::path & path)
 {
     static Sync<std::map<std::filesystem::path, WorkdirInfo>> _cache;
@@ -3,6 +3,8 @@
 #include "filtering-source-accessor.hh"
 #include "fs-sink.hh"
 
+#include <chrono>
+
 namespace nix {
 
 namespace fetchers { struct PublicKey; }
@@ -98,6 +100,23 @@ struct GitRepo
 
     virtual void flush() = 0;
 
+    /**
+     * If `flush()` has created many packfiles, or the repository
+     * contains many loose objects, combine the loose objects and the
+     * small packfiles into a single packfile. This keeps repositories
+     * that are written to often (like the tarball cache) fast to open
+     * and small, since objects in the same packfile can be stored as
+     * deltas of each other. Packfiles that are at least twice as large
+     * as all smaller ones together are left alone, so the cost of a
+     * repack doesn't grow with the size of the repository.
+     *
+     * The packfiles and loose objects that were combined are only
+     * deleted by a later call, once they have been superseded for
+     * `gracePeriod`, since concurrent readers may still be about to
+     * open them.
+     */
+    virtual void maybeRepack(std::chrono::seconds gracePeriod = std::chrono::hours(1)) = 0;
+
     virtual void fetch(
         const std::string & url,
         const std::string & refspec,
@@ -127,6 +146,13 @@ struct GitRepo
 
 ref<GitRepo> getTarballCache();
 
+/**
+ * Call `maybeRepack()` on the tarball cache in a background thread,
+ * so that fetches don't have to wait for it. The process waits for it
+ * to finish before exiting.
+ */
+void repackTarballCacheInBackground();
+
 // A helper to ensure that the `git_*_free` functions get called.
 template<auto del>
 struct Deleter
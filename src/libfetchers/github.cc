@@ -298,6 +298,7 @@ struct GitArchiveInputScheme : InputScheme
         auto parseSink = tarballCache->getFileSystemObjectSink();
         auto lastModified = unpackTarfileToSink(archive, *parseSink);
         auto tree = parseSink->flush();
+        repackTarballCacheInBackground();
 
         act.reset();
 
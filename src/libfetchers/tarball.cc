@@ -5,6 +5,7 @@
 #include "store-api.hh"
 #include "archive.hh"
 #include "tarfile.hh"
+#include "compression.hh"
 #include "types.hh"
 #include "store-path-accessor.hh"
 #include "store-api.hh"
@@ -133,14 +134,21 @@ static DownloadTarballResult downloadTarball_(
 
     auto _res = std::make_shared<Sync<FileTransferResult>>();
 
+    auto isZip = hasSuffix(toLower(parseURL(url).path), ".zip");
+
     auto source = sinkToSource([&](Sink & sink) {
         FileTransferRequest req(url);
         req.expectedETag = cached ? getStrAttr(cached->value, "etag") : "";
-        getFileTransfer()->download(std::move(req), sink,
+        /* Decompress tarballs on a separate thread, so that
+           downloading, decompressing and importing into the Git
+           cache all happen concurrently. */
+        auto decompressor = isZip ? nullptr : makeAutoDecompressionSink(sink);
+        getFileTransfer()->download(std::move(req), decompressor ? (Sink &) *decompressor : sink,
             [_res](FileTransferResult r)
             {
                 *_res->lock() = r;
             });
+        if (decompressor) decompressor->finish();
     });
 
     // TODO: fall back to cached value if download fails.
@@ -153,7 +161,7 @@ static DownloadTarballResult downloadTarball_(
     /* Note: if the download is cached, `importTarball()` will receive
        no data, which causes it to import an empty tarball. */
     auto archive =
-        hasSuffix(toLower(parseURL(url).path), ".zip")
+        isZip
         ? ({
                 /* In streaming mode, libarchive doesn't handle
                    symlinks in zip files correctly (#10649). So write
@@ -173,6 +181,7 @@ static DownloadTarballResult downloadTarball_(
     auto parseSink = tarballCache->getFileSystemObjectSink();
     auto lastModified = unpackTarfileToSink(archive, *parseSink);
     auto tree = parseSink->flush();
+    repackTarballCacheInBackground();
 
     act.reset();
 
@@ -13,9 +13,12 @@
 #include "value-to-json.hh"
 #include "local-fs-store.hh"
 #include "fetch-to-store.hh"
+#include "thread-pool.hh"
 
 #include <nlohmann/json.hpp>
 
+#include <future>
+
 namespace nix {
 
 using namespace flake;
@@ -28,14 +31,23 @@ struct FetchedFlake
     ref<SourceAccessor> accessor;
 };
 
-typedef std::map<FlakeRef, FetchedFlake> FlakeCache;
+struct FlakeCache
+{
+    std::map<FlakeRef, FetchedFlake> fetched;
+
+    /**
+     * Fetches of direct flake references that were done concurrently
+     * by prefetchInputs() and haven't been used yet.
+     */
+    std::map<FlakeRef, std::future<FetchedFlake>> prefetched;
+};
 
 static std::optional<FetchedFlake> lookupInFlakeCache(
     const FlakeCache & flakeCache,
     const FlakeRef & flakeRef)
 {
-    auto i = flakeCache.find(flakeRef);
-    if (i == flakeCache.end()) return std::nullopt;
+    auto i = flakeCache.fetched.find(flakeRef);
+    if (i == flakeCache.fetched.end()) return std::nullopt;
     debug("mapping '%s' to previously seen input '%s' -> '%s",
         flakeRef, i->first, i->second.lockedRef);
     return i->second;
@@ -51,7 +63,13 @@ static std::tuple<ref<SourceAccessor>, FlakeRef, FlakeRef> fetchOrSubstituteTree
     FlakeRef resolvedRef = originalRef;
 
     if (!fetched) {
-        if (originalRef.input.isDirect()) {
+        if (auto i = flakeCache.prefetched.find(originalRef); i != flakeCache.prefetched.end()) {
+            /* This rethrows any error from the fetch, as if we had
+               done it here. */
+            auto result = std::move(i->second);
+            flakeCache.prefetched.erase(i);
+            fetched.emplace(result.get());
+        } else if (originalRef.input.isDirect()) {
             auto [accessor, lockedRef] = originalRef.lazyFetch(state.store);
             fetched.emplace(FetchedFlake{.lockedRef = lockedRef, .accessor = accessor});
         } else {
@@ -68,13 +86,13 @@ static std::tuple<ref<SourceAccessor>, FlakeRef, FlakeRef> fetchOrSubstituteTree
                     auto [accessor, lockedRef] = resolvedRef.lazyFetch(state.store);
                     fetched.emplace(FetchedFlake{.lockedRef = lockedRef, .accessor = accessor});
                 }
-                flakeCache.insert_or_assign(resolvedRef, *fetched);
+                flakeCache.fetched.insert_or_assign(resolvedRef, *fetched);
             }
             else {
                 throw Error("'%s' is an indirect flake reference, but registry lookups are not allowed", originalRef);
             }
         }
-        flakeCache.insert_or_assign(originalRef, *fetched);
+        flakeCache.fetched.insert_or_assign(originalRef, *fetched);
     }
 
     debug("got tree '%s' from '%s'", fetched->accessor, fetched->lockedRef);
@@ -82,6 +100,53 @@ static std::tuple<ref<SourceAccessor>, FlakeRef, FlakeRef> fetchOrSubstituteTree
     return {fetched->accessor, resolvedRef, fetched->lockedRef};
 }
 
+/**
+ * Fetch the given direct flake references concurrently, and record the
+ * results in `flakeCache` for fetchOrSubstituteTree(). Errors are
+ * recorded as well, and are thrown when the result is used.
+ */
+static void prefetchInputs(
+    EvalState & state,
+    FlakeCache & flakeCache,
+    const std::set<FlakeRef> & refs)
+{
+    std::map<FlakeRef, std::promise<FetchedFlake>> promises;
+
+    for (auto & ref : refs)
+        if (!flakeCache.fetched.count(ref) && !flakeCache.prefetched.count(ref))
+            promises[ref];
+
+    /* There is nothing to gain from fetching a single input in
+       another thread. */
+    if (promises.size() < 2) return;
+
+    debug("fetching %d flake inputs concurrently", promises.size());
+
+    /* This is safe for inputs that are imported into the tarball
+       cache: every fetch opens its own GitRepo and builds the
+       objects in memory, and writing them to disk is serialised (see
+       GitRepoImpl::flush()). */
+
+    {
+        ThreadPool pool;
+
+        for (auto & [ref, promise] : promises)
+            pool.enqueue([&state, &ref, &promise]() {
+                try {
+                    auto [accessor, lockedRef] = ref.lazyFetch(state.store);
+                    promise.set_value(FetchedFlake{.lockedRef = lockedRef, .accessor = accessor});
+                } catch (...) {
+                    promise.set_exception(std::current_exception());
+                }
+            });
+
+        pool.process();
+    }
+
+    for (auto & [ref, promise] : promises)
+        flakeCache.prefetched.emplace(ref, promise.get_future());
+}
+
 static StorePath copyInputToStore(
     EvalState & state,
     fetchers::Input & input,
@@ -564,6 +629,46 @@ LockedFlake lockFlake(
                         printInputAttrPath(inputAttrPathPrefix), follow);
             }
 
+            /* Fetch the inputs that the loop below will fetch
+               concurrently. This only fills `flakeCache`, and the loop
+               still processes the inputs in order, so the resulting
+               lock file is the same as when fetching them one at a
+               time. The conditions below mirror those in the loop; if
+               they diverge, we only do some unnecessary or sequential
+               fetching. */
+            {
+                std::set<FlakeRef> toFetch;
+
+                for (auto & [id, input2] : flakeInputs) {
+                    auto inputAttrPath(inputAttrPathPrefix);
+                    inputAttrPath.push_back(id);
+
+                    auto i = overrides.find(inputAttrPath);
+                    auto & input = i != overrides.end() ? i->second.input : input2;
+
+                    if (input.follows
+                        || !input.ref
+                        || input.ref->input.isRelative()
+                        || !input.ref->input.isDirect()
+                        || (!lockFlags.allowUnlocked && !input.ref->input.isLocked()))
+                        continue;
+
+                    /* Skip inputs that will be copied from the old
+                       lock file. */
+                    if (oldNode && !lockFlags.inputUpdates.count(inputAttrPath))
+                        if (auto oldLock = get(oldNode->inputs, id))
+                            if (auto oldLock2 = std::get_if<0>(&*oldLock))
+                                if ((*oldLock2)->originalRef == *input.ref
+                                    && !(*oldLock2)->parentInputAttrPath
+                                    && !explicitCliOverrides.contains(inputAttrPath))
+                                    continue;
+
+                    toFetch.insert(*input.ref);
+                }
+
+                prefetchInputs(state, flakeCache, toFetch);
+            }
+
             /* Go over the flake inputs, resolve/fetch them if
                necessary (i.e. if they're new or the flakeref changed
                from what's in the lock file). */
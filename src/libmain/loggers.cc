@@ -6,6 +6,11 @@ namespace nix {
 
 LogFormat defaultLogFormat = LogFormat::raw;
 
+/**
+ * The trace file that the current logger writes to, if any.
+ */
+static std::optional<Path> activeTraceFile;
+
 LogFormat parseLogFormat(const std::string & logFormatStr)
 {
     if (logFormatStr == "raw" || getEnv("NIX_GET_COMPLETIONS"))
@@ -21,7 +26,7 @@ LogFormat parseLogFormat(const std::string & logFormatStr)
     throw Error("option 'log-format' has an invalid value '%s'", logFormatStr);
 }
 
-std::unique_ptr<Logger> makeDefaultLogger()
+static std::unique_ptr<Logger> makeBaseLogger()
 {
     switch (defaultLogFormat) {
     case LogFormat::raw:
@@ -42,6 +47,17 @@ std::unique_ptr<Logger> makeDefaultLogger()
     }
 }
 
+std::unique_ptr<Logger> makeDefaultLogger()
+{
+    auto logger = makeBaseLogger();
+    activeTraceFile.reset();
+    if (auto & path = loggerSettings.activityTraceFile.get(); !path.empty()) {
+        logger = makeTraceLogger(std::move(logger), path);
+        activeTraceFile = path;
+    }
+    return logger;
+}
+
 void setLogFormat(const std::string & logFormatStr)
 {
     setLogFormat(parseLogFormat(logFormatStr));
@@ -53,4 +69,12 @@ void setLogFormat(const LogFormat & logFormat)
     logger = makeDefaultLogger();
 }
 
+void applyActivityTraceFile()
+{
+    auto & path = loggerSettings.activityTraceFile.get();
+    if (path.empty() || activeTraceFile == path) return;
+    logger = makeTraceLogger(std::move(logger), path);
+    activeTraceFile = path;
+}
+
 }
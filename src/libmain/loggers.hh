@@ -16,4 +16,11 @@ enum class LogFormat {
 void setLogFormat(const std::string & logFormatStr);
 void setLogFormat(const LogFormat & logFormat);
 
+/**
+ * Start writing a trace of all activities to the file specified by
+ * the `activity-trace-file` setting, if it's set. This must be called
+ * after the command line and configuration have been processed.
+ */
+void applyActivityTraceFile();
+
 }
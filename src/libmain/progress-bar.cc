@@ -76,6 +76,14 @@ private:
         size_t suspensions = 0;
         bool haveUpdate = true;
 
+        /**
+         * Build log lines (with `--print-build-logs`) that haven't
+         * been written yet. The update thread writes them once per
+         * frame, rather than erasing and redrawing the status line
+         * for every line.
+         */
+        std::string pendingLogLines;
+
         bool isPaused() const
         {
             return suspensions > 0;
@@ -94,6 +102,17 @@ private:
     bool printBuildLogs = false;
     bool isTTY;
 
+    /**
+     * Minimum time between redraws of the status line.
+     */
+    static constexpr auto frameInterval = std::chrono::milliseconds(50);
+
+    /**
+     * Write the pending build log lines before this many bytes have
+     * accumulated, even if the update thread didn't get to it yet.
+     */
+    static constexpr size_t maxPendingLogLines = 64 * 1024;
+
 public:
 
     ProgressBar(bool isTTY)
@@ -107,7 +126,7 @@ public:
                 if (!state->haveUpdate)
                     state.wait_for(updateCV, nextWakeup);
                 nextWakeup = draw(*state);
-                state.wait_for(quitCV, std::chrono::milliseconds(50));
+                state.wait_for(quitCV, frameInterval);
             }
         });
     }
@@ -123,8 +142,8 @@ public:
         {
             auto state(state_.lock());
             if (state->active) {
+                writeLogLines(*state);
                 state->active = false;
-                writeToStderr("\r\e[K");
                 updateCV.notify_one();
                 quitCV.notify_one();
             }
@@ -142,7 +161,7 @@ public:
         }
 
         if (state->active)
-            writeToStderr("\r\e[K");
+            writeLogLines(*state);
     }
 
     void resume() override {
@@ -155,9 +174,8 @@ public:
         }
         if (state->suspensions == 0) {
             if (state->active)
-                writeToStderr("\r\e[K");
-            state->haveUpdate = true;
-            updateCV.notify_one();
+                writeLogLines(*state);
+            update(*state);
         }
     }
 
@@ -166,40 +184,68 @@ public:
         return printBuildLogs;
     }
 
+    /* Note: messages are filtered before taking the lock, so that
+       threads that log a lot don't serialise on it. */
+
     void log(Verbosity lvl, std::string_view s) override
     {
         if (lvl > verbosity) return;
+        auto line = filterANSIEscapes(s, !isTTY);
         auto state(state_.lock());
-        log(*state, lvl, s);
+        writeLine(*state, line);
     }
 
     void logEI(const ErrorInfo & ei) override
     {
-        auto state(state_.lock());
-
         std::ostringstream oss;
         showErrorInfo(oss, ei, loggerSettings.showTrace.get());
 
-        log(*state, ei.level, toView(oss));
+        auto line = filterANSIEscapes(toView(oss), !isTTY);
+        auto state(state_.lock());
+        writeLine(*state, line);
     }
 
-    void log(State & state, Verbosity lvl, std::string_view s)
+    /**
+     * Write a filtered line. The status line is redrawn by the update
+     * thread at its next frame.
+     */
+    void writeLine(State & state, const std::string & line)
     {
         if (state.active) {
-            writeToStderr("\r\e[K" + filterANSIEscapes(s, !isTTY) + ANSI_NORMAL "\n");
-            draw(state);
+            writeLogLines(state, line + ANSI_NORMAL "\n");
+            update(state);
         } else {
-            writeToStderr(filterANSIEscapes(s, !isTTY) + "\n");
+            writeToStderr(line + "\n");
         }
     }
 
+    /**
+     * Erase the status line and write the pending build log lines,
+     * followed by `s`.
+     */
+    void writeLogLines(State & state, std::string_view s = "")
+    {
+        std::string out = "\r\e[K";
+        out += state.pendingLogLines;
+        out += s;
+        writeToStderr(out);
+        state.pendingLogLines.clear();
+        /* The status line is gone, so make sure it is redrawn even
+           if it didn't change. */
+        lastOutput_.lock()->clear();
+    }
+
     void startActivity(ActivityId act, Verbosity lvl, ActivityType type,
         const std::string & s, const Fields & fields, ActivityId parent) override
     {
+        std::optional<std::string> line;
+        if (lvl <= verbosity && !s.empty() && type != actBuildWaiting)
+            line = filterANSIEscapes(s + "...", !isTTY);
+
         auto state(state_.lock());
 
-        if (lvl <= verbosity && !s.empty() && type != actBuildWaiting)
-            log(*state, lvl, s + "...");
+        if (line)
+            writeLine(*state, *line);
 
         state->activities.emplace_back(ActInfo {
             .s = s,
@@ -296,6 +342,11 @@ public:
 
     void result(ActivityId act, ResultType type, const std::vector<Field> & fields) override
     {
+        if (type == resBuildLogLine || type == resPostBuildLogLine) {
+            logBuildLine(act, type, getS(fields, 0));
+            return;
+        }
+
         auto state(state_.lock());
 
         if (type == resFileLinked) {
@@ -304,26 +355,6 @@ public:
             update(*state);
         }
 
-        else if (type == resBuildLogLine || type == resPostBuildLogLine) {
-            auto lastLine = chomp(getS(fields, 0));
-            auto i = state->its.find(act);
-            assert(i != state->its.end());
-            ActInfo info = *i->second;
-            if (printBuildLogs) {
-                auto suffix = "> ";
-                if (type == resPostBuildLogLine) {
-                    suffix = " (post)> ";
-                }
-                log(*state, lvlInfo, ANSI_FAINT + info.name.value_or("unnamed") + suffix + ANSI_NORMAL + lastLine);
-            } else {
-                state->activities.erase(i->second);
-                info.lastLine = lastLine;
-                state->activities.emplace_back(info);
-                i->second = std::prev(state->activities.end());
-                update(*state);
-            }
-        }
-
         else if (type == resUntrustedPath) {
             state->untrustedPaths++;
             update(*state);
@@ -373,8 +404,57 @@ public:
         }
     }
 
+    /**
+     * Handle a line of build output. This is the hot path during
+     * builds that produce a lot of output, so it does as little as
+     * possible while holding the lock.
+     */
+    void logBuildLine(ActivityId act, ResultType type, std::string_view s)
+    {
+        std::optional<std::string> name;
+
+        {
+            auto state(state_.lock());
+            auto i = state->its.find(act);
+            assert(i != state->its.end());
+
+            if (!printBuildLogs) {
+                /* Only the last line is shown, so successive lines
+                   just overwrite each other until the next frame.
+                   Move the activity to the end of the list, making it
+                   the one that is shown. Splicing keeps the iterators
+                   in `its` and `activitiesByType` valid. */
+                i->second->lastLine = chomp(s);
+                state->activities.splice(state->activities.end(), state->activities, i->second);
+                update(*state);
+                return;
+            }
+
+            name = i->second->name;
+        }
+
+        auto line = filterANSIEscapes(
+            ANSI_FAINT + name.value_or("unnamed")
+            + (type == resPostBuildLogLine ? " (post)> " : "> ")
+            + ANSI_NORMAL + chomp(s),
+            !isTTY);
+
+        auto state(state_.lock());
+        if (state->active) {
+            state->pendingLogLines += line;
+            state->pendingLogLines += ANSI_NORMAL "\n";
+            if (state->pendingLogLines.size() >= maxPendingLogLines)
+                writeLogLines(*state);
+            update(*state);
+        } else
+            writeToStderr(line + "\n");
+    }
+
     void update(State & state)
     {
+        /* Only wake up the update thread for the first change since
+           the last frame; it picks up the others at the same time. */
+        if (state.haveUpdate) return;
         state.haveUpdate = true;
         updateCV.notify_one();
     }
@@ -400,6 +480,10 @@ public:
         auto nextWakeup = std::chrono::milliseconds::max();
 
         state.haveUpdate = false;
+
+        if (state.active && !state.pendingLogLines.empty())
+            writeLogLines(state);
+
         if (state.isPaused() || !state.active) return nextWakeup;
 
         std::string line;
@@ -547,7 +631,7 @@ public:
     {
         auto state(state_.lock());
         if (state->active) {
-            std::cerr << "\r\e[K";
+            writeLogLines(*state);
             Logger::writeToStdout(s);
             draw(*state);
         } else {
@@ -559,7 +643,7 @@ public:
     {
         auto state(state_.lock());
         if (!state->active) return {};
-        std::cerr << fmt("\r\e[K%s ", msg);
+        writeLogLines(*state, fmt("%s ", msg));
         auto s = trim(readLine(getStandardInput(), true));
         if (s.size() != 1) return {};
         draw(*state);
@@ -0,0 +1,166 @@
+#include <gtest/gtest.h>
+
+#include "build-log.hh"
+#include "file-system.hh"
+#include "hash.hh"
+
+#include <thread>
+
+namespace nix {
+
+static std::string makeLog(size_t lines)
+{
+    std::string log;
+    for (size_t i = 0; i < lines; ++i)
+        log += fmt("line %d of the build log, padded to make it a bit longer\n", i);
+    return log;
+}
+
+/**
+ * A log that doesn't compress as well, so that its frames are larger
+ * than the read-ahead of ranged reads.
+ */
+static std::string makeHashLog(size_t lines)
+{
+    std::string log;
+    for (size_t i = 0; i < lines; ++i)
+        log += hashString(HashAlgorithm::SHA256, std::to_string(i)).to_string(HashFormat::Base16, false) + "\n";
+    return log;
+}
+
+static std::string read(std::string_view data, const BuildLogFilter & filter = {})
+{
+    StringSink sink;
+    readIndexedBuildLog(data, filter, sink);
+    return std::move(sink.s);
+}
+
+static std::string filter(std::string_view log, const BuildLogFilter & filter)
+{
+    StringSink sink;
+    filterBuildLog(log, filter, sink);
+    return std::move(sink.s);
+}
+
+TEST(BuildLog, roundTrip)
+{
+    /* Large enough to need several frames. */
+    auto log = makeLog(30000);
+    auto compressed = compressBuildLog(log);
+    ASSERT_TRUE(isIndexedBuildLog(compressed));
+    ASSERT_LT(compressed.size(), log.size());
+    ASSERT_EQ(read(compressed), log);
+}
+
+TEST(BuildLog, empty)
+{
+    auto compressed = compressBuildLog("");
+    ASSERT_TRUE(isIndexedBuildLog(compressed));
+    ASSERT_EQ(read(compressed), "");
+    ASSERT_EQ(read(compressed, {.tail = 10}), "");
+}
+
+TEST(BuildLog, notIndexed)
+{
+    ASSERT_FALSE(isIndexedBuildLog(""));
+    ASSERT_FALSE(isIndexedBuildLog("line 1\nline 2\n"));
+}
+
+TEST(BuildLog, unterminatedLastLine)
+{
+    std::string log = "foo\nbar\nbaz";
+    auto compressed = compressBuildLog(log);
+    ASSERT_EQ(read(compressed), log);
+    ASSERT_EQ(read(compressed, {.tail = 2}), "bar\nbaz");
+}
+
+TEST(BuildLog, tail)
+{
+    auto log = makeLog(30000);
+    auto compressed = compressBuildLog(log);
+    ASSERT_EQ(read(compressed, {.tail = 0}), "");
+    ASSERT_EQ(read(compressed, {.tail = 1}), "line 29999 of the build log, padded to make it a bit longer\n");
+    ASSERT_EQ(read(compressed, {.tail = 15000}), makeLog(30000).substr(makeLog(15000).size()));
+    ASSERT_EQ(read(compressed, {.tail = 1000000}), log);
+}
+
+TEST(BuildLog, grep)
+{
+    auto log = makeLog(30000);
+    auto compressed = compressBuildLog(log);
+    std::regex re("line 2999[0-9] ");
+    auto expected = filter(log, {.grep = re});
+    ASSERT_EQ(std::count(expected.begin(), expected.end(), '\n'), 10);
+    ASSERT_EQ(read(compressed, {.grep = re}), expected);
+    ASSERT_EQ(read(compressed, {.grep = re, .tail = 2}),
+        "line 29998 of the build log, padded to make it a bit longer\n"
+        "line 29999 of the build log, padded to make it a bit longer\n");
+}
+
+TEST(BuildLog, truncated)
+{
+    /* A log that is still being written lacks the end marker (the
+       last 24 bytes) and may end in the middle of a frame. The
+       complete frames are still readable. */
+    auto first = compressBuildLog(makeLog(1000));
+    auto second = compressBuildLog(makeLog(2000));
+    auto partial = first.substr(0, first.size() - 24) + second.substr(0, second.size() / 2);
+    ASSERT_TRUE(isIndexedBuildLog(partial));
+    ASSERT_EQ(read(partial), makeLog(1000));
+    ASSERT_EQ(read(partial, {.tail = 1}), "line 999 of the build log, padded to make it a bit longer\n");
+}
+
+TEST(BuildLog, rangedTail)
+{
+    auto log = makeHashLog(100000);
+    auto compressed = compressBuildLog(log);
+
+    /* Only the frame headers and the last frame need to be read. */
+    size_t bytesRead = 0;
+    StringSink sink;
+    readIndexedBuildLog(compressed.size(),
+        [&](uint64_t offset, size_t len) {
+            bytesRead += len;
+            return compressed.substr(offset, len);
+        },
+        {.tail = 2}, sink);
+    ASSERT_EQ(sink.s, log.substr(log.size() - 2 * 65));
+    ASSERT_LT(bytesRead, compressed.size() / 2);
+}
+
+TEST(BuildLog, compact)
+{
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    auto path = tmpDir + "/log.zst";
+
+    /* Simulate a build that pauses between two lines, so that the
+       first one is written as a frame of its own. */
+    StringSink ssink;
+    auto sink = makeBuildLogSink(ssink, true);
+    (*sink)("foo\n");
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    (*sink)("bar\n");
+    sink->finish();
+    writeFile(path, ssink.s);
+
+    compactBuildLogFile(path);
+    auto compacted = readFile(path);
+    ASSERT_LT(compacted.size(), ssink.s.size());
+    ASSERT_EQ(compacted, compressBuildLog("foo\nbar\n"));
+
+    /* A log without small frames is left alone. */
+    compactBuildLogFile(path);
+    ASSERT_EQ(readFile(path), compacted);
+}
+
+TEST(BuildLog, filterUncompressed)
+{
+    std::string log = "foo\nbar\nbaz\n";
+    ASSERT_EQ(filter(log, {}), log);
+    ASSERT_EQ(filter(log, {.tail = 2}), "bar\nbaz\n");
+    ASSERT_EQ(filter(log, {.grep = std::regex("ba")}), "bar\nbaz\n");
+    ASSERT_EQ(filter(log, {.grep = std::regex("ba"), .tail = 1}), "baz\n");
+}
+
+}
@@ -1,6 +1,8 @@
 #include "archive.hh"
 #include "binary-cache-store.hh"
+#include "chunking.hh"
 #include "compression.hh"
+#include "build-log.hh"
 #include "derivations.hh"
 #include "source-accessor.hh"
 #include "globals.hh"
@@ -13,6 +15,7 @@
 #include "callback.hh"
 #include "signals.hh"
 #include "archive.hh"
+#include "users.hh"
 
 #include <chrono>
 #include <future>
@@ -37,6 +40,24 @@ BinaryCacheStore::BinaryCacheStore(const Params & params)
     narMagic = sink.s;
 }
 
+/* The path index is a header line followed by the sorted 64-bit
+   keys of all store paths in the binary cache, in little-endian
+   order. A key collision only causes a .narinfo lookup, so 64 bits
+   are plenty. */
+static const std::string pathIndexMagic = "nix-path-index-1\n";
+
+static std::optional<std::string> pathIndexNameFromCacheInfo(const std::string & cacheInfo)
+{
+    for (auto & line : tokenizeString<Strings>(cacheInfo, "\n")) {
+        size_t colon = line.find(':');
+        if (colon == std::string::npos || line.substr(0, colon) != "PathIndex") continue;
+        auto value = trim(line.substr(colon + 1, std::string::npos));
+        if (value != "" && value.find('/') == std::string::npos && value.find('.') != 0)
+            return value;
+    }
+    return std::nullopt;
+}
+
 void BinaryCacheStore::init()
 {
     auto cacheInfo = getNixCacheInfo();
@@ -59,6 +80,10 @@ void BinaryCacheStore::init()
             }
         }
     }
+
+    auto pathIndex(pathIndex_.lock());
+    pathIndex->name = cacheInfo ? pathIndexNameFromCacheInfo(*cacheInfo) : std::nullopt;
+    pathIndex->haveName = true;
 }
 
 std::optional<std::string> BinaryCacheStore::getNixCacheInfo()
@@ -106,31 +131,294 @@ std::optional<std::string> BinaryCacheStore::getFile(const std::string & path)
     return std::move(sink.s);
 }
 
+std::optional<BinaryCacheStore::FileRange> BinaryCacheStore::getFileRange(
+    const std::string & path, uint64_t offset, size_t length)
+{
+    auto data = getFile(path);
+    if (!data) return std::nullopt;
+    auto size = data->size();
+    return FileRange {
+        .data = offset < size ? data->substr(offset, length) : "",
+        .fileSize = size,
+    };
+}
+
+static std::optional<std::vector<uint64_t>> parsePathIndex(std::string_view data)
+{
+    if (!data.starts_with(pathIndexMagic)) return std::nullopt;
+    data.remove_prefix(pathIndexMagic.size());
+    if (data.size() % sizeof(uint64_t)) return std::nullopt;
+    std::vector<uint64_t> keys;
+    keys.reserve(data.size() / sizeof(uint64_t));
+    for (size_t pos = 0; pos < data.size(); pos += sizeof(uint64_t))
+        keys.push_back(readLittleEndian<uint64_t>((unsigned char *) data.data() + pos));
+    if (!std::is_sorted(keys.begin(), keys.end())) return std::nullopt;
+    return keys;
+}
+
+uint64_t BinaryCacheStore::pathIndexKey(std::string_view hashPart)
+{
+    auto hash = Hash::parseNonSRIUnprefixed(hashPart, HashAlgorithm::SHA1);
+    uint64_t key = 0;
+    for (size_t n = 0; n < sizeof(key); ++n)
+        key |= (uint64_t) hash.hash[n] << (n * 8);
+    return key;
+}
+
+void BinaryCacheStore::loadPathIndex(PathIndex & pathIndex)
+{
+    pathIndex.loaded = true;
+    pathIndex.loadedAt = time(nullptr);
+    pathIndex.keys.reset();
+
+    if (!pathIndex.haveName) {
+        try {
+            if (auto cacheInfo = getNixCacheInfo())
+                pathIndex.name = pathIndexNameFromCacheInfo(*cacheInfo);
+            pathIndex.haveName = true;
+        } catch (Error & e) {
+            warn("cannot get the path index of binary cache '%s': %s", getUri(), e.msg());
+            return;
+        }
+    }
+
+    if (!pathIndex.name) return;
+
+    /* Keep a copy of the index in the user's cache directory, so that
+       it's only downloaded once per negative TTL. */
+    auto localPath = getCacheDir() + "/path-index/"
+        + hashString(HashAlgorithm::SHA256, getUri() + "\n" + *pathIndex.name).to_string(HashFormat::Nix32, false);
+
+    try {
+        auto st = maybeLstat(localPath);
+        if (st && st->st_mtime + (time_t) settings.ttlNegativeNarInfoCache.get() > time(nullptr)) {
+            if (auto keys = parsePathIndex(readFile(localPath))) {
+                debug("using cached path index of binary cache '%s'", getUri());
+                pathIndex.keys = std::move(keys);
+                pathIndex.loadedAt = st->st_mtime;
+                return;
+            }
+        }
+    } catch (SystemError &) {
+        ignoreExceptionExceptInterrupt();
+    }
+
+    try {
+        auto data = getFile(*pathIndex.name);
+        if (!data) return;
+        pathIndex.keys = parsePathIndex(*data);
+        if (!pathIndex.keys) {
+            warn("ignoring invalid path index '%s' in binary cache '%s'", *pathIndex.name, getUri());
+            return;
+        }
+        debug("downloaded path index of binary cache '%s' (%d paths)", getUri(), pathIndex.keys->size());
+        try {
+            createDirs(dirOf(localPath));
+            auto tmpPath = fmt("%s.tmp-%d-%d", localPath, getpid(), rand());
+            writeFile(tmpPath, *data);
+            std::filesystem::rename(tmpPath, localPath);
+        } catch (...) {
+            ignoreExceptionExceptInterrupt();
+        }
+    } catch (Error & e) {
+        warn("cannot get the path index of binary cache '%s': %s", getUri(), e.msg());
+    }
+}
+
+bool BinaryCacheStore::maybeInPathIndex(std::string_view hashPart)
+{
+    auto ttl = (time_t) settings.ttlNegativeNarInfoCache.get();
+
+    if (!usePathIndex || !ttl) return true;
+
+    auto key = pathIndexKey(hashPart);
+
+    auto pathIndex(pathIndex_.lock());
+
+    /* Refresh the index (and its name in `nix-cache-info`) once it's
+       as old as a negative .narinfo lookup may be. */
+    if (!pathIndex->loaded || pathIndex->loadedAt + ttl <= time(nullptr)) {
+        if (pathIndex->loaded) pathIndex->haveName = false;
+        loadPathIndex(*pathIndex);
+    }
+
+    return
+        !pathIndex->keys
+        || pathIndex->added.count(key)
+        || std::binary_search(pathIndex->keys->begin(), pathIndex->keys->end(), key);
+}
+
+void BinaryCacheStore::uploadPathIndex()
+{
+    std::optional<std::string> name;
+    std::vector<uint64_t> added;
+    {
+        auto pathIndex(pathIndex_.lock());
+        if (!pathIndex->haveName) {
+            if (auto cacheInfo = getNixCacheInfo())
+                pathIndex->name = pathIndexNameFromCacheInfo(*cacheInfo);
+            pathIndex->haveName = true;
+        }
+        name = pathIndex->name;
+        added.insert(added.end(), pathIndex->added.begin(), pathIndex->added.end());
+    }
+
+    /* Add the paths written by this process to the current index
+       (not the possibly stale local copy). Only list the entire
+       binary cache if there is no usable index yet. Concurrent
+       writers may lose each other's additions, in which case readers
+       using the index don't see the lost paths until they're copied
+       again. */
+    std::optional<std::vector<uint64_t>> keys;
+    if (name)
+        if (auto data = getFile(*name))
+            keys = parsePathIndex(*data);
+
+    if (!keys) {
+        keys.emplace();
+        for (auto & path : queryAllValidPaths())
+            keys->push_back(pathIndexKey(path.hashPart()));
+    }
+
+    keys->insert(keys->end(), added.begin(), added.end());
+    std::sort(keys->begin(), keys->end());
+    keys->erase(std::unique(keys->begin(), keys->end()), keys->end());
+
+    StringSink data;
+    data << pathIndexMagic;
+    for (auto key : *keys) {
+        unsigned char buf[sizeof(key)];
+        for (size_t n = 0; n < sizeof(key); ++n)
+            buf[n] = key >> (n * 8);
+        data({(char *) buf, sizeof(buf)});
+    }
+
+    upsertFile(pathIndexFile, std::move(data.s), "application/octet-stream");
+
+    debug("wrote path index of binary cache '%s' (%d paths)", getUri(), keys->size());
+
+    if (name != pathIndexFile) {
+        auto cacheInfo = getNixCacheInfo().value_or("StoreDir: " + storeDir + "\n");
+        std::string newCacheInfo;
+        for (auto & line : tokenizeString<Strings>(cacheInfo, "\n"))
+            if (!line.starts_with("PathIndex:"))
+                newCacheInfo += line + "\n";
+        newCacheInfo += "PathIndex: " + pathIndexFile + "\n";
+        upsertFile(cacheInfoFile, std::move(newCacheInfo), "text/x-nix-cache-info");
+    }
+
+    auto pathIndex(pathIndex_.lock());
+    pathIndex->name = pathIndexFile;
+    pathIndex->loaded = true;
+    pathIndex->loadedAt = time(nullptr);
+    pathIndex->keys = std::move(keys);
+    for (auto key : added)
+        pathIndex->added.erase(key);
+}
+
 std::string BinaryCacheStore::narInfoFileFor(const StorePath & storePath)
 {
     return std::string(storePath.hashPart()) + ".narinfo";
 }
 
+static std::string compressionExtension(const std::string & compression)
+{
+    return
+        compression == "xz" ? ".xz" :
+        compression == "bzip2" ? ".bz2" :
+        compression == "zstd" ? ".zst" :
+        compression == "lzip" ? ".lzip" :
+        compression == "lz4" ? ".lz4" :
+        compression == "br" ? ".br" :
+        "";
+}
+
+std::string BinaryCacheStore::chunkFileFor(const Hash & chunkHash, const std::string & method)
+{
+    return "chunks/" + chunkHash.to_string(HashFormat::Nix32, false) + compressionExtension(method);
+}
+
+/* The number of chunks to upload or download concurrently. */
+static constexpr size_t chunkConcurrency = 16;
+
+uint64_t BinaryCacheStore::uploadChunks(const std::vector<std::pair<std::string, std::string>> & chunks, RepairFlag repair)
+{
+    std::atomic<uint64_t> bytesWritten{0};
+
+    ThreadPool pool(chunks.size());
+
+    std::set<std::string> seen;
+
+    for (auto & [key, chunk] : chunks) {
+        if (!seen.insert(key).second) continue;
+        if (!repair && knownChunks.lock()->count(key)) continue;
+        pool.enqueue([&, key{key}, chunk{&chunk}]() {
+            if (repair || !fileExists(key)) {
+                auto compressed = nix::compress(compression, *chunk, parallelCompression, compressionLevel);
+                bytesWritten += compressed.size();
+                upsertFile(key, std::move(compressed), "application/x-nix-nar-chunk");
+            }
+            knownChunks.lock()->insert(key);
+        });
+    }
+
+    pool.process();
+
+    return bytesWritten;
+}
+
 void BinaryCacheStore::writeNarInfo(ref<NarInfo> narInfo)
 {
     auto narInfoFile = narInfoFileFor(narInfo->path);
 
     upsertFile(narInfoFile, narInfo->to_string(*this), "text/x-nix-narinfo");
 
-    {
-        auto state_(state.lock());
-        state_->pathInfoCache.upsert(
-            std::string(narInfo->path.to_string()),
-            PathInfoCacheValue { .value = std::shared_ptr<NarInfo>(narInfo) });
-    }
+    if (usePathIndex || writePathIndex)
+        pathIndex_.lock()->added.insert(pathIndexKey(narInfo->path.hashPart()));
+
+    pathInfoCache.upsert(
+        narInfo->path,
+        PathInfoCacheValue { .value = std::shared_ptr<NarInfo>(narInfo) });
 
     if (diskCache)
         diskCache->upsertNarInfo(getUri(), std::string(narInfo->path.hashPart()), std::shared_ptr<NarInfo>(narInfo));
 }
 
+void BinaryCacheStore::checkReferences(const ValidPathInfo & info, const StorePathSet & pending)
+{
+    /* This may do some .narinfo reads, but typically they'll already
+       be cached. */
+    for (auto & ref : info.references)
+        try {
+            if (ref != info.path && !pending.count(ref))
+                queryPathInfo(ref);
+        } catch (InvalidPath &) {
+            throw Error("cannot add '%s' to the binary cache because the reference '%s' is not valid",
+                printStorePath(info.path), printStorePath(ref));
+        }
+}
+
 ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
     Source & narSource, RepairFlag repair, CheckSigsFlag checkSigs,
     std::function<ValidPathInfo(HashResult)> mkInfo)
+{
+    auto narInfo = uploadNar(narSource, repair, mkInfo, true);
+
+    /* Atomically write the NAR info file.*/
+    if (signer) narInfo->sign(*this, *signer);
+
+    writeNarInfo(narInfo);
+
+    stats.narInfoWrite++;
+
+    return narInfo;
+}
+
+ref<NarInfo> BinaryCacheStore::uploadNar(
+    Source & narSource, RepairFlag repair,
+    std::function<ValidPathInfo(HashResult)> mkInfo,
+    bool verifyReferences,
+    const UploadProgress & progress)
 {
     auto [fdTemp, fnTemp] = createTempFile();
 
@@ -140,18 +428,46 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
 
     /* Read the NAR simultaneously into a CompressionSink+FileSink (to
        write the compressed NAR to disk), into a HashSink (to get the
-       NAR hash), and into a NarAccessor (to get the NAR listing). */
+       NAR hash), and into a NarAccessor (to get the NAR listing). If
+       chunking is enabled, the file is instead a list of chunks,
+       which are uploaded as they are produced. */
     HashSink fileHashSink { HashAlgorithm::SHA256 };
     std::shared_ptr<SourceAccessor> narAccessor;
     HashSink narHashSink { HashAlgorithm::SHA256 };
+    uint64_t chunkBytesWritten = 0;
+    std::vector<std::pair<std::string, std::string>> pendingChunks;
     {
     FdSink fileSink(fdTemp.get());
     TeeSink teeSinkCompressed { fileSink, fileHashSink };
-    auto compressionSink = makeCompressionSink(compression, teeSinkCompressed, parallelCompression, compressionLevel);
-    TeeSink teeSinkUncompressed { *compressionSink, narHashSink };
+    std::shared_ptr<FinishSink> compressionSink;
+    if (chunkedNars) {
+        teeSinkCompressed(fmt("Compression: %s\n", compression.get()));
+        compressionSink = std::make_shared<ChunkingSink>(narChunkSize, [&](std::string_view chunk) {
+            auto chunkHash = hashString(HashAlgorithm::SHA256, chunk);
+            teeSinkCompressed(fmt("Chunk: %s %d\n", chunkHash.to_string(HashFormat::Nix32, false), chunk.size()));
+            pendingChunks.emplace_back(chunkFileFor(chunkHash, compression), chunk);
+            if (pendingChunks.size() >= chunkConcurrency) {
+                auto n = uploadChunks(pendingChunks, repair);
+                chunkBytesWritten += n;
+                if (progress.uploaded) progress.uploaded(n);
+                pendingChunks.clear();
+            }
+        });
+    } else
+        compressionSink = makeCompressionSink(compression, teeSinkCompressed, parallelCompression, compressionLevel).get_ptr();
+    LambdaSink progressSink([&](std::string_view data) {
+        if (progress.compressed) progress.compressed(data.size());
+    });
+    TeeSink teeSinkProgress { narHashSink, progressSink };
+    TeeSink teeSinkUncompressed { *compressionSink, teeSinkProgress };
     TeeSource teeSource { narSource, teeSinkUncompressed };
     narAccessor = makeNarAccessor(teeSource);
     compressionSink->finish();
+    if (!pendingChunks.empty()) {
+        auto n = uploadChunks(pendingChunks, repair);
+        chunkBytesWritten += n;
+        if (progress.uploaded) progress.uploaded(n);
+    }
     fileSink.flush();
     }
 
@@ -159,35 +475,26 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
 
     auto info = mkInfo(narHashSink.finish());
     auto narInfo = make_ref<NarInfo>(info);
-    narInfo->compression = compression;
+    narInfo->compression = chunkedNars ? "chunked" : compression.get();
     auto [fileHash, fileSize] = fileHashSink.finish();
     narInfo->fileHash = fileHash;
     narInfo->fileSize = fileSize;
-    narInfo->url = "nar/" + narInfo->fileHash->to_string(HashFormat::Nix32, false) + ".nar"
-                   + (compression == "xz" ? ".xz" :
-           compression == "bzip2" ? ".bz2" :
-           compression == "zstd" ? ".zst" :
-           compression == "lzip" ? ".lzip" :
-           compression == "lz4" ? ".lz4" :
-           compression == "br" ? ".br" :
-           "");
+    narInfo->url = "nar/" + narInfo->fileHash->to_string(HashFormat::Nix32, false)
+        + (chunkedNars ? ".chunks" : ".nar" + compressionExtension(compression));
+
+    /* For chunked NARs, only count the chunks that we actually
+       uploaded. */
+    auto compressedSize = chunkedNars ? chunkBytesWritten : fileSize;
 
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1).count();
     printMsg(lvlTalkative, "copying path '%1%' (%2% bytes, compressed %3$.1f%% in %4% ms) to binary cache",
         printStorePath(narInfo->path), info.narSize,
-        ((1.0 - (double) fileSize / info.narSize) * 100.0),
+        ((1.0 - (double) compressedSize / info.narSize) * 100.0),
         duration);
 
-    /* Verify that all references are valid. This may do some .narinfo
-       reads, but typically they'll already be cached. */
-    for (auto & ref : info.references)
-        try {
-            if (ref != info.path)
-                queryPathInfo(ref);
-        } catch (InvalidPath &) {
-            throw Error("cannot add '%s' to the binary cache because the reference '%s' is not valid",
-                printStorePath(info.path), printStorePath(ref));
-        }
+    /* Verify that all references are valid. */
+    if (verifyReferences)
+        checkReferences(info);
 
     /* Optionally write a JSON file containing a listing of the
        contents of the NAR. */
@@ -263,21 +570,235 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
         upsertFile(narInfo->url,
             std::make_shared<std::fstream>(fnTemp, std::ios_base::in | std::ios_base::binary),
             "application/x-nix-nar");
+        if (progress.uploaded) progress.uploaded(fileSize);
     } else
         stats.narWriteAverted++;
 
     stats.narWriteBytes += info.narSize;
-    stats.narWriteCompressedBytes += fileSize;
+    stats.narWriteCompressedBytes += compressedSize;
     stats.narWriteCompressionTimeMs += duration;
 
-    /* Atomically write the NAR info file.*/
-    if (signer) narInfo->sign(*this, *signer);
+    return narInfo;
+}
 
-    writeNarInfo(narInfo);
+void BinaryCacheStore::addMultipleToStore(
+    PathsSource && pathsToCopy,
+    Activity & act,
+    RepairFlag repair,
+    CheckSigsFlag checkSigs)
+{
+    /* Unlike Store::addMultipleToStore(), don't wait for the
+       references of a path to be uploaded before uploading its NAR;
+       only the .narinfo files need to be written in dependency
+       order, so that the cache never refers to missing paths. That
+       way the NARs of all paths can be produced, compressed and
+       uploaded concurrently. */
+    std::atomic<size_t> nrDone{0};
+    std::atomic<size_t> nrFailed{0};
+    std::atomic<uint64_t> nrRunning{0};
+
+    using PathWithInfo = std::pair<ValidPathInfo, std::unique_ptr<Source>>;
+
+    uint64_t bytesExpected = 0;
+
+    std::map<StorePath, PathWithInfo *> infosMap;
+    for (auto & thingToAdd : pathsToCopy) {
+        bytesExpected += thingToAdd.first.narSize;
+        infosMap.insert_or_assign(thingToAdd.first.path, &thingToAdd);
+    }
 
-    stats.narInfoWrite++;
+    act.setExpected(actCopyPath, bytesExpected);
 
-    return narInfo;
+    auto showProgress = [&, nrTotal = pathsToCopy.size()]() {
+        act.progress(nrDone, nrTotal, nrRunning, nrFailed);
+    };
+
+    auto valid = queryValidPaths(
+        [&]() {
+            StorePathSet paths;
+            for (auto & [path, _] : infosMap) paths.insert(path);
+            return paths;
+        }(),
+        NoSubstitute);
+
+    /* The paths to upload. A path's .narinfo is written as soon as
+       its NAR has been uploaded and the .narinfo files of all its
+       references have been written (or failed). */
+    struct Node
+    {
+        size_t refsLeft = 0;
+        StorePathSet referrers;
+        std::shared_ptr<NarInfo> narInfo;
+        bool written = false;
+        bool failed = false;
+    };
+
+    Sync<std::map<StorePath, Node>> graph_;
+    std::atomic<size_t> nrUploaded{0};
+
+    /* The paths in the graph, whose validity is checked just before
+       writing the .narinfo files of their referrers. */
+    StorePathSet pending;
+
+    {
+        auto graph(graph_.lock());
+        for (auto & [path, _] : infosMap)
+            if (repair || !valid.count(path))
+                graph->emplace(path, Node());
+        for (auto & [path, node] : *graph)
+            for (auto & ref : infosMap.at(path)->first.references)
+                if (ref != path)
+                    if (auto i = graph->find(ref); i != graph->end()) {
+                        node.refsLeft++;
+                        i->second.referrers.insert(path);
+                    }
+        for (auto & [path, _] : *graph)
+            pending.insert(path);
+    }
+
+    /* Report the progress and throughput of the stages of the
+       uploads separately: reading and compressing the NARs, and
+       uploading them. */
+    Activity compressAct(*logger, lvlTalkative, actUnknown, fmt("compressing paths for '%s'", getUri()), {}, act.id);
+    Activity uploadAct(*logger, lvlTalkative, actUnknown, fmt("uploading paths to '%s'", getUri()), {}, act.id);
+    std::atomic<uint64_t> bytesCompressed{0}, bytesUploaded{0};
+    auto startTime = std::chrono::steady_clock::now();
+
+    UploadProgress progress {
+        .compressed = [&](uint64_t n) {
+            auto done = bytesCompressed += n;
+            /* Don't report every write. */
+            if ((done - n) >> 20 != done >> 20)
+                compressAct.progress(done, bytesExpected);
+        },
+        .uploaded = [&](uint64_t n) {
+            uploadAct.progress(bytesUploaded += n, 0);
+        },
+    };
+
+    auto handleError = [&](const StorePath & path, Error & e) {
+        nrFailed++;
+        if (!settings.keepGoing)
+            throw e;
+        printMsg(lvlError, "could not copy %s: %s", printStorePath(path), e.what());
+        showProgress();
+    };
+
+    ThreadPool pool{uploadJobs ? uploadJobs + 1 : 0};
+
+    std::function<void(const StorePath & path)> writeNarInfo_;
+
+    /* Mark `path` as finished, and schedule the .narinfo files of
+       its referrers that no longer have to wait. If `path` failed,
+       the referrers fail in checkReferences(), or before uploading
+       their NARs if they haven't started yet. */
+    auto finished = [&](const StorePath & path, bool failed) {
+        auto graph(graph_.lock());
+        graph->at(path).failed = failed;
+        for (auto & referrer : graph->at(path).referrers) {
+            auto & node = graph->at(referrer);
+            assert(node.refsLeft);
+            if (!--node.refsLeft && node.narInfo)
+                pool.enqueue(std::bind(writeNarInfo_, referrer));
+        }
+    };
+
+    writeNarInfo_ = [&](const StorePath & path) {
+        checkInterrupt();
+        auto narInfo = ref<NarInfo>(graph_.lock()->at(path).narInfo);
+        try {
+            checkReferences(*narInfo);
+            if (signer) narInfo->sign(*this, *signer);
+            writeNarInfo(narInfo);
+            stats.narInfoWrite++;
+            nrDone++;
+            graph_.lock()->at(path).written = true;
+        } catch (Error & e) {
+            finished(path, true);
+            handleError(path, e);
+            return;
+        }
+        finished(path, false);
+        showProgress();
+    };
+
+    for (auto & [path, pathWithInfo] : infosMap) {
+        if (!graph_.lock()->count(path)) {
+            nrDone++;
+            continue;
+        }
+
+        pool.enqueue([&, path{path}, pathWithInfo{pathWithInfo}]() {
+            checkInterrupt();
+
+            auto info = pathWithInfo->first;
+            info.ultimate = false;
+
+            /* Make sure that the Source object is destroyed when
+               we're done (see Store::addMultipleToStore()). */
+            auto source = std::move(pathWithInfo->second);
+
+            MaintainCount<decltype(nrRunning)> mc(nrRunning);
+            showProgress();
+
+            std::shared_ptr<NarInfo> narInfo;
+            try {
+                /* Check the references before uploading the NAR, so
+                   that a path that can't be added doesn't leave an
+                   orphaned NAR behind. References that are uploaded
+                   concurrently can only be checked if they have
+                   already failed; otherwise they are checked before
+                   the .narinfo file is written. */
+                checkReferences(info, pending);
+                for (auto & ref : info.references)
+                    if (ref != path && pending.count(ref) && graph_.lock()->at(ref).failed)
+                        throw Error("cannot add '%s' to the binary cache because the reference '%s' could not be added",
+                            printStorePath(path), printStorePath(ref));
+
+                narInfo = uploadNar(*source, repair, [&](HashResult) { return info; }, false, progress).get_ptr();
+                nrUploaded++;
+            } catch (Error & e) {
+                finished(path, true);
+                handleError(path, e);
+                return;
+            }
+
+            auto graph(graph_.lock());
+            auto & node = graph->at(path);
+            node.narInfo = narInfo;
+            if (!node.refsLeft)
+                pool.enqueue(std::bind(writeNarInfo_, path));
+        });
+    }
+
+    showProgress();
+
+    pool.process();
+
+    compressAct.progress(bytesCompressed, bytesExpected);
+
+    if (nrUploaded) {
+        auto seconds = std::max(0.001, std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count());
+        printMsg(lvlTalkative, "compressed %.1f MiB (%.1f MiB/s) and uploaded %.1f MiB (%.1f MiB/s) to '%s'",
+            bytesCompressed / (1024.0 * 1024.0), bytesCompressed / (1024.0 * 1024.0) / seconds,
+            bytesUploaded / (1024.0 * 1024.0), bytesUploaded / (1024.0 * 1024.0) / seconds,
+            getUri());
+    }
+
+    /* Paths whose .narinfo is still pending are part of a
+       reference cycle. */
+    auto graph(graph_.lock());
+    for (auto & [path, node] : *graph)
+        if (node.narInfo && !node.written && node.refsLeft)
+            throw Error("cycle detected in the references of '%s'", printStorePath(path));
+
+    if (writePathIndex && nrUploaded) {
+        try {
+            uploadPathIndex();
+        } catch (Error & e) {
+            warn("could not write the path index of binary cache '%s': %s", getUri(), e.msg());
+        }
+    }
 }
 
 void BinaryCacheStore::addToStore(const ValidPathInfo & info, Source & narSource,
@@ -397,21 +918,155 @@ void BinaryCacheStore::narFromPath(const StorePath & storePath, Sink & sink)
     LengthSink narSize;
     TeeSink tee { sink, narSize };
 
-    auto decompressor = makeDecompressionSink(info->compression, tee);
+    if (info->compression == "chunked") {
+        try {
+            narFromChunks(*info, tee);
+        } catch (NoSuchBinaryCacheFile & e) {
+            throw SubstituteGone(std::move(e.info()));
+        }
+    } else {
+        auto decompressor = makeDecompressionSink(info->compression, tee);
 
-    try {
-        getFile(info->url, *decompressor);
-    } catch (NoSuchBinaryCacheFile & e) {
-        throw SubstituteGone(std::move(e.info()));
-    }
+        try {
+            getFile(info->url, *decompressor);
+        } catch (NoSuchBinaryCacheFile & e) {
+            throw SubstituteGone(std::move(e.info()));
+        }
 
-    decompressor->finish();
+        decompressor->finish();
+    }
 
     stats.narRead++;
     //stats.narReadCompressedBytes += nar->size(); // FIXME
     stats.narReadBytes += narSize.length;
 }
 
+void BinaryCacheStore::narFromChunks(const NarInfo & info, Sink & sink)
+{
+    StringSink manifest;
+    getFile(info.url, manifest);
+
+    std::string chunkCompression;
+
+    struct Chunk
+    {
+        std::string name;
+        Hash hash;
+        uint64_t size;
+    };
+
+    std::vector<Chunk> chunks;
+
+    for (auto & line : tokenizeString<Strings>(manifest.s, "\n")) {
+        size_t colon = line.find(':');
+        if (colon == std::string::npos)
+            throw Error("invalid chunk list '%s' in binary cache '%s'", info.url, getUri());
+        auto name = line.substr(0, colon);
+        auto value = trim(line.substr(colon + 1));
+
+        if (name == "Compression")
+            chunkCompression = value;
+
+        else if (name == "Chunk") {
+            auto fields = tokenizeString<std::vector<std::string>>(value, " ");
+            auto size = fields.size() == 2 ? string2Int<uint64_t>(fields[1]) : std::nullopt;
+            if (!size)
+                throw Error("invalid chunk list '%s' in binary cache '%s'", info.url, getUri());
+            chunks.push_back(Chunk{
+                .name = fields[0],
+                .hash = Hash::parseNonSRIUnprefixed(fields[0], HashAlgorithm::SHA256),
+                .size = *size,
+            });
+        }
+    }
+
+    if (localChunkCache != "")
+        createDirs(localChunkCache);
+
+    auto isValid = [&](const Chunk & chunk, const std::string & data) {
+        return data.size() == chunk.size && hashString(HashAlgorithm::SHA256, data) == chunk.hash;
+    };
+
+    auto localPathFor = [&](const Chunk & chunk) -> Path {
+        /* Don't use the name from the chunk list, which may be in
+           base-64 and thus contain '/'. */
+        return localChunkCache != ""
+            ? localChunkCache + "/" + chunk.hash.to_string(HashFormat::Nix32, false)
+            : "";
+    };
+
+    /* A chunk that is either in the local chunk cache, or being
+       downloaded. */
+    struct Pending
+    {
+        const Chunk & chunk;
+        std::optional<std::string> data;
+        std::future<std::optional<std::string>> compressed;
+    };
+
+    std::deque<Pending> pending;
+
+    auto start = [&](const Chunk & chunk) {
+        Pending p{.chunk = chunk};
+
+        auto localPath = localPathFor(chunk);
+        if (localPath != "" && pathExists(localPath)) {
+            p.data = readFile(localPath);
+            if (!isValid(chunk, *p.data)) {
+                warn("ignoring corrupt chunk '%s'", localPath);
+                p.data.reset();
+            }
+        }
+
+        if (!p.data) {
+            auto promise = std::make_shared<std::promise<std::optional<std::string>>>();
+            p.compressed = promise->get_future();
+            getFile(chunkFileFor(chunk.hash, chunkCompression),
+                {[promise](std::future<std::optional<std::string>> result) {
+                    try {
+                        promise->set_value(result.get());
+                    } catch (...) {
+                        promise->set_exception(std::current_exception());
+                    }
+                }});
+        }
+
+        pending.push_back(std::move(p));
+    };
+
+    /* Download up to `chunkConcurrency` chunks ahead of the one we're
+       writing, but decompress and write them in order. */
+    auto next = chunks.begin();
+
+    while (next != chunks.end() || !pending.empty()) {
+        while (next != chunks.end() && pending.size() < chunkConcurrency)
+            start(*next++);
+
+        auto p = std::move(pending.front());
+        pending.pop_front();
+
+        if (!p.data) {
+            auto compressed = p.compressed.get();
+            if (!compressed)
+                throw NoSuchBinaryCacheFile("chunk '%s' does not exist in binary cache '%s'", p.chunk.name, getUri());
+            p.data = decompress(chunkCompression, *compressed);
+            if (!isValid(p.chunk, *p.data))
+                throw Error("chunk '%s' in binary cache '%s' is corrupt", p.chunk.name, getUri());
+            if (auto localPath = localPathFor(p.chunk); localPath != "") {
+                try {
+                    auto tmpPath = fmt("%s.tmp-%d-%d", localPath, getpid(), rand());
+                    writeFile(tmpPath, *p.data);
+                    std::filesystem::rename(tmpPath, localPath);
+                } catch (...) {
+                    ignoreExceptionExceptInterrupt();
+                }
+            }
+        }
+
+        sink(*p.data);
+    }
+}
+
 void BinaryCacheStore::queryPathInfoUncached(const StorePath & storePath,
     Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept
 {
@@ -423,6 +1078,17 @@ void BinaryCacheStore::queryPathInfoUncached(const StorePath & storePath,
 
     auto narInfoFile = narInfoFileFor(storePath);
 
+    try {
+        /* Trust the index for as long as we'd trust a negative
+           .narinfo lookup. */
+        if (!maybeInPathIndex(storePath.hashPart())) {
+            debug("path '%s' is not in the path index of binary cache '%s'", storePathS, uri);
+            return callback({});
+        }
+    } catch (...) {
+        return callback.rethrow();
+    }
+
     auto callbackPtr = std::make_shared<decltype(callback)>(std::move(callback));
 
     getFile(narInfoFile,
@@ -538,17 +1204,73 @@ std::optional<std::string> BinaryCacheStore::getBuildLogExact(const StorePath &
 
     debug("fetching build log from binary cache '%s/%s'", getUri(), logPath);
 
-    return getFile(logPath);
+    auto log = getFile(logPath);
+    if (log && isIndexedBuildLog(*log)) {
+        StringSink sink;
+        readIndexedBuildLog(*log, {}, sink);
+        return std::move(sink.s);
+    }
+    return log;
+}
+
+bool BinaryCacheStore::readBuildLogExact(const StorePath & path, const BuildLogFilter & filter, Sink & sink)
+{
+    auto logPath = "log/" + std::string(baseNameOf(printStorePath(path)));
+
+    debug("fetching build log from binary cache '%s/%s'", getUri(), logPath);
+
+    /* For `--tail`, only fetch the frame headers and the last frames
+       of a large indexed log. */
+    if (filter.tail) {
+        constexpr size_t headSize = 1024 * 1024;
+        auto head = getFileRange(logPath, 0, headSize);
+        if (!head) return false;
+        if (head->data.size() < head->fileSize && isIndexedBuildLog(head->data)) {
+            readIndexedBuildLog(head->fileSize,
+                [&](uint64_t offset, size_t len) -> std::string {
+                    if (offset + len <= head->data.size())
+                        return head->data.substr(offset, len);
+                    auto range = getFileRange(logPath, offset, len);
+                    if (!range)
+                        throw Error("build log '%s' disappeared from binary cache '%s'", logPath, getUri());
+                    return std::move(range->data);
+                },
+                filter, sink);
+            return true;
+        }
+        if (head->data.size() == head->fileSize) {
+            if (isIndexedBuildLog(head->data))
+                readIndexedBuildLog(head->data, filter, sink);
+            else
+                filterBuildLog(head->data, filter, sink);
+            return true;
+        }
+    }
+
+    auto log = getFile(logPath);
+    if (!log) return false;
+
+    if (isIndexedBuildLog(*log))
+        readIndexedBuildLog(*log, filter, sink);
+    else
+        filterBuildLog(*log, filter, sink);
+    return true;
 }
 
 void BinaryCacheStore::addBuildLog(const StorePath & drvPath, std::string_view log)
 {
     assert(drvPath.isDerivation());
 
-    upsertFile(
-        "log/" + std::string(drvPath.to_string()),
-        (std::string) log, // FIXME: don't copy
-        "text/plain; charset=utf-8");
+    if (compressBuildLogs)
+        upsertFile(
+            "log/" + std::string(drvPath.to_string()),
+            compressBuildLog(log),
+            "application/zstd");
+    else
+        upsertFile(
+            "log/" + std::string(drvPath.to_string()),
+            (std::string) log, // FIXME: don't copy
+            "text/plain; charset=utf-8");
 }
 
 }
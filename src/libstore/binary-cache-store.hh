@@ -6,8 +6,10 @@
 #include "log-store.hh"
 
 #include "pool.hh"
+#include "sync.hh"
 
 #include <atomic>
+#include <unordered_set>
 
 namespace nix {
 
@@ -44,6 +46,50 @@ struct BinaryCacheStoreConfig : virtual StoreConfig
           The meaning and accepted values depend on the compression method selected.
           `-1` specifies that the default compression level should be used.
         )"};
+
+    const Setting<unsigned int> uploadJobs{this, 0, "upload-jobs",
+        R"(
+          The maximum number of store paths to compress and upload concurrently when copying several paths to this binary cache.
+          `0` means the number of CPU cores.
+        )"};
+
+    const Setting<bool> chunkedNars{this, false, "chunked-nars",
+        R"(
+          Whether to split NARs into content-defined chunks when uploading them.
+          Each chunk is compressed and stored separately under `chunks/`, and chunks that the binary cache already has are not uploaded again.
+          This greatly reduces storage and bandwidth when the cache contains many similar store paths (such as successive versions of a package).
+          The `.narinfo` file then refers to a list of chunks rather than to a compressed NAR, so such store paths cannot be downloaded by older versions of Nix.
+        )"};
+
+    const Setting<uint64_t> narChunkSize{this, 1024 * 1024, "nar-chunk-size",
+        "The average size in bytes of the chunks created by `chunked-nars`."};
+
+    const Setting<Path> localChunkCache{this, "", "local-chunk-cache",
+        R"(
+          Path to a local cache of NAR chunks fetched from this binary cache.
+          Chunks in this directory are not downloaded again, so fetching a store path that is similar to a previously fetched one only downloads the chunks that differ.
+        )"};
+
+    const Setting<bool> usePathIndex{this, false, "use-path-index",
+        R"(
+          Whether to use the path index advertised by the binary cache (see `write-path-index`) to skip looking up `.narinfo` files of paths that the binary cache doesn't have.
+          A path that is missing from the index is considered missing without contacting the binary cache.
+          Since the index may be out of date, it is downloaded again after [`narinfo-cache-negative-ttl`](@docroot@/command-ref/conf-file.md#conf-narinfo-cache-negative-ttl) seconds, like a negative `.narinfo` lookup.
+        )"};
+
+    const Setting<bool> writePathIndex{this, false, "write-path-index",
+        R"(
+          Whether to maintain an index of the store paths in the binary cache after copying paths to it, and advertise it in `nix-cache-info`.
+          The first time, this lists the entire binary cache, so it only works for binary caches that can be listed (such as `file://` and `s3://`).
+          After that, paths are added to the existing index.
+        )"};
+
+    const Setting<bool> compressBuildLogs{this, false, "compress-build-logs",
+        R"(
+          Whether to upload build logs compressed with zstd, in independently compressed chunks of whole lines.
+          This lets `nix log --tail` show the end of a large log without decompressing all of it.
+          Such logs cannot be read by older versions of Nix.
+        )"};
 };
 
 
@@ -66,6 +112,8 @@ protected:
 
     const std::string cacheInfoFile = "nix-cache-info";
 
+    const std::string pathIndexFile = "nix-path-index";
+
     BinaryCacheStore(const Params & params);
 
 public:
@@ -102,6 +150,24 @@ public:
 
     std::optional<std::string> getFile(const std::string & path);
 
+    struct FileRange
+    {
+        std::string data;
+
+        /**
+         * The size of the whole file.
+         */
+        uint64_t fileSize;
+    };
+
+    /**
+     * Return up to `length` bytes of the specified file, starting at
+     * `offset`, or std::nullopt if the file doesn't exist. The default
+     * implementation fetches the whole file.
+     */
+    virtual std::optional<FileRange> getFileRange(
+        const std::string & path, uint64_t offset, size_t length);
+
 public:
 
     virtual void init() override;
@@ -110,14 +176,131 @@ private:
 
     std::string narMagic;
 
+    struct PathIndex
+    {
+        /**
+         * Whether `name` has been read from `nix-cache-info`. This
+         * is not done by `init()` if the cache info was found in the
+         * disk cache.
+         */
+        bool haveName = false;
+
+        /**
+         * The path index advertised in `nix-cache-info`, if any.
+         */
+        std::optional<std::string> name;
+
+        bool loaded = false;
+
+        /**
+         * When the index in `keys` was downloaded. It's refreshed
+         * once it's older than `narinfo-cache-negative-ttl`.
+         */
+        time_t loadedAt = 0;
+
+        /**
+         * Sorted keys (see `pathIndexKey()`) of the paths in the
+         * binary cache, or `std::nullopt` if there is no usable
+         * index.
+         */
+        std::optional<std::vector<uint64_t>> keys;
+
+        /**
+         * Keys of the paths written by this process since the index
+         * was loaded.
+         */
+        std::unordered_set<uint64_t> added;
+    };
+
+    Sync<PathIndex> pathIndex_;
+
+    static uint64_t pathIndexKey(std::string_view hashPart);
+
+    /**
+     * Return false if the path index says that no path with this
+     * hash part exists in the binary cache. Return true if it does
+     * or if there is no index.
+     */
+    bool maybeInPathIndex(std::string_view hashPart);
+
+    /**
+     * Load the path index from the local cache or from the binary
+     * cache. Must be called with `pathIndex_` locked.
+     */
+    void loadPathIndex(PathIndex & pathIndex);
+
+    /**
+     * Add the paths written by this process to the path index, or
+     * write the index of all paths in this binary cache if there is
+     * none yet, and advertise it in `nix-cache-info`.
+     */
+    void uploadPathIndex();
+
     std::string narInfoFileFor(const StorePath & storePath);
 
+    std::string chunkFileFor(const Hash & chunkHash, const std::string & method);
+
+    /**
+     * Files of chunks that are known to exist in this binary cache,
+     * so that uploads don't have to check for them again.
+     */
+    Sync<std::set<std::string>> knownChunks;
+
+    /**
+     * Compress and upload `chunks` (pairs of file name and contents)
+     * concurrently, skipping those that the binary cache already
+     * has. Return the number of compressed bytes written.
+     */
+    uint64_t uploadChunks(const std::vector<std::pair<std::string, std::string>> & chunks, RepairFlag repair);
+
+    /**
+     * Write the NAR described by a chunk list (see
+     * `chunked-nars`) to `sink`. Several chunks are downloaded
+     * concurrently if the binary cache supports it.
+     */
+    void narFromChunks(const NarInfo & info, Sink & sink);
+
     void writeNarInfo(ref<NarInfo> narInfo);
 
     ref<const ValidPathInfo> addToStoreCommon(
         Source & narSource, RepairFlag repair, CheckSigsFlag checkSigs,
         std::function<ValidPathInfo(HashResult)> mkInfo);
 
+    /**
+     * Callbacks that report the progress of the stages of
+     * `uploadNar()`.
+     */
+    struct UploadProgress
+    {
+        /**
+         * Called with the number of NAR bytes that were just read and
+         * compressed.
+         */
+        std::function<void(uint64_t)> compressed;
+
+        /**
+         * Called with the number of compressed bytes that were just
+         * uploaded.
+         */
+        std::function<void(uint64_t)> uploaded;
+    };
+
+    /**
+     * Compress and upload a NAR and its auxiliary files, but don't
+     * write its .narinfo file yet.
+     */
+    ref<NarInfo> uploadNar(
+        Source & narSource, RepairFlag repair,
+        std::function<ValidPathInfo(HashResult)> mkInfo,
+        bool verifyReferences,
+        const UploadProgress & progress = {});
+
+    /**
+     * Throw an error if some reference of `info` is not valid in
+     * this binary cache. References in `pending` are skipped.
+     */
+    void checkReferences(const ValidPathInfo & info, const StorePathSet & pending = {});
+
 public:
 
     bool isValidPathUncached(const StorePath & path) override;
@@ -130,6 +313,14 @@ public:
     void addToStore(const ValidPathInfo & info, Source & narSource,
         RepairFlag repair, CheckSigsFlag checkSigs) override;
 
+    using Store::addMultipleToStore;
+
+    void addMultipleToStore(
+        PathsSource && pathsToCopy,
+        Activity & act,
+        RepairFlag repair,
+        CheckSigsFlag checkSigs) override;
+
     StorePath addToStoreFromDump(
         Source & dump,
         std::string_view name,
@@ -161,6 +352,8 @@ public:
 
     std::optional<std::string> getBuildLogExact(const StorePath & path) override;
 
+    bool readBuildLogExact(const StorePath & path, const BuildLogFilter & filter, Sink & sink) override;
+
     void addBuildLog(const StorePath & drvPath, std::string_view log) override;
 
 };
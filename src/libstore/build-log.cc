@@ -0,0 +1,598 @@
+#include "build-log.hh"
+#include "file-system.hh"
+#include "pathlocks.hh"
+#include "signals.hh"
+#include "sync.hh"
+#include "util.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <fstream>
+#include <thread>
+
+namespace nix {
+
+/* Magic numbers of the skippable frames that precede each data frame
+   and mark the end of the log. zstd reserves 0x184D2A50 to
+   0x184D2A5F for skippable frames. */
+static constexpr uint32_t frameMagic = 0x184D2A5B;
+static constexpr uint32_t endMagic = 0x184D2A5C;
+
+/* The header of a data frame: the magic number, the size of the
+   payload and the payload (compressed size, uncompressed size and
+   number of lines). */
+static constexpr size_t frameHeaderSize = 4 + 4 + 3 * 8;
+
+/* Complete lines are written after this long even if the frame isn't
+   full, so that the log can be followed. The resulting small frames
+   are merged by compactBuildLogFile() once the log is complete. */
+static constexpr auto maxFrameDelay = std::chrono::seconds(1);
+
+/* Lines longer than this are split across frames. */
+static constexpr size_t maxLineSize = 16 * buildLogFrameSize;
+
+template<typename T>
+static void putLittleEndian(std::string & s, T x)
+{
+    for (size_t i = 0; i < sizeof(x); ++i)
+        s.push_back((char) (x >> (i * 8)));
+}
+
+template<typename T>
+static T getLittleEndian(std::string_view s, size_t pos)
+{
+    assert(pos + sizeof(T) <= s.size());
+    return readLittleEndian<T>((unsigned char *) s.data() + pos);
+}
+
+static uint64_t countLines(std::string_view text)
+{
+    return std::count(text.begin(), text.end(), '\n')
+        + (!text.empty() && text.back() != '\n' ? 1 : 0);
+}
+
+/**
+ * Return the suffix of `text` that contains its last `n` lines.
+ */
+static std::string_view lastLines(std::string_view text, size_t n)
+{
+    if (n == 0) return {};
+    size_t pos = text.size();
+    if (pos && text[pos - 1] == '\n') pos--;
+    while (pos > 0) {
+        if (text[pos - 1] == '\n' && --n == 0) break;
+        pos--;
+    }
+    return text.substr(pos);
+}
+
+/**
+ * Write the lines of `text` that match `grep` to `sink`.
+ */
+static void writeMatching(std::string_view text, const std::optional<std::regex> & grep, Sink & sink)
+{
+    if (!grep) {
+        sink(text);
+        return;
+    }
+
+    while (!text.empty()) {
+        auto eol = text.find('\n');
+        auto line = text.substr(0, eol == text.npos ? text.npos : eol + 1);
+        auto end = line.end() - (line.back() == '\n' ? 1 : 0);
+        if (std::regex_search(line.begin(), end, *grep))
+            sink(line);
+        text.remove_prefix(line.size());
+    }
+}
+
+struct BuildLogSink : CompressionSink
+{
+    Sink & nextSink;
+
+    bool flushPeriodically;
+
+    struct State
+    {
+        std::string buf;
+        std::chrono::steady_clock::time_point lastFrame = std::chrono::steady_clock::now();
+        uint64_t totalSize = 0, totalLines = 0;
+        bool stopFlusher = false;
+        bool finished = false;
+    };
+
+    /* Also used by `flusher`, which writes complete lines that have
+       been waiting for `maxFrameDelay` if no more output arrives. */
+    Sync<State> state_;
+
+    std::condition_variable wakeup;
+
+    std::thread flusher;
+
+    BuildLogSink(Sink & nextSink, bool flushPeriodically)
+        : nextSink(nextSink)
+        , flushPeriodically(flushPeriodically)
+    {
+        if (flushPeriodically)
+            flusher = std::thread([this]() { runFlusher(); });
+    }
+
+    ~BuildLogSink()
+    {
+        stopFlusher();
+    }
+
+    /* Don't use BufferedSink's buffer, since we have our own. */
+    void operator () (std::string_view data) override
+    {
+        writeUnbuffered(data);
+    }
+
+    void writeUnbuffered(std::string_view data) override
+    {
+        auto state(state_.lock());
+        state->buf.append(data);
+        writeFrames(*state);
+    }
+
+    /* Write the full frames in `buf`, and if the log can be followed,
+       its complete lines if they have been waiting long enough. */
+    void writeFrames(State & state)
+    {
+        auto & buf = state.buf;
+
+        while (true) {
+            size_t n = 0;
+            if (buf.size() >= buildLogFrameSize) {
+                /* Cut the frame after the last line that fits, or
+                   after the first line if even that doesn't fit. */
+                auto i = buf.rfind('\n', buildLogFrameSize - 1);
+                if (i == buf.npos) i = buf.find('\n');
+                if (i != buf.npos)
+                    n = i + 1;
+                else if (buf.size() >= maxLineSize)
+                    n = buf.size();
+            }
+            else if (flushPeriodically && std::chrono::steady_clock::now() - state.lastFrame >= maxFrameDelay) {
+                auto i = buf.rfind('\n');
+                if (i != buf.npos) n = i + 1;
+            }
+            if (!n) break;
+            writeFrame(state, std::string_view(buf).substr(0, n));
+            buf.erase(0, n);
+        }
+    }
+
+    void writeFrame(State & state, std::string_view data)
+    {
+        auto compressed = compress("zstd", data);
+        auto lines = countLines(data);
+
+        std::string s;
+        putLittleEndian<uint32_t>(s, frameMagic);
+        putLittleEndian<uint32_t>(s, frameHeaderSize - 8);
+        putLittleEndian<uint64_t>(s, compressed.size());
+        putLittleEndian<uint64_t>(s, data.size());
+        putLittleEndian<uint64_t>(s, lines);
+        s += compressed;
+        write(s);
+
+        state.totalSize += data.size();
+        state.totalLines += lines;
+        state.lastFrame = std::chrono::steady_clock::now();
+    }
+
+    void write(std::string_view s)
+    {
+        nextSink(s);
+        /* Make the frame visible to readers following the log. */
+        if (auto buffered = dynamic_cast<BufferedSink *>(&nextSink))
+            buffered->flush();
+    }
+
+    void runFlusher()
+    {
+        auto state(state_.lock());
+        while (!state->stopFlusher) {
+            state.wait_for(wakeup, maxFrameDelay);
+            if (state->stopFlusher) break;
+            try {
+                writeFrames(*state);
+            } catch (...) {
+                /* The next write or finish() will fail as well. */
+                ignoreExceptionExceptInterrupt();
+            }
+        }
+    }
+
+    void stopFlusher()
+    {
+        if (!flusher.joinable()) return;
+        state_.lock()->stopFlusher = true;
+        wakeup.notify_one();
+        flusher.join();
+    }
+
+    void finish() override
+    {
+        stopFlusher();
+
+        auto state(state_.lock());
+        if (state->finished) return;
+        state->finished = true;
+
+        if (!state->buf.empty()) {
+            writeFrame(*state, state->buf);
+            state->buf.clear();
+        }
+
+        std::string s;
+        putLittleEndian<uint32_t>(s, endMagic);
+        putLittleEndian<uint32_t>(s, 2 * 8);
+        putLittleEndian<uint64_t>(s, state->totalSize);
+        putLittleEndian<uint64_t>(s, state->totalLines);
+        write(s);
+    }
+};
+
+ref<CompressionSink> makeBuildLogSink(Sink & nextSink, bool flushPeriodically)
+{
+    return make_ref<BuildLogSink>(nextSink, flushPeriodically);
+}
+
+std::string compressBuildLog(std::string_view log)
+{
+    StringSink ssink;
+    auto sink = makeBuildLogSink(ssink);
+    (*sink)(log);
+    sink->finish();
+    return std::move(ssink.s);
+}
+
+bool isIndexedBuildLog(std::string_view data)
+{
+    if (data.size() < 4) return false;
+    auto magic = getLittleEndian<uint32_t>(data, 0);
+    return magic == frameMagic || magic == endMagic;
+}
+
+namespace {
+
+/**
+ * Random access to an indexed build log, which may be growing.
+ */
+struct LogReader
+{
+    virtual ~LogReader() { }
+
+    virtual uint64_t size() = 0;
+
+    virtual std::string read(uint64_t offset, size_t len) = 0;
+
+    /**
+     * Whether the log may still grow.
+     */
+    virtual bool isBeingWritten()
+    {
+        return false;
+    }
+};
+
+struct StringLogReader : LogReader
+{
+    std::string_view data;
+
+    StringLogReader(std::string_view data)
+        : data(data)
+    { }
+
+    uint64_t size() override
+    {
+        return data.size();
+    }
+
+    std::string read(uint64_t offset, size_t len) override
+    {
+        return std::string(data.substr(offset, len));
+    }
+};
+
+struct FileLogReader : LogReader
+{
+    Path path;
+    std::ifstream file;
+
+    FileLogReader(const Path & path)
+        : path(path)
+        , file(path, std::ios::binary)
+    {
+        if (!file)
+            throw SysError("opening build log '%s'", path);
+    }
+
+    uint64_t size() override
+    {
+        /* Clear the end-of-file state, since the file may have grown. */
+        file.clear();
+        file.seekg(0, std::ios::end);
+        return file.tellg();
+    }
+
+    std::string read(uint64_t offset, size_t len) override
+    {
+        std::string s(len, 0);
+        file.clear();
+        file.seekg(offset);
+        file.read(s.data(), len);
+        if ((size_t) file.gcount() != len)
+            throw Error("unexpected end of build log '%s'", path);
+        return s;
+    }
+
+    /* The builder holds a lock on the log while it's running (see
+       `DerivationGoal::openLogFile()`), so a log that isn't locked
+       won't grow anymore, even if it lacks the end marker because
+       the builder crashed. */
+    bool isBeingWritten() override
+    {
+#ifndef _WIN32
+        AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        return fd && !lockFile(fd.get(), ltRead, false);
+#else
+        return true;
+#endif
+    }
+};
+
+/**
+ * A log that is read piecewise through a callback, e.g. using ranged
+ * requests. Reads are rounded up to `readAhead` bytes, since frame
+ * headers are small and are usually followed by their frame.
+ */
+struct CallbackLogReader : LogReader
+{
+    static constexpr size_t readAhead = 64 * 1024;
+
+    uint64_t fileSize;
+    std::function<std::string(uint64_t offset, size_t len)> readFn;
+
+    uint64_t bufOffset = 0;
+    std::string buf;
+
+    CallbackLogReader(uint64_t fileSize, std::function<std::string(uint64_t offset, size_t len)> readFn)
+        : fileSize(fileSize)
+        , readFn(std::move(readFn))
+    { }
+
+    uint64_t size() override
+    {
+        return fileSize;
+    }
+
+    std::string read(uint64_t offset, size_t len) override
+    {
+        if (offset < bufOffset || offset + len > bufOffset + buf.size()) {
+            bufOffset = offset;
+            buf = readFn(offset, std::min<uint64_t>(std::max(len, readAhead), fileSize - offset));
+            if (buf.size() < len)
+                throw Error("unexpected end of build log");
+        }
+        return buf.substr(offset - bufOffset, len);
+    }
+};
+
+struct FrameInfo
+{
+    uint64_t offset, compressedSize, size, lines;
+};
+
+struct LogIndex
+{
+    std::vector<FrameInfo> frames;
+
+    /**
+     * Whether the end of the log was found.
+     */
+    bool complete = false;
+
+    /**
+     * The offset of the first frame that wasn't indexed yet.
+     */
+    uint64_t end = 0;
+
+    /**
+     * Index the frames that were added since the last call. Frames
+     * that weren't completely written yet are ignored.
+     */
+    void update(LogReader & reader)
+    {
+        auto size = reader.size();
+
+        while (!complete && size - end >= 8) {
+            auto header = reader.read(end, 8);
+            auto magic = getLittleEndian<uint32_t>(header, 0);
+            auto payloadSize = getLittleEndian<uint32_t>(header, 4);
+            auto payloadStart = end + 8;
+
+            if (size - payloadStart < payloadSize) break;
+
+            if (magic == frameMagic) {
+                if (payloadSize < frameHeaderSize - 8)
+                    throw Error("build log is corrupt");
+                auto payload = reader.read(payloadStart, frameHeaderSize - 8);
+                FrameInfo frame {
+                    .offset = payloadStart + payloadSize,
+                    .compressedSize = getLittleEndian<uint64_t>(payload, 0),
+                    .size = getLittleEndian<uint64_t>(payload, 8),
+                    .lines = getLittleEndian<uint64_t>(payload, 16),
+                };
+                if (size - frame.offset < frame.compressedSize) break;
+                frames.push_back(frame);
+                end = frame.offset + frame.compressedSize;
+            }
+
+            else if (magic == endMagic) {
+                complete = true;
+                end = payloadStart + payloadSize;
+            }
+
+            else
+                throw Error("build log is corrupt");
+        }
+    }
+};
+
+}
+
+static std::string readFrame(LogReader & reader, const FrameInfo & frame)
+{
+    auto text = decompress("zstd", reader.read(frame.offset, frame.compressedSize));
+    if (text.size() != frame.size)
+        throw Error("build log is corrupt");
+    return text;
+}
+
+static void readBuildLog(LogReader & reader, const BuildLogFilter & filter, Sink & sink)
+{
+    LogIndex index;
+    index.update(reader);
+
+    auto & frames = index.frames;
+
+    if (!filter.tail) {
+        for (auto & frame : frames)
+            writeMatching(readFrame(reader, frame), filter.grep, sink);
+    }
+
+    else if (!filter.grep) {
+        /* Use the line counts to find the frames that contain the
+           last lines, and only decompress those. */
+        size_t first = frames.size();
+        uint64_t lines = 0;
+        while (first > 0 && lines < *filter.tail)
+            lines += frames[--first].lines;
+
+        std::string text;
+        for (auto i = first; i < frames.size(); ++i)
+            text += readFrame(reader, frames[i]);
+        sink(lastLines(text, *filter.tail));
+    }
+
+    else {
+        /* Decompress frames from the end until we have enough
+           matching lines. */
+        std::vector<std::string> matches;
+        uint64_t lines = 0;
+        for (auto i = frames.size(); i > 0 && lines < *filter.tail; --i) {
+            StringSink matching;
+            writeMatching(readFrame(reader, frames[i - 1]), filter.grep, matching);
+            lines += countLines(matching.s);
+            matches.push_back(std::move(matching.s));
+        }
+
+        std::string text;
+        for (auto i = matches.rbegin(); i != matches.rend(); ++i)
+            text += *i;
+        sink(lastLines(text, *filter.tail));
+    }
+
+    if (!filter.follow) return;
+
+    auto done = frames.size();
+
+    while (!index.complete) {
+        checkInterrupt();
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        /* Check this before reading the final frames. */
+        auto running = reader.isBeingWritten();
+        index.update(reader);
+        for (; done < frames.size(); ++done)
+            writeMatching(readFrame(reader, frames[done]), filter.grep, sink);
+        if (!running) break;
+    }
+}
+
+void readIndexedBuildLog(std::string_view data, const BuildLogFilter & filter, Sink & sink)
+{
+    StringLogReader reader(data);
+    auto filter2(filter);
+    filter2.follow = false;
+    readBuildLog(reader, filter2, sink);
+}
+
+void readIndexedBuildLog(
+    uint64_t size,
+    std::function<std::string(uint64_t offset, size_t len)> read,
+    const BuildLogFilter & filter,
+    Sink & sink)
+{
+    CallbackLogReader reader(size, std::move(read));
+    auto filter2(filter);
+    filter2.follow = false;
+    readBuildLog(reader, filter2, sink);
+}
+
+void readIndexedBuildLogFile(const Path & path, const BuildLogFilter & filter, Sink & sink)
+{
+    FileLogReader reader(path);
+    readBuildLog(reader, filter, sink);
+}
+
+void compactBuildLogFile(const Path & path)
+{
+    LogIndex index;
+    {
+        FileLogReader reader(path);
+        index.update(reader);
+    }
+    if (!index.complete) return;
+
+    auto & frames = index.frames;
+
+    bool mergeable = false;
+    for (size_t i = 1; i < frames.size(); ++i)
+        if (frames[i - 1].size + frames[i].size <= buildLogFrameSize)
+            mergeable = true;
+    if (!mergeable) return;
+
+    debug("merging the %d frames of build log '%s'", frames.size(), path);
+
+    auto tmpPath = path + ".tmp";
+    AutoDelete del(tmpPath, false);
+
+    {
+        FileLogReader reader(path);
+        AutoCloseFD fd = toDescriptor(open(tmpPath.c_str(), O_CREAT | O_TRUNC | O_WRONLY
+#ifndef _WIN32
+            | O_CLOEXEC
+#endif
+            , 0666));
+        if (!fd) throw SysError("creating '%s'", tmpPath);
+        FdSink fdSink(fd.get());
+        BuildLogSink sink(fdSink, false);
+        for (auto & frame : frames)
+            sink(readFrame(reader, frame));
+        sink.finish();
+        fdSink.flush();
+    }
+
+    /* Readers that still have the old file open see a complete log. */
+    std::filesystem::rename(tmpPath, path);
+    del.cancel();
+}
+
+void filterBuildLog(std::string_view log, const BuildLogFilter & filter, Sink & sink)
+{
+    if (!filter.tail)
+        writeMatching(log, filter.grep, sink);
+    else if (!filter.grep)
+        sink(lastLines(log, *filter.tail));
+    else {
+        StringSink matching;
+        writeMatching(log, filter.grep, matching);
+        sink(lastLines(matching.s, *filter.tail));
+    }
+}
+
+}
@@ -0,0 +1,109 @@
+#pragma once
+///@file
+
+#include "compression.hh"
+
+#include <functional>
+#include <regex>
+
+namespace nix {
+
+/**
+ * Build logs are stored as a sequence of independently compressed
+ * zstd frames of about `buildLogFrameSize` bytes, each containing
+ * whole lines. Every frame is preceded by a zstd skippable frame
+ * that records its compressed size, its uncompressed size and its
+ * number of lines, and the log ends with a skippable frame marking
+ * it as complete. So the file is still a valid zstd stream (readable
+ * by e.g. `zstdcat`), but a reader can find the frames it needs
+ * without decompressing the others, and can follow a log that is
+ * still being written.
+ */
+constexpr size_t buildLogFrameSize = 1024 * 1024;
+
+/**
+ * Which lines of a build log to return.
+ */
+struct BuildLogFilter
+{
+    /**
+     * Only return lines that contain a match for this regular
+     * expression.
+     */
+    std::optional<std::regex> grep;
+
+    /**
+     * Only return the last `tail` lines (that match `grep`).
+     */
+    std::optional<size_t> tail;
+
+    /**
+     * If the log is still being written, wait for the rest.
+     */
+    bool follow = false;
+
+    bool empty() const
+    {
+        return !grep && !tail && !follow;
+    }
+};
+
+/**
+ * Return a sink that writes a build log in the indexed format to
+ * `nextSink`. Frames are written when they are full. If
+ * `flushPeriodically` is set, complete lines are also written once
+ * they have been waiting for a while, so that followers see them,
+ * from a thread if no more output arrives; `nextSink` is then also
+ * written from that thread. `finish()` marks the log as complete.
+ */
+ref<CompressionSink> makeBuildLogSink(Sink & nextSink, bool flushPeriodically = false);
+
+/**
+ * Convert a build log to the indexed format.
+ */
+std::string compressBuildLog(std::string_view log);
+
+/**
+ * Whether `data` (of which at least the first 4 bytes are required)
+ * is a build log in the indexed format.
+ */
+bool isIndexedBuildLog(std::string_view data);
+
+/**
+ * Write the lines of the indexed build log `data` selected by
+ * `filter` to `sink`. `filter.follow` is ignored.
+ */
+void readIndexedBuildLog(std::string_view data, const BuildLogFilter & filter, Sink & sink);
+
+/**
+ * Like `readIndexedBuildLog()`, but for a log of `size` bytes that is
+ * read piecewise through `read(offset, len)`, e.g. using ranged
+ * requests, so that only the frames that are needed are fetched.
+ */
+void readIndexedBuildLog(
+    uint64_t size,
+    std::function<std::string(uint64_t offset, size_t len)> read,
+    const BuildLogFilter & filter,
+    Sink & sink);
+
+/**
+ * Like `readIndexedBuildLog()`, but read from a file, which is
+ * polled for new frames if `filter.follow` is set and the log is not
+ * complete yet, until the build that writes it has stopped.
+ */
+void readIndexedBuildLogFile(const Path & path, const BuildLogFilter & filter, Sink & sink);
+
+/**
+ * Write the lines of the uncompressed build log `log` selected by
+ * `filter` to `sink`.
+ */
+void filterBuildLog(std::string_view log, const BuildLogFilter & filter, Sink & sink);
+
+/**
+ * Rewrite the complete indexed build log `path`, merging the small
+ * frames that were written so that the log of the running build could
+ * be followed. Does nothing if there is nothing to merge.
+ */
+void compactBuildLogFile(const Path & path);
+
+}
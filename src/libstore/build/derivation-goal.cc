@@ -12,6 +12,7 @@
 #include "util.hh"
 #include "archive.hh"
 #include "compression.hh"
+#include "build-log.hh"
 #include "common-protocol.hh"
 #include "common-protocol-impl.hh"
 #include "topo-sort.hh"
@@ -1248,8 +1249,10 @@ Path DerivationGoal::openLogFile()
     Path dir = fmt("%s/%s/%s/", logDir, LocalFSStore::drvsLogDir, baseName.substr(0, 2));
     createDirs(dir);
 
+    bool indexed = settings.compressLog && settings.indexBuildLog;
+
     Path logFileName = fmt("%s/%s%s", dir, baseName.substr(2),
-        settings.compressLog ? ".bz2" : "");
+        !settings.compressLog ? "" : indexed ? ".zst" : ".bz2");
 
     fdLogFile = toDescriptor(open(logFileName.c_str(), O_CREAT | O_WRONLY | O_TRUNC
 #ifndef _WIN32
@@ -1258,9 +1261,17 @@ Path DerivationGoal::openLogFile()
         , 0666));
     if (!fdLogFile) throw SysError("creating log file '%1%'", logFileName);
 
+    /* Tell `nix log --follow` that the log is still being written. */
+    if (indexed)
+        lockFile(fdLogFile.get(), ltWrite, true);
+
     logFileSink = std::make_shared<FdSink>(fdLogFile.get());
 
-    if (settings.compressLog)
+    if (indexed) {
+        logSink = std::shared_ptr<CompressionSink>(makeBuildLogSink(*logFileSink, true));
+        indexedLogFile = logFileName;
+    }
+    else if (settings.compressLog)
         logSink = std::shared_ptr<CompressionSink>(makeCompressionSink("bzip2", *logFileSink));
     else
         logSink = logFileSink;
@@ -1276,6 +1287,16 @@ void DerivationGoal::closeLogFile()
     if (logFileSink) logFileSink->flush();
     logSink = logFileSink = 0;
     fdLogFile.close();
+
+    if (!indexedLogFile.empty()) {
+        auto path = std::move(indexedLogFile);
+        indexedLogFile.clear();
+        try {
+            compactBuildLogFile(path);
+        } catch (Error & e) {
+            warn("could not merge the frames of build log '%s': %s", path, e.msg());
+        }
+    }
 }
 
 
@@ -169,6 +169,12 @@ struct DerivationGoal : public Goal
     AutoCloseFD fdLogFile;
     std::shared_ptr<BufferedSink> logFileSink, logSink;
 
+    /**
+     * The log file if it is in the indexed format, in which case its
+     * frames are merged once it has been closed.
+     */
+    Path indexedLogFile;
+
     /**
      * Number of bytes received from the builder's stdout/stderr.
      */
@@ -2,6 +2,7 @@
 
 #include "common-ssh-store-config.hh"
 #include "ssh.hh"
+#include "globals.hh"
 
 namespace nix {
 
@@ -37,6 +38,7 @@ SSHMaster CommonSSHStoreConfig::createSSHMaster(bool useMaster, Descriptor logFD
         useMaster,
         compress,
         logFD,
+        settings.sshMasterPersist,
     };
 }
 
@@ -733,6 +733,10 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         readInt(conn.from);
         readInt(conn.from);
         readInt(conn.from);
+        if (conn.features.count(WorkerProto::featureGCMaxCandidates)) {
+            auto maxCandidates = readNum<uint64_t>(conn.from);
+            if (maxCandidates) options.maxCandidates = maxCandidates;
+        }
 
         GCResults results;
 
@@ -71,6 +71,8 @@ struct curlFileTransfer : public FileTransfer
 
         bool acceptRanges = false;
 
+        std::string range;
+
         curl_off_t writtenToSink = 0;
 
         std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
@@ -212,6 +214,7 @@ struct curlFileTransfer : public FileTransfer
                 result.etag = "";
                 result.data.clear();
                 result.bodySize = 0;
+                result.totalSize.reset();
                 statusMsg = trim(match.str(1));
                 acceptRanges = false;
                 encoding = "";
@@ -243,6 +246,14 @@ struct curlFileTransfer : public FileTransfer
                     else if (name == "accept-ranges" && toLower(trim(line.substr(i + 1))) == "bytes")
                         acceptRanges = true;
 
+                    else if (name == "content-range") {
+                        /* E.g. "bytes 0-1023/4096". */
+                        auto value = trim(line.substr(i + 1));
+                        auto slash = value.rfind('/');
+                        if (hasPrefix(value, "bytes ") && slash != value.npos)
+                            result.totalSize = string2Int<uint64_t>(value.substr(slash + 1));
+                    }
+
                     else if (name == "link" || name == "x-amz-meta-link") {
                         auto value = trim(line.substr(i + 1));
                         static std::regex linkRegex("<([^>]*)>; rel=\"immutable\"", std::regex::extended | std::regex::icase);
@@ -397,7 +408,12 @@ struct curlFileTransfer : public FileTransfer
             curl_easy_setopt(req, CURLOPT_NETRC_FILE, settings.netrcFile.get().c_str());
             curl_easy_setopt(req, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
 
-            if (writtenToSink)
+            if (request.range) {
+                range = fmt("%d-%d", request.range->first, request.range->first + request.range->second - 1);
+                curl_easy_setopt(req, CURLOPT_RANGE, range.c_str());
+            }
+
+            else if (writtenToSink)
                 curl_easy_setopt(req, CURLOPT_RESUME_FROM_LARGE, writtenToSink);
 
             curl_easy_setopt(req, CURLOPT_ERRORBUFFER, errbuf);
@@ -74,6 +74,14 @@ struct FileTransferRequest
     std::string mimeType;
     std::function<void(std::string_view data)> dataCallback;
 
+    /**
+     * If set, only request this many bytes (the second element),
+     * starting at this offset (the first element). The server may
+     * ignore this and return the whole file; see
+     * `FileTransferResult::totalSize`.
+     */
+    std::optional<std::pair<uint64_t, uint64_t>> range;
+
     FileTransferRequest(std::string_view uri)
         : uri(uri), parentAct(getCurActivity()) { }
 
@@ -108,6 +116,12 @@ struct FileTransferResult
 
     uint64_t bodySize = 0;
 
+    /**
+     * The size of the whole file, if the server returned only part of
+     * it (as indicated by a `Content-Range` header).
+     */
+    std::optional<uint64_t> totalSize;
+
     /**
      * An "immutable" URL for this resource (i.e. one whose contents
      * will never change), as returned by the `Link: <url>;
@@ -53,6 +53,18 @@ struct GCOptions
      * Stop after at least `maxFreed` bytes have been freed.
      */
     uint64_t maxFreed{std::numeric_limits<uint64_t>::max()};
+
+    /**
+     * For `gcReturnDead` and `gcDeleteDead`, if set, don't scan the
+     * whole store for garbage. Instead, only consider the oldest valid
+     * paths that have no referrers, until this many of them have been
+     * found to be dead. Since deleting a path can leave its references
+     * without referrers, repeated collections eventually free the same
+     * garbage as a full collection, but each one deletes a bounded
+     * number of paths. Live candidates are skipped, so they don't
+     * prevent progress.
+     */
+    std::optional<uint64_t> maxCandidates;
 };
 
 
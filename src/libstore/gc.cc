@@ -5,6 +5,7 @@
 #include "unix-domain-socket.hh"
 #include "signals.hh"
 #include "posix-fs-canonicalise.hh"
+#include "thread-pool.hh"
 
 #if !defined(__linux__)
 // For shelling out to lsof
@@ -16,6 +17,7 @@
 #include <algorithm>
 #include <regex>
 #include <random>
+#include <chrono>
 
 #include <climits>
 #include <errno.h>
@@ -212,11 +214,39 @@ void LocalStore::findTempRoots(Roots & tempRoots, bool censor)
 }
 
 
-void LocalStore::findRoots(const Path & path, std::filesystem::file_type type, Roots & roots)
+/* Modification time of `path` in nanoseconds, following symlinks. */
+static int64_t mtimeNs(const Path & path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1)
+        throw SysError("getting status of '%s'", path);
+#ifdef __APPLE__
+    return (int64_t) st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    return (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+}
+
+
+/* What `path` is, for the entries of the permanent roots cache: the
+   target if it's a symlink, empty if it doesn't exist. */
+static std::string linkState(const Path & path)
+{
+    auto st = std::filesystem::symlink_status(path);
+    if (st.type() == std::filesystem::file_type::not_found) return "";
+    if (st.type() == std::filesystem::file_type::symlink) return "-> " + readLink(path);
+    return "other";
+}
+
+
+void LocalStore::findRoots(const Path & path, std::filesystem::file_type type, Roots & roots, PermRootsScan * scan)
 {
     auto foundRoot = [&](const Path & path, const Path & target) {
         try {
             auto storePath = toStorePath(target).first;
+            /* Record invalid targets too: they may become valid
+               while the cache is in use. */
+            if (scan) scan->roots.insert(storePath);
             if (isValidPath(storePath))
                 roots[std::move(storePath)].emplace(path);
             else
@@ -230,9 +260,19 @@ void LocalStore::findRoots(const Path & path, std::filesystem::file_type type, R
             type = std::filesystem::symlink_status(path).type();
 
         if (type == std::filesystem::file_type::directory) {
+            /* Get the modification time before reading the directory,
+               so that anything added while we read it invalidates the
+               cache. Changes within the timestamp granularity can't
+               be detected, so don't cache those at all. */
+            if (scan) {
+                auto mtime = mtimeNs(path);
+                scan->dirs[path] = mtime;
+                if (mtime >= (int64_t) (time(nullptr) - 2) * 1000000000)
+                    scan->racy = true;
+            }
             for (auto & i : std::filesystem::directory_iterator{path}) {
                 checkInterrupt();
-                findRoots(i.path().string(), i.symlink_status().type(), roots);
+                findRoots(i.path().string(), i.symlink_status().type(), roots, scan);
             }
         }
 
@@ -250,6 +290,7 @@ void LocalStore::findRoots(const Path & path, std::filesystem::file_type type, R
                         unlink(path.c_str());
                     }
                 } else {
+                    if (scan) scan->links[target] = linkState(target);
                     if (!std::filesystem::is_symlink(target)) return;
                     Path target2 = readLink(target);
                     if (isInStore(target2)) foundRoot(target, target2);
@@ -259,6 +300,7 @@ void LocalStore::findRoots(const Path & path, std::filesystem::file_type type, R
 
         else if (type == std::filesystem::file_type::regular) {
             auto storePath = maybeParseStorePath(storeDir + "/" + std::string(baseNameOf(path)));
+            if (storePath && scan) scan->roots.insert(*storePath);
             if (storePath && isValidPath(*storePath))
                 roots[std::move(*storePath)].emplace(path);
         }
@@ -283,11 +325,16 @@ void LocalStore::findRoots(const Path & path, std::filesystem::file_type type, R
 }
 
 
-void LocalStore::findRootsNoTemp(Roots & roots, bool censor)
+void LocalStore::findRootsNoTemp(Roots & roots, bool censor, PermRootsScan * scan)
 {
     /* Process direct roots in {gcroots,profiles}. */
-    findRoots(stateDir + "/" + gcRootsDir, std::filesystem::file_type::unknown, roots);
-    findRoots(stateDir + "/profiles", std::filesystem::file_type::unknown, roots);
+    for (auto & dir : {stateDir + "/" + gcRootsDir, stateDir + "/profiles"}) {
+        /* These aren't inside any directory we track, so record
+           whether they are (still) directories. */
+        if (scan && std::filesystem::symlink_status(dir).type() != std::filesystem::file_type::directory)
+            scan->links[dir] = linkState(dir);
+        findRoots(dir, std::filesystem::file_type::unknown, roots, scan);
+    }
 
     /* Add additional roots returned by different platforms-specific
        heuristics.  This is typically used to add running programs to
@@ -296,6 +343,117 @@ void LocalStore::findRootsNoTemp(Roots & roots, bool censor)
 }
 
 
+/* The cache of the permanent roots is a sequence of NUL-terminated
+   fields, since paths may contain any other character. After the
+   version, each entry is either `dir <path> <mtime>`, `link <path>
+   <state>` or `root <store path>`. */
+static const std::string permRootsCacheVersion = "nix-gc-roots-1";
+
+static Path permRootsCacheFile(const Path & stateDir)
+{
+    return stateDir + "/gc-roots.cache";
+}
+
+
+bool LocalStore::readPermRootsCache(StorePathSet & roots)
+{
+    auto cacheFile = permRootsCacheFile(stateDir);
+
+    std::string contents;
+    try {
+        contents = readFile(cacheFile);
+    } catch (SysError & e) {
+        if (e.errNo == ENOENT) return false;
+        throw;
+    }
+
+    size_t pos = 0;
+    auto next = [&]() {
+        auto end = contents.find((char) 0, pos);
+        if (end == contents.npos)
+            throw Error("GC roots cache '%s' is truncated", cacheFile);
+        auto field = contents.substr(pos, end - pos);
+        pos = end + 1;
+        return field;
+    };
+
+    StorePathSet found;
+
+    try {
+        if (next() != permRootsCacheVersion) return false;
+
+        while (pos < contents.size()) {
+            checkInterrupt();
+            auto kind = next();
+
+            if (kind == "dir") {
+                auto path = next();
+                if (mtimeNs(path) != std::stoll(next())) return false;
+            }
+
+            else if (kind == "link") {
+                auto path = next();
+                if (linkState(path) != next()) return false;
+            }
+
+            else if (kind == "root")
+                found.insert(parseStorePath(next()));
+
+            else
+                return false;
+        }
+    } catch (Error & e) {
+        /* A directory that went away is a change, too. */
+        debug("not using the GC roots cache: %s", e.msg());
+        return false;
+    } catch (std::exception & e) {
+        debug("not using the GC roots cache: %s", e.what());
+        return false;
+    }
+
+    roots.insert(found.begin(), found.end());
+    return true;
+}
+
+
+void LocalStore::writePermRootsCache(const PermRootsScan & scan)
+{
+    auto cacheFile = permRootsCacheFile(stateDir);
+
+    if (scan.racy) {
+        /* Don't let an older cache outlive this scan. */
+        std::filesystem::remove(cacheFile);
+        return;
+    }
+
+    std::string s;
+    auto field = [&](std::string_view f) {
+        s += f;
+        s += (char) 0;
+    };
+
+    field(permRootsCacheVersion);
+    for (auto & [dir, mtime] : scan.dirs) {
+        field("dir");
+        field(dir);
+        field(std::to_string(mtime));
+    }
+    for (auto & [link, state] : scan.links) {
+        field("link");
+        field(link);
+        field(state);
+    }
+    for (auto & root : scan.roots) {
+        field("root");
+        field(printStorePath(root));
+    }
+
+    auto tmpFile = fmt("%s.tmp-%d", cacheFile, getpid());
+    writeFile(tmpFile, s);
+    std::filesystem::rename(tmpFile, cacheFile);
+}
+
+
 Roots LocalStore::findRoots(bool censor)
 {
     Roots roots;
@@ -463,9 +621,9 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
         // ignore suffixes like '.lock', '.chroot' and '.check'.
         std::unordered_set<std::string> tempRoots;
 
-        // Hash part of the store path currently being deleted, if
-        // any.
-        std::optional<std::string> pending;
+        // Hash parts of the store paths currently being checked or
+        // deleted.
+        std::unordered_set<std::string> pending;
     };
 
     Sync<Shared> _shared;
@@ -579,7 +737,7 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
                                    done. FIXME: ideally we would use a
                                    FD for this so we don't block the
                                    poll loop. */
-                                while (shared->pending == hashPart) {
+                                while (shared->pending.count(hashPart)) {
                                     debug("synchronising with deletion of path '%s'", path);
                                     shared.wait(wakeup);
                                 }
@@ -610,8 +768,23 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
        permanent roots cannot increase now. */
     printInfo("finding garbage collector roots...");
     Roots rootMap;
-    if (!options.ignoreLiveness)
-        findRootsNoTemp(rootMap, true);
+    if (!options.ignoreLiveness) {
+        /* Bounded collections run often (e.g. as auto-GC during
+           builds), so they reuse the permanent roots of the previous
+           scan if nothing they came from has changed. Runtime roots
+           are always rescanned. */
+        StorePathSet cachedRoots;
+        bool bounded = options.maxCandidates && options.action != GCOptions::gcReturnLive;
+        if (bounded && readPermRootsCache(cachedRoots)) {
+            debug("using %d cached permanent GC roots", cachedRoots.size());
+            roots.insert(cachedRoots.begin(), cachedRoots.end());
+            findRuntimeRoots(rootMap, true);
+        } else {
+            PermRootsScan scan;
+            findRootsNoTemp(rootMap, true, &scan);
+            writePermRootsCache(scan);
+        }
+    }
 
     for (auto & i : rootMap) roots.insert(i.first);
 
@@ -628,8 +801,22 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
     if (auto p = getEnv("_NIX_TEST_GC_SYNC_2"))
         readFile(*p);
 
-    /* Helper function that deletes a path from the store and throws
-       GCLimitReached if we've deleted enough garbage. */
+    /* State of the deletion workers. */
+    struct Deletion
+    {
+        PathSet paths;
+        uint64_t bytesFreed = 0;
+        size_t inFlight = 0;
+        /* The estimated size of the paths that are being deleted. */
+        uint64_t bytesInFlight = 0;
+        bool failed = false;
+    };
+
+    Sync<Deletion> _deletion;
+
+    std::condition_variable deletionDone;
+
+    /* Helper function that deletes a path from the store. */
     auto deleteFromStore = [&](std::string_view baseName)
     {
         Path path = storeDir + "/" + std::string(baseName);
@@ -648,21 +835,117 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 
         printInfo("deleting '%1%'", path);
 
-        results.paths.insert(path);
-
-        uint64_t bytesFreed;
+        uint64_t bytesFreed = 0;
         deleteStorePath(realPath, bytesFreed);
 
-        results.bytesFreed += bytesFreed;
+        auto deletion(_deletion.lock());
+        deletion->paths.insert(path);
+        deletion->bytesFreed += bytesFreed;
+    };
+
+    /* Deleting lots of small files is bound by syscall latency, so
+       the actual deletion is done by a pool of workers, while the
+       liveness traversal and the database updates stay on this
+       thread. Since the paths are no longer valid at this point, the
+       order in which they are deleted doesn't matter. `hashPart` stays
+       in `pending` until the path is gone, so a client that wants to
+       register it as a temporary root waits for the deletion to
+       finish. */
+    size_t deleteJobs = settings.gcDeleteJobs;
+    if (!deleteJobs) deleteJobs = std::max(1U, std::thread::hardware_concurrency());
+
+    /* Bound the amount of work that is queued, so we don't invalidate
+       far more paths than needed to reach `maxFreed`. */
+    size_t maxInFlight = deleteJobs * 4;
+
+    auto scheduleDeletion = [&](std::string baseName, std::optional<std::string> hashPart, uint64_t size, ThreadPool & pool)
+    {
+        auto finishDeletion = [&, hashPart]() {
+            if (!hashPart) return;
+            auto shared(_shared.lock());
+            shared->pending.erase(*hashPart);
+            wakeup.notify_all();
+        };
+
+        if (deleteJobs <= 1) {
+            Finally release(finishDeletion);
+            deleteFromStore(baseName);
+            return;
+        }
+
+        bool failed;
+
+        {
+            auto deletion(_deletion.lock());
+            while (deletion->inFlight >= maxInFlight && !deletion->failed)
+                deletion.wait(deletionDone);
+            failed = deletion->failed;
+            if (!failed) {
+                deletion->inFlight++;
+                deletion->bytesInFlight += size;
+            }
+        }
+
+        if (!failed) {
+            try {
+                pool.enqueue([&, baseName, finishDeletion, size]() {
+                    Finally release([&]() {
+                        finishDeletion();
+                        auto deletion(_deletion.lock());
+                        deletion->inFlight--;
+                        deletion->bytesInFlight -= size;
+                        if (std::uncaught_exceptions()) deletion->failed = true;
+                        deletionDone.notify_all();
+                    });
+                    deleteFromStore(baseName);
+                });
+                return;
+            } catch (ThreadPoolShutDown &) {
+                auto deletion(_deletion.lock());
+                deletion->inFlight--;
+                deletion->bytesInFlight -= size;
+            }
+        }
 
-        if (results.bytesFreed > options.maxFreed) {
+        /* A worker failed. Rethrow its exception. */
+        finishDeletion();
+        pool.process();
+        throw Error("a garbage collector deletion worker failed");
+    };
+
+    /* Throw GCLimitReached if we've deleted enough garbage, counting
+       the deletions that are still in flight. */
+    auto checkLimit = [&]()
+    {
+        auto deletion(_deletion.lock());
+        if (deletion->bytesFreed + deletion->bytesInFlight > options.maxFreed) {
             printInfo("deleted more than %d bytes; stopping", options.maxFreed);
             throw GCLimitReached();
         }
     };
 
+    /* If we bail out early, paths handed to the deletion workers may
+       still be in `pending`. Make sure that GC clients don't wait for
+       them forever. */
+    Finally clearPending([&]() {
+        _shared.lock()->pending.clear();
+        wakeup.notify_all();
+    });
+
+    /* Create the pool last to ensure its threads are stopped before
+       the state they reference is destroyed. The calling thread does
+       the liveness traversal, so it doesn't count as a worker. */
+    ThreadPool deletionPool(deleteJobs + 1);
+
+    auto startTime = std::chrono::steady_clock::now();
+
     std::unordered_map<StorePath, StorePathSet> referrersCache;
 
+    /* `maxFreed` doesn't apply to the deletion of specific paths. */
+    bool limitFreed =
+        options.action != GCOptions::gcDeleteSpecific
+        && options.maxFreed != std::numeric_limits<uint64_t>::max();
+
     /* Helper function that visits all paths reachable from `start`
        via the referrers edges and optionally derivers and derivation
        output edges. If none of those paths are roots, then all
@@ -671,11 +954,16 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
         StorePathSet visited;
         std::queue<StorePath> todo;
 
-        /* Wake up any GC client waiting for deletion of the paths in
-           'visited' to finish. */
+        /* Hash parts that we added to `pending` and that haven't been
+           handed over to the deletion workers. */
+        std::unordered_set<std::string> claimed;
+
+        /* Wake up any GC client waiting for the paths in 'visited' to
+           be checked. */
         Finally releasePending([&]() {
             auto shared(_shared.lock());
-            shared->pending.reset();
+            for (auto & hashPart : claimed)
+                shared->pending.erase(hashPart);
             wakeup.notify_all();
         });
 
@@ -688,6 +976,7 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 
         while (auto path = pop(todo)) {
             checkInterrupt();
+            if (limitFreed) checkLimit();
 
             /* Bail out if we've previously discovered that this path
                is alive. */
@@ -730,7 +1019,8 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
                     debug("cannot delete '%s' because it's a temporary root", printStorePath(*path));
                     return markAlive();
                 }
-                shared->pending = hashPart;
+                if (shared->pending.insert(hashPart).second)
+                    claimed.insert(hashPart);
             }
 
             if (isValidPath(*path)) {
@@ -764,20 +1054,57 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
                 }
             }
         }
-        for (auto & path : topoSortPaths(visited)) {
-            if (!dead.insert(path).second) continue;
-            if (shouldDelete) {
+        std::vector<StorePath> newlyDead;
+        for (auto & path : topoSortPaths(visited))
+            if (dead.insert(path).second)
+                newlyDead.push_back(path);
+
+        if (!shouldDelete || newlyDead.empty()) return;
+
+        /* Don't invalidate more of the closure than needed to reach
+           `maxFreed`, counting the deletions that are still in
+           flight. Since `newlyDead` is sorted referrers first, any
+           prefix of it can be deleted on its own; the rest stays
+           valid. */
+        std::unordered_map<StorePath, uint64_t> sizes;
+        bool limitReached = false;
+        if (limitFreed) {
+            auto expected = [&]() {
+                auto deletion(_deletion.lock());
+                return deletion->bytesFreed + deletion->bytesInFlight;
+            }();
+            size_t n = 0;
+            while (n < newlyDead.size() && expected <= options.maxFreed) {
+                auto & path = newlyDead[n++];
+                uint64_t size = 0;
                 try {
-                    invalidatePathChecked(path);
-                    deleteFromStore(path.to_string());
-                    referrersCache.erase(path);
-                } catch (PathInUse &e) {
-                    // If we end up here, it's likely a new occurence
-                    // of https://github.com/NixOS/nix/issues/11923
-                    printError("BUG: %s", e.what());
-                }
+                    size = queryPathInfo(path)->narSize;
+                } catch (InvalidPath &) { }
+                sizes.emplace(path, size);
+                expected += size;
             }
+            if (expected > options.maxFreed) {
+                limitReached = true;
+                for (auto i = n; i < newlyDead.size(); ++i)
+                    dead.erase(newlyDead[i]);
+                newlyDead.erase(newlyDead.begin() + n, newlyDead.end());
+            }
+        }
+
+        /* Invalidate the closure in one transaction, then hand the
+           paths over to the deletion workers. */
+        for (auto & path : invalidatePathsChecked(newlyDead)) {
+            referrersCache.erase(path);
+            auto hashPart = std::string(path.hashPart());
+            std::optional<std::string> pending;
+            if (claimed.erase(hashPart)) pending = hashPart;
+            auto size = sizes.find(path);
+            scheduleDeletion(std::string(path.to_string()), std::move(pending),
+                size != sizes.end() ? size->second : 0, deletionPool);
         }
+
+        if (limitReached)
+            checkLimit();
     };
 
     /* Either delete all garbage paths, or just the specified
@@ -786,12 +1113,16 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 
         for (auto & i : options.pathsToDelete) {
             deleteReferrersClosure(i);
-            if (!dead.count(i))
+            if (!dead.count(i)) {
+                /* Let the deletions that were already started
+                   finish. */
+                deletionPool.process();
                 throw Error(
                     "Cannot delete path '%1%' since it is still alive. "
                     "To find out why, use: "
                     "nix-store --query --roots and nix-store --query --referrers",
                     printStorePath(i));
+            }
         }
 
     } else if (options.maxFreed > 0) {
@@ -802,30 +1133,73 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
             printInfo("determining live/dead paths...");
 
         try {
-            AutoCloseDir dir(opendir(realStoreDir.get().c_str()));
-            if (!dir) throw SysError("opening directory '%1%'", realStoreDir);
-
-            /* Read the store and delete all paths that are invalid or
-               unreachable. We don't use readDirectory() here so that
-               GCing can start faster. */
-            auto linksName = baseNameOf(linksDir);
-            Paths entries;
-            struct dirent * dirent;
-            while (errno = 0, dirent = readdir(dir.get())) {
-                checkInterrupt();
-                std::string name = dirent->d_name;
-                if (name == "." || name == ".." || name == linksName) continue;
-
-                if (auto storePath = maybeParseStorePath(storeDir + "/" + name))
-                    deleteReferrersClosure(*storePath);
-                else
-                    deleteFromStore(name);
+            if (options.maxCandidates && options.action != GCOptions::gcReturnLive) {
+                /* Incremental mode: rather than scanning the whole
+                   store, only look at the oldest paths that nothing
+                   refers to. Their referrers closure is usually just
+                   the path itself, so this is cheap. Candidates that
+                   turn out to be alive don't count, and the cursor
+                   skips past them, so that old rooted paths don't
+                   stop every collection from making progress. */
+                LocalStore::GCCandidatesCursor cursor;
+                auto left = *options.maxCandidates;
+                while (left > 0) {
+                    auto candidates = queryGCCandidates(left, cursor);
+                    if (candidates.empty()) break;
+                    for (auto & path : candidates) {
+                        checkInterrupt();
+                        checkLimit();
+                        deleteReferrersClosure(path);
+                        if (dead.count(path)) left--;
+                    }
+                }
+            } else {
+                AutoCloseDir dir(opendir(realStoreDir.get().c_str()));
+                if (!dir) throw SysError("opening directory '%1%'", realStoreDir);
+
+                /* Read the store and delete all paths that are invalid or
+                   unreachable. We don't use readDirectory() here so that
+                   GCing can start faster. */
+                auto linksName = baseNameOf(linksDir);
+                Paths entries;
+                struct dirent * dirent;
+                while (errno = 0, dirent = readdir(dir.get())) {
+                    checkInterrupt();
+                    checkLimit();
+                    std::string name = dirent->d_name;
+                    if (name == "." || name == ".." || name == linksName) continue;
+
+                    if (auto storePath = maybeParseStorePath(storeDir + "/" + name))
+                        deleteReferrersClosure(*storePath);
+                    else
+                        scheduleDeletion(name, std::nullopt, 0, deletionPool);
 
+                }
             }
         } catch (GCLimitReached & e) {
         }
     }
 
+    /* Wait for the deletion workers to finish. */
+    deletionPool.process();
+
+    {
+        auto deletion(_deletion.lock());
+        results.paths.insert(deletion->paths.begin(), deletion->paths.end());
+        results.bytesFreed += deletion->bytesFreed;
+
+        if (shouldDelete) {
+            auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - startTime).count();
+            printMsg(lvlTalkative, "deleted %d paths (%s) in %.1f s using %d threads (%d paths/s)",
+                deletion->paths.size(),
+                showBytes(deletion->bytesFreed),
+                duration / 1000.0,
+                deleteJobs,
+                duration ? deletion->paths.size() * 1000 / duration : deletion->paths.size());
+        }
+    }
+
     if (options.action == GCOptions::gcReturnLive) {
         for (auto & i : alive)
             results.paths.insert(printStorePath(i));
@@ -849,31 +1223,54 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
         AutoCloseDir dir(opendir(linksDir.c_str()));
         if (!dir) throw SysError("opening directory '%1%'", linksDir);
 
-        int64_t actualSize = 0, unsharedSize = 0;
+        std::atomic<int64_t> actualSize = 0, unsharedSize = 0;
+
+        /* Stat and unlink the links in batches on a pool of
+           workers. */
+        ThreadPool linksPool(deleteJobs);
+
+        auto sweepLinks = [&](const Strings & names) {
+            for (auto & name : names) {
+                checkInterrupt();
+                Path path = linksDir + "/" + name;
+
+                auto st = lstat(path);
+
+                if (st.st_nlink != 1) {
+                    actualSize += st.st_size;
+                    unsharedSize += (st.st_nlink - 1) * st.st_size;
+                    continue;
+                }
+
+                printMsg(lvlTalkative, "deleting unused link '%1%'", path);
+
+                if (unlink(path.c_str()) == -1)
+                    throw SysError("deleting '%1%'", path);
+
+                /* Do not account for deleted file here. Rely on deletePath()
+                   accounting.  */
+            }
+        };
+
+        Strings batch;
 
         struct dirent * dirent;
         while (errno = 0, dirent = readdir(dir.get())) {
             checkInterrupt();
             std::string name = dirent->d_name;
             if (name == "." || name == "..") continue;
-            Path path = linksDir + "/" + name;
-
-            auto st = lstat(path);
-
-            if (st.st_nlink != 1) {
-                actualSize += st.st_size;
-                unsharedSize += (st.st_nlink - 1) * st.st_size;
-                continue;
+            batch.push_back(std::move(name));
+            if (batch.size() >= 1024) {
+                linksPool.enqueue(std::bind(sweepLinks, std::move(batch)));
+                batch.clear();
             }
+        }
+        if (errno) throw SysError("reading directory '%1%'", linksDir);
 
-            printMsg(lvlTalkative, "deleting unused link '%1%'", path);
-
-            if (unlink(path.c_str()) == -1)
-                throw SysError("deleting '%1%'", path);
+        if (!batch.empty())
+            linksPool.enqueue(std::bind(sweepLinks, std::move(batch)));
 
-            /* Do not account for deleted file here. Rely on deletePath()
-               accounting.  */
-        }
+        linksPool.process();
 
         struct stat st;
         if (stat(linksDir.c_str(), &st) == -1)
@@ -953,6 +1350,8 @@ void LocalStore::autoGC(bool sync)
 
                 GCOptions options;
                 options.maxFreed = settings.maxFree - avail;
+                if (settings.autoGCMaxPaths)
+                    options.maxCandidates = settings.autoGCMaxPaths;
 
                 printInfo("running auto-GC to free %d bytes", options.maxFreed);
 
@@ -960,7 +1359,13 @@ void LocalStore::autoGC(bool sync)
 
                 collectGarbage(options, results);
 
-                _state.lock()->availAfterGC = getAvail();
+                /* An incremental collection that freed something may
+                   have left more garbage behind, so don't hold off the
+                   next one. */
+                _state.lock()->availAfterGC =
+                    options.maxCandidates && !results.paths.empty()
+                    ? std::numeric_limits<uint64_t>::max()
+                    : getAvail();
 
             } catch (...) {
                 // FIXME: we could propagate the exception to the
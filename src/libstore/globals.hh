@@ -382,6 +382,23 @@ public:
           This can drastically reduce build times if the network connection between the local machine and the remote build host is slow.
         )"};
 
+    Setting<unsigned int> buildersMaxUploads{
+        this, 1, "builders-max-uploads",
+        R"(
+          The maximum number of concurrent uploads of build inputs to a single [remote build machine](#conf-builders).
+          The default of `1` serialises uploads to each machine.
+          Higher values let builds whose inputs are small start without waiting for large uploads to finish.
+        )"};
+
+    Setting<unsigned int> sshMasterPersist{
+        this, 0, "ssh-master-persist",
+        R"(
+          If non-zero, SSH connections to remote stores and [remote build machines](#conf-builders) go through an SSH master connection that is shared by all Nix processes of the current user.
+          The master connection stays open for this many seconds after its last session has ended (see `ControlPersist` in ssh_config(5)), so subsequent `nix copy`, build hook and `ssh-ng://` store invocations don't have to set up and authenticate a new SSH connection.
+
+          If `0` (the default), each Nix process starts its own master connection when it needs more than one connection to a machine.
+        )"};
+
     Setting<off_t> reservedSize{this, 8 * 1024 * 1024, "gc-reserved-space",
         "Amount of reserved disk space for the garbage collector."};
 
@@ -512,11 +529,26 @@ public:
         this, true, "compress-build-log",
         R"(
           If set to `true` (the default), build logs written to
-          `/nix/var/log/nix/drvs` will be compressed on the fly using bzip2.
+          `/nix/var/log/nix/drvs` will be compressed on the fly using bzip2,
+          or zstd if [`index-build-log`](#conf-index-build-log) is set.
           Otherwise, they will not be compressed.
         )",
         {"build-compress-log"}};
 
+    Setting<bool> indexBuildLog{
+        this, false, "index-build-log",
+        R"(
+          If set to `true`, compressed build logs written to
+          `/nix/var/log/nix/drvs` are stored using zstd in independently
+          compressed chunks of whole lines, so that
+          [`nix log --tail`](@docroot@/command-ref/new-cli/nix3-log.md)
+          doesn't need to decompress the entire log, and
+          `nix log --follow` can show the log of a running build.
+
+          Such logs cannot be read by older versions of Nix or by tools
+          that expect bzip2-compressed logs (such as Hydra).
+        )"};
+
     Setting<unsigned long> maxLogSize{
         this, 0, "max-build-log-size",
         R"(
@@ -561,6 +593,16 @@ public:
         )",
         {"gc-keep-derivations"}};
 
+    Setting<unsigned int> gcDeleteJobs{
+        this, 0, "gc-delete-jobs",
+        R"(
+          The number of threads that the garbage collector uses to delete
+          dead store paths and unused files in `/nix/store/.links`. The
+          default, `0`, uses one thread per CPU core. Set it to `1` to
+          delete paths one at a time, which may be faster on rotational
+          disks.
+        )"};
+
     Setting<bool> autoOptimiseStore{
         this, false, "auto-optimise-store",
         R"(
@@ -1145,6 +1187,24 @@ public:
     Setting<uint64_t> minFreeCheckInterval{this, 5, "min-free-check-interval",
         "Number of seconds between checking free disk space."};
 
+    Setting<uint64_t> autoGCMaxPaths{
+        this, 0, "auto-gc-max-paths",
+        R"(
+          If non-zero, a garbage collection triggered by the `min-free`
+          option doesn't scan the entire Nix store. Instead, it only
+          considers the least recently registered store paths that are not
+          referenced by any other store path, oldest first, until this many
+          of them have been found to be garbage. Paths that are still
+          reachable from a root are skipped.
+          This bounds the amount of work done by each collection, making
+          it suitable for frequent triggers; subsequent collections pick up
+          the paths that became unreferenced.
+
+          Paths in the store directory that are not valid (such as the
+          leftovers of interrupted builds) are only removed by a full
+          garbage collection.
+        )"};
+
     Setting<size_t> narBufferSize{this, 32 * 1024 * 1024, "nar-buffer-size",
         "Maximum size of NARs before spilling them to disk."};
 
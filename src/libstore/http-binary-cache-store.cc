@@ -164,6 +164,35 @@ protected:
         }
     }
 
+    std::optional<FileRange> getFileRange(const std::string & path, uint64_t offset, size_t length) override
+    {
+        checkEnabled();
+        auto request(makeRequest(path));
+        /* Only HTTP reports which part of the file it returned. */
+        if (!hasPrefix(request.uri, "https://") && !hasPrefix(request.uri, "http://"))
+            return BinaryCacheStore::getFileRange(path, offset, length);
+        request.range = {offset, length};
+        try {
+            auto result = getFileTransfer()->download(std::move(request));
+            if (result.totalSize)
+                return FileRange { .data = std::move(result.data), .fileSize = *result.totalSize };
+            /* The server ignored the range and returned the whole file. */
+            auto size = result.data.size();
+            return FileRange {
+                .data = offset < size ? result.data.substr(offset, length) : "",
+                .fileSize = size,
+            };
+        } catch (FileTransferError & e) {
+            if (e.error == FileTransfer::NotFound || e.error == FileTransfer::Forbidden)
+                return std::nullopt;
+            /* E.g. 416 for a range past the end of an empty file. */
+            if (e.error == FileTransfer::Misc)
+                return BinaryCacheStore::getFileRange(path, offset, length);
+            maybeDisable();
+            throw;
+        }
+    }
+
     void getFile(const std::string & path,
         Callback<std::optional<std::string>> callback) noexcept override
     {
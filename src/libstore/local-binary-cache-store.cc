@@ -4,6 +4,7 @@
 #include "signals.hh"
 
 #include <atomic>
+#include <fstream>
 
 namespace nix {
 
@@ -80,6 +81,24 @@ protected:
         }
     }
 
+    std::optional<FileRange> getFileRange(const std::string & path, uint64_t offset, size_t length) override
+    {
+        auto path2 = binaryCacheDir + "/" + path;
+        std::ifstream file(path2, std::ios::binary | std::ios::ate);
+        if (!file) {
+            if (!pathExists(path2)) return std::nullopt;
+            throw SysError("opening '%s'", path2);
+        }
+        uint64_t size = file.tellg();
+        std::string data(offset < size ? std::min<uint64_t>(length, size - offset) : 0, 0);
+        if (!data.empty()) {
+            file.seekg(offset);
+            if (!file.read(data.data(), data.size()))
+                throw Error("reading '%s'", path2);
+        }
+        return FileRange { .data = std::move(data), .fileSize = size };
+    }
+
     StorePathSet queryAllValidPaths() override
     {
         StorePathSet paths;
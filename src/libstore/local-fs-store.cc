@@ -4,6 +4,7 @@
 #include "local-fs-store.hh"
 #include "globals.hh"
 #include "compression.hh"
+#include "build-log.hh"
 #include "derivations.hh"
 
 namespace nix {
@@ -89,21 +90,33 @@ void LocalFSStore::narFromPath(const StorePath & path, Sink & sink)
 
 const std::string LocalFSStore::drvsLogDir = "drvs";
 
-std::optional<std::string> LocalFSStore::getBuildLogExact(const StorePath & path)
+std::vector<Path> LocalFSStore::buildLogPaths(const StorePath & drvPath)
 {
-    auto baseName = path.to_string();
+    auto baseName = drvPath.to_string();
+    return {
+        fmt("%s/%s/%s/%s", logDir, drvsLogDir, baseName.substr(0, 2), baseName.substr(2)),
+        fmt("%s/%s/%s", logDir, drvsLogDir, baseName),
+    };
+}
 
-    for (int j = 0; j < 2; j++) {
+std::optional<std::string> LocalFSStore::getBuildLogExact(const StorePath & path)
+{
+    for (auto & logPath : buildLogPaths(path)) {
 
-        Path logPath =
-            j == 0
-            ? fmt("%s/%s/%s/%s", logDir, drvsLogDir, baseName.substr(0, 2), baseName.substr(2))
-            : fmt("%s/%s/%s", logDir, drvsLogDir, baseName);
+        Path logZstPath = logPath + ".zst";
         Path logBz2Path = logPath + ".bz2";
 
         if (pathExists(logPath))
             return readFile(logPath);
 
+        else if (pathExists(logZstPath)) {
+            try {
+                StringSink sink;
+                readIndexedBuildLogFile(logZstPath, {}, sink);
+                return std::move(sink.s);
+            } catch (Error &) { }
+        }
+
         else if (pathExists(logBz2Path)) {
             try {
                 return decompress("bzip2", readFile(logBz2Path));
@@ -115,4 +128,17 @@ std::optional<std::string> LocalFSStore::getBuildLogExact(const StorePath & path
     return std::nullopt;
 }
 
+bool LocalFSStore::readBuildLogExact(const StorePath & path, const BuildLogFilter & filter, Sink & sink)
+{
+    for (auto & logPath : buildLogPaths(path)) {
+        Path logZstPath = logPath + ".zst";
+        if (pathExists(logZstPath)) {
+            readIndexedBuildLogFile(logZstPath, filter, sink);
+            return true;
+        }
+    }
+
+    return LogStore::readBuildLogExact(path, filter, sink);
+}
+
 }
@@ -80,6 +80,16 @@ public:
 
     std::optional<std::string> getBuildLogExact(const StorePath & path) override;
 
+    bool readBuildLogExact(const StorePath & path, const BuildLogFilter & filter, Sink & sink) override;
+
+private:
+
+    /**
+     * The locations of the log of `drvPath`, without the extension
+     * that indicates its compression method.
+     */
+    std::vector<Path> buildLogPaths(const StorePath & drvPath);
+
 };
 
 }
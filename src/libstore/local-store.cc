@@ -12,6 +12,7 @@
 #include "topo-sort.hh"
 #include "finally.hh"
 #include "compression.hh"
+#include "build-log.hh"
 #include "signals.hh"
 #include "posix-fs-canonicalise.hh"
 #include "posix-source-accessor.hh"
@@ -93,6 +94,9 @@ struct LocalStore::State::Stmts {
     SQLiteStmt QueryValidPaths;
     SQLiteStmt QueryRealisationReferences;
     SQLiteStmt AddRealisationReference;
+    SQLiteStmt MarkPathOptimised;
+    SQLiteStmt QueryUnoptimisedPaths;
+    SQLiteStmt QueryGCCandidates;
 };
 
 LocalStore::LocalStore(
@@ -333,6 +337,19 @@ LocalStore::LocalStore(
     state->stmts->QueryPathFromHashPart.create(state->db,
         "select path from ValidPaths where path >= ? limit 1;");
     state->stmts->QueryValidPaths.create(state->db, "select path from ValidPaths");
+    state->stmts->QueryGCCandidates.create(state->db,
+        R"(
+            select id, registrationTime, path from ValidPaths v
+                where (registrationTime > ? or (registrationTime = ? and id > ?))
+                  and not exists (select 1 from Refs where reference = v.id and referrer != v.id)
+                order by registrationTime, id limit ?;
+        )");
+    if (!readOnly) {
+        state->stmts->MarkPathOptimised.create(state->db,
+            "insert or ignore into OptimisedPaths (id) select id from ValidPaths where path = ?;");
+        state->stmts->QueryUnoptimisedPaths.create(state->db,
+            "select path from ValidPaths where id not in (select id from OptimisedPaths);");
+    }
     if (experimentalFeatureSettings.isEnabled(Xp::CaDerivations)) {
         state->stmts->RegisterRealisedOutput.create(state->db,
             R"(
@@ -566,6 +583,18 @@ void LocalStore::upgradeDBSchema(State & state)
             "20220326-ca-derivations",
             #include "ca-specific-schema.sql.gen.hh"
             );
+
+    if (!readOnly) {
+        doUpgrade(
+            "20261018-optimised-paths",
+            #include "optimised-paths-schema.sql.gen.hh"
+            );
+
+        /* Used by queryGCCandidates(). */
+        doUpgrade(
+            "20261018-registration-time-index",
+            "create index if not exists IndexRegistrationTime on ValidPaths(registrationTime)");
+    }
 }
 
 
@@ -708,11 +737,8 @@ uint64_t LocalStore::addValidPath(State & state,
         }
     }
 
-    {
-        auto state_(Store::state.lock());
-        state_->pathInfoCache.upsert(std::string(info.path.to_string()),
-            PathInfoCacheValue{ .value = std::make_shared<const ValidPathInfo>(info) });
-    }
+    pathInfoCache.upsert(info.path,
+        PathInfoCacheValue{ .value = std::make_shared<const ValidPathInfo>(info) });
 
     return id;
 }
@@ -837,6 +863,56 @@ StorePathSet LocalStore::queryAllValidPaths()
 }
 
 
+StorePathSet LocalStore::queryUnoptimisedPaths()
+{
+    /* The statement isn't prepared in read-only mode, since the
+       database may predate the OptimisedPaths table. */
+    if (readOnly)
+        throw Error("cannot optimise the Nix store in read-only mode");
+
+    return retrySQLite<StorePathSet>([&]() {
+        auto state(_state.lock());
+        auto use(state->stmts->QueryUnoptimisedPaths.use());
+        StorePathSet res;
+        while (use.next()) res.insert(parseStorePath(use.getStr(0)));
+        return res;
+    });
+}
+
+
+std::vector<StorePath> LocalStore::queryGCCandidates(uint64_t limit, GCCandidatesCursor & cursor)
+{
+    return retrySQLite<std::vector<StorePath>>([&]() {
+        auto state(_state.lock());
+        auto use(state->stmts->QueryGCCandidates.use()
+            (cursor.registrationTime)
+            (cursor.registrationTime)
+            (cursor.id)
+            ((int64_t) std::min(limit, (uint64_t) std::numeric_limits<int64_t>::max())));
+        std::vector<StorePath> res;
+        auto newCursor = cursor;
+        while (use.next()) {
+            newCursor = {.registrationTime = use.getInt(1), .id = use.getInt(0)};
+            res.push_back(parseStorePath(use.getStr(2)));
+        }
+        cursor = newCursor;
+        return res;
+    });
+}
+
+
+void LocalStore::markPathOptimised(const StorePath & path)
+{
+    if (readOnly)
+        throw Error("cannot record that path '%s' is optimised in read-only mode", printStorePath(path));
+
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        state->stmts->MarkPathOptimised.use()(printStorePath(path)).exec();
+    });
+}
+
+
 void LocalStore::queryReferrers(State & state, const StorePath & path, StorePathSet & referrers)
 {
     auto useQueryReferrers(state.stmts->QueryReferrers.use()(printStorePath(path)));
@@ -977,6 +1053,21 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
                 state->stmts->AddReference.use()(referrer)(queryValidPathId(*state, j)).exec();
         }
 
+        /* Record the paths that optimisePath() already deduplicated,
+           so that optimiseStore() won't read them again. */
+        StringSet optimised;
+        {
+            auto optimisedUnregistered_(optimisedUnregistered.lock());
+            for (auto & [_, i] : infos) {
+                std::string name(i.path.to_string());
+                if (optimisedUnregistered_->count(name))
+                    optimised.insert(std::move(name));
+            }
+        }
+        for (auto & [_, i] : infos)
+            if (optimised.count(std::string(i.path.to_string())))
+                state->stmts->MarkPathOptimised.use()(printStorePath(i.path)).exec();
+
         /* Check that the derivation outputs are correct.  We can't do
            this in addValidPath() above, because the references might
            not be valid yet. */
@@ -1003,6 +1094,10 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
             }});
 
         txn.commit();
+
+        auto optimisedUnregistered_(optimisedUnregistered.lock());
+        for (auto & name : optimised)
+            optimisedUnregistered_->erase(name);
     });
 }
 
@@ -1018,10 +1113,7 @@ void LocalStore::invalidatePath(State & state, const StorePath & path)
     /* Note that the foreign key constraints on the Refs table take
        care of deleting the references entries for `path'. */
 
-    {
-        auto state_(Store::state.lock());
-        state_->pathInfoCache.erase(std::string(path.to_string()));
-    }
+    pathInfoCache.erase(path);
 }
 
 const PublicKeys & LocalStore::getPublicKeys()
@@ -1368,6 +1460,38 @@ void LocalStore::invalidatePathChecked(const StorePath & path)
 }
 
 
+std::vector<StorePath> LocalStore::invalidatePathsChecked(const std::vector<StorePath> & paths)
+{
+    return retrySQLite<std::vector<StorePath>>([&]() {
+        auto state(_state.lock());
+
+        SQLiteTxn txn(state->db);
+
+        std::vector<StorePath> invalidated;
+
+        for (auto & path : paths) {
+            if (isValidPath_(*state, path)) {
+                StorePathSet referrers; queryReferrers(*state, path, referrers);
+                referrers.erase(path); /* ignore self-references */
+                if (!referrers.empty()) {
+                    // If we end up here, it's likely a new occurence
+                    // of https://github.com/NixOS/nix/issues/11923
+                    printError("BUG: cannot delete path '%s' because it is in use by %s",
+                        printStorePath(path), showPaths(referrers));
+                    continue;
+                }
+                invalidatePath(*state, path);
+            }
+            invalidated.push_back(path);
+        }
+
+        txn.commit();
+
+        return invalidated;
+    });
+}
+
+
 bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
 {
     printInfo("reading the Nix store...");
@@ -1693,15 +1817,16 @@ void LocalStore::addBuildLog(const StorePath & drvPath, std::string_view log)
 
     auto baseName = drvPath.to_string();
 
-    auto logPath = fmt("%s/%s/%s/%s.bz2", logDir, drvsLogDir, baseName.substr(0, 2), baseName.substr(2));
+    auto logPathBase = fmt("%s/%s/%s/%s", logDir, drvsLogDir, baseName.substr(0, 2), baseName.substr(2));
+    auto logPath = logPathBase + (settings.indexBuildLog ? ".zst" : ".bz2");
 
-    if (pathExists(logPath)) return;
+    if (pathExists(logPathBase + ".zst") || pathExists(logPathBase + ".bz2")) return;
 
     createDirs(dirOf(logPath));
 
     auto tmpFile = fmt("%s.tmp.%d", logPath, getpid());
 
-    writeFile(tmpFile, compress("bzip2", log));
+    writeFile(tmpFile, settings.indexBuildLog ? compressBuildLog(log) : compress("bzip2", log));
 
     std::filesystem::rename(tmpFile, logPath);
 }
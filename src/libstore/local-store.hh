@@ -32,6 +32,22 @@ struct OptimiseStats
 {
     unsigned long filesLinked = 0;
     uint64_t bytesFreed = 0;
+
+    /**
+     * Number and total size of the files that had to be read and
+     * hashed.
+     */
+    unsigned long filesHashed = 0;
+    uint64_t bytesHashed = 0;
+
+    OptimiseStats & operator += (const OptimiseStats & other)
+    {
+        filesLinked += other.filesLinked;
+        bytesFreed += other.bytesFreed;
+        filesHashed += other.filesHashed;
+        bytesHashed += other.bytesHashed;
+        return *this;
+    }
 };
 
 struct LocalStoreConfig : virtual LocalFSStoreConfig
@@ -257,7 +273,9 @@ public:
 
     /**
      * Optimise the disk space usage of the Nix store by hard-linking
-     * files with the same contents.
+     * files with the same contents. Paths are processed in parallel,
+     * and only paths that have not been recorded as optimised by a
+     * previous run are considered.
      */
     void optimiseStore(OptimiseStats & stats);
 
@@ -371,6 +389,14 @@ private:
      */
     void invalidatePathChecked(const StorePath & path);
 
+    /**
+     * Like `invalidatePathChecked()`, but invalidates all of `paths`,
+     * which must be sorted topologically (referrers first), in a single
+     * transaction. Paths that still have referrers are skipped. Returns
+     * the paths that are no longer valid.
+     */
+    std::vector<StorePath> invalidatePathsChecked(const std::vector<StorePath> & paths);
+
     std::shared_ptr<const ValidPathInfo> queryPathInfoInternal(State & state, const StorePath & path);
 
     void updatePathInfo(State & state, const ValidPathInfo & info);
@@ -378,9 +404,49 @@ private:
     PathSet queryValidPathsOld();
     ValidPathInfo queryPathInfoOld(const Path & path);
 
-    void findRoots(const Path & path, std::filesystem::file_type type, Roots & roots);
+    /**
+     * What a scan of the permanent roots depended on, so that a later
+     * bounded collection can check cheaply whether it still holds.
+     */
+    struct PermRootsScan
+    {
+        /**
+         * The directories that were read, with their modification
+         * time in nanoseconds.
+         */
+        std::map<Path, int64_t> dirs;
+
+        /**
+         * Paths outside of the directories above, such as the targets
+         * of indirect roots, and what they were (see `linkState()` in
+         * gc.cc).
+         */
+        std::map<Path, std::string> links;
+
+        /**
+         * Every store path a root points to, valid or not.
+         */
+        StorePathSet roots;
+
+        /**
+         * Whether a directory changed too recently to trust its
+         * modification time.
+         */
+        bool racy = false;
+    };
+
+    void findRoots(const Path & path, std::filesystem::file_type type, Roots & roots, PermRootsScan * scan = nullptr);
 
-    void findRootsNoTemp(Roots & roots, bool censor);
+    void findRootsNoTemp(Roots & roots, bool censor, PermRootsScan * scan = nullptr);
+
+    /**
+     * Add the permanent roots recorded by the last root scan to
+     * `roots`, if none of the directories or indirect roots it looked
+     * at have changed since. Return false otherwise.
+     */
+    bool readPermRootsCache(StorePathSet & roots);
+
+    void writePermRootsCache(const PermRootsScan & scan);
 
     void findRuntimeRoots(Roots & roots, bool censor);
 
@@ -389,8 +455,53 @@ private:
     typedef std::unordered_set<ino_t> InodeHash;
 
     InodeHash loadInodeHash();
-    Strings readDirectoryIgnoringInodes(const Path & path, const InodeHash & inodeHash);
-    void optimisePath_(Activity * act, OptimiseStats & stats, const Path & path, InodeHash & inodeHash, RepairFlag repair);
+    Strings readDirectoryIgnoringInodes(const Path & path, Sync<InodeHash> & inodeHash);
+
+    /**
+     * Deduplicate the files in `path`. Return whether every file was
+     * processed, i.e. none were skipped.
+     */
+    bool optimisePath_(Activity * act, OptimiseStats & stats, const Path & path, Sync<InodeHash> & inodeHash, RepairFlag repair);
+
+    /**
+     * Return the valid paths that have not been recorded as optimised
+     * yet.
+     */
+    StorePathSet queryUnoptimisedPaths();
+
+    /**
+     * The position of `queryGCCandidates()` in the list of GC
+     * candidates, i.e. the registration time and ID of the last path
+     * it returned.
+     */
+    struct GCCandidatesCursor
+    {
+        int64_t registrationTime = std::numeric_limits<int64_t>::min();
+        int64_t id = 0;
+    };
+
+    /**
+     * Return up to `limit` valid paths that have no referrers other
+     * than themselves, least recently registered first, starting
+     * after `cursor`, and advance `cursor` past them.
+     */
+    std::vector<StorePath> queryGCCandidates(uint64_t limit, GCCandidatesCursor & cursor);
+
+    /**
+     * Record in the database that all files in `path` have been
+     * deduplicated.
+     */
+    void markPathOptimised(const StorePath & path);
+
+    /**
+     * Base names of paths that were deduplicated by `optimisePath()`
+     * but are not valid yet. `registerValidPaths()` marks them as
+     * optimised, so that `optimiseStore()` doesn't have to read them
+     * again. Entries are removed once that transaction has committed.
+     */
+    Sync<StringSet> optimisedUnregistered;
+
+    static constexpr size_t maxOptimisedUnregistered = 10000;
 
     // Internal versions that are not wrapped in retry_sqlite.
     bool isValidPath_(State & state, const StorePath & path);
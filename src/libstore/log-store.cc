@@ -9,4 +9,21 @@ std::optional<std::string> LogStore::getBuildLog(const StorePath & path) {
     return getBuildLogExact(maybePath.value());
 }
 
+bool LogStore::readBuildLog(const StorePath & path, const BuildLogFilter & filter, Sink & sink)
+{
+    auto maybePath = getBuildDerivationPath(path);
+    if (!maybePath)
+        return false;
+    return readBuildLogExact(maybePath.value(), filter, sink);
+}
+
+bool LogStore::readBuildLogExact(const StorePath & path, const BuildLogFilter & filter, Sink & sink)
+{
+    auto log = getBuildLogExact(path);
+    if (!log)
+        return false;
+    filterBuildLog(*log, filter, sink);
+    return true;
+}
+
 }
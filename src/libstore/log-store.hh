@@ -2,7 +2,7 @@
 ///@file
 
 #include "store-api.hh"
-
+#include "build-log.hh"
 
 namespace nix {
 
@@ -18,6 +18,23 @@ struct LogStore : public virtual Store
 
     virtual std::optional<std::string> getBuildLogExact(const StorePath & path) = 0;
 
+    /**
+     * Write the lines of the build log of the specified store path
+     * that are selected by `filter` to `sink`.
+     *
+     * @return false if the log is not available.
+     */
+    bool readBuildLog(const StorePath & path, const BuildLogFilter & filter, Sink & sink);
+
+    /**
+     * Like `readBuildLog()`, but for the log of the derivation
+     * `path`. The default implementation gets the whole log using
+     * `getBuildLogExact()` and doesn't support following it. Stores
+     * that keep logs in the indexed format only decompress the parts
+     * they need.
+     */
+    virtual bool readBuildLogExact(const StorePath & path, const BuildLogFilter & filter, Sink & sink);
+
     virtual void addBuildLog(const StorePath & path, std::string_view log) = 0;
 
     static LogStore & require(Store & store);
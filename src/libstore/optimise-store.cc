@@ -3,6 +3,8 @@
 #include "signals.hh"
 #include "posix-fs-canonicalise.hh"
 #include "posix-source-accessor.hh"
+#include "thread-pool.hh"
+#include "finally.hh"
 
 #include <cstdlib>
 #include <cstring>
@@ -12,6 +14,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <regex>
+#include <chrono>
 
 
 namespace nix {
@@ -63,9 +66,9 @@ LocalStore::InodeHash LocalStore::loadInodeHash()
 }
 
 
-Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, const InodeHash & inodeHash)
+Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, Sync<InodeHash> & inodeHash_)
 {
-    Strings names;
+    std::vector<std::pair<std::string, ino_t>> entries;
 
     AutoCloseDir dir(opendir(path.c_str()));
     if (!dir) throw SysError("opening directory '%1%'", path);
@@ -73,24 +76,31 @@ Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, const InodeHa
     struct dirent * dirent;
     while (errno = 0, dirent = readdir(dir.get())) { /* sic */
         checkInterrupt();
-
-        if (inodeHash.count(dirent->d_ino)) {
-            debug("'%1%' is already linked", dirent->d_name);
-            continue;
-        }
-
         std::string name = dirent->d_name;
         if (name == "." || name == "..") continue;
-        names.push_back(name);
+        entries.emplace_back(std::move(name), dirent->d_ino);
     }
     if (errno) throw SysError("reading directory '%1%'", path);
 
+    /* Filter the entries under a single acquisition of the lock,
+       since other threads may be optimising other paths. */
+    Strings names;
+    auto inodeHash(inodeHash_.lock());
+
+    for (auto & [name, ino] : entries) {
+        if (inodeHash->count(ino)) {
+            debug("'%1%' is already linked", name);
+            continue;
+        }
+        names.push_back(std::move(name));
+    }
+
     return names;
 }
 
 
-void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
-    const Path & path, InodeHash & inodeHash, RepairFlag repair)
+bool LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
+    const Path & path, Sync<InodeHash> & inodeHash, RepairFlag repair)
 {
     checkInterrupt();
 
@@ -106,15 +116,17 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
     if (std::regex_search(path, std::regex("\\.app/Contents/.+$")))
     {
         debug("'%1%' is not allowed to be linked in macOS", path);
-        return;
+        return true;
     }
 #endif
 
     if (S_ISDIR(st.st_mode)) {
         Strings names = readDirectoryIgnoringInodes(path, inodeHash);
+        bool complete = true;
         for (auto & i : names)
-            optimisePath_(act, stats, path + "/" + i, inodeHash, repair);
-        return;
+            if (!optimisePath_(act, stats, path + "/" + i, inodeHash, repair))
+                complete = false;
+        return complete;
     }
 
     /* We can hard link regular files and maybe symlinks. */
@@ -122,7 +134,7 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
 #if CAN_LINK_SYMLINK
         && !S_ISLNK(st.st_mode)
 #endif
-        ) return;
+        ) return true;
 
     /* Sometimes SNAFUs can cause files in the Nix store to be
        modified, in particular when running programs as root under
@@ -130,13 +142,13 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
        those files.  FIXME: check the modification time. */
     if (S_ISREG(st.st_mode) && (st.st_mode & S_IWUSR)) {
         warn("skipping suspicious writable file '%1%'", path);
-        return;
+        return false;
     }
 
     /* This can still happen on top-level files. */
-    if (st.st_nlink > 1 && inodeHash.count(st.st_ino)) {
+    if (st.st_nlink > 1 && inodeHash.lock()->count(st.st_ino)) {
         debug("'%s' is already linked, with %d other file(s)", path, st.st_nlink - 2);
-        return;
+        return true;
     }
 
     /* Hash the file.  Note that hashPath() returns the hash over the
@@ -155,6 +167,9 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
     });
     debug("'%1%' has hash '%2%'", path, hash.to_string(HashFormat::Nix32, true));
 
+    stats.filesHashed++;
+    stats.bytesHashed += st.st_size;
+
     /* Check if this is a known hash. */
     std::filesystem::path linkPath = std::filesystem::path{linksDir} / hash.to_string(HashFormat::Nix32, false);
 
@@ -180,7 +195,7 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
         /* Nope, create a hard link in the links directory. */
         try {
             std::filesystem::create_hard_link(path, linkPath);
-            inodeHash.insert(st.st_ino);
+            inodeHash.lock()->insert(st.st_ino);
         } catch (std::filesystem::filesystem_error & e) {
             if (e.code() == std::errc::file_exists) {
                 /* Fall through if another process created ‘linkPath’ before
@@ -193,7 +208,7 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
                    just effectively disable deduplication of this
                    file.  */
                 printInfo("cannot link '%s' to '%s': %s", linkPath, path, strerror(errno));
-                return;
+                return false;
             }
 
             else throw;
@@ -206,7 +221,7 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
 
     if (st.st_ino == stLink.st_ino) {
         debug("'%1%' is already linked to '%2%'", path, linkPath);
-        return;
+        return true;
     }
 
     printMsg(lvlTalkative, "linking '%1%' to '%2%'", path, linkPath);
@@ -226,7 +241,7 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
 
     try {
         std::filesystem::create_hard_link(linkPath, tempLink);
-        inodeHash.insert(st.st_ino);
+        inodeHash.lock()->insert(st.st_ino);
     } catch (std::filesystem::filesystem_error & e) {
         if (e.code() == std::errc::too_many_links) {
             /* Too many links to the same file (>= 32000 on most file
@@ -234,7 +249,7 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
                Just shrug and ignore. */
             if (st.st_size)
                 printInfo("'%1%' has maximum number of links", linkPath);
-            return;
+            return false;
         }
         throw;
     }
@@ -251,7 +266,7 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
                temporarily increases the st_nlink field before
                decreasing it again.) */
             debug("'%s' has reached maximum number of links", linkPath);
-            return;
+            return false;
         }
         throw;
     }
@@ -265,6 +280,8 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
             , st.st_blocks
 #endif
             );
+
+    return true;
 }
 
 
@@ -272,42 +289,95 @@ void LocalStore::optimiseStore(OptimiseStats & stats)
 {
     Activity act(*logger, actOptimiseStore);
 
-    auto paths = queryAllValidPaths();
-    InodeHash inodeHash = loadInodeHash();
+    /* Paths that were deduplicated by a previous run, or by
+       auto-optimise-store when they were added, are recorded in the
+       database and don't need to be read again. */
+    auto paths = queryUnoptimisedPaths();
 
     act.progress(0, paths.size());
 
-    uint64_t done = 0;
+    if (paths.empty()) return;
 
-    for (auto & i : paths) {
-        addTempRoot(i);
-        if (!isValidPath(i)) continue; /* path was GC'ed, probably */
-        {
-            Activity act(*logger, lvlTalkative, actUnknown, fmt("optimising path '%s'", printStorePath(i)));
-            optimisePath_(&act, stats, realStoreDir + "/" + std::string(i.to_string()), inodeHash, NoRepair);
-        }
-        done++;
-        act.progress(done, paths.size());
-    }
+    /* Note that this still reads all of the links directory, so the
+       cost of a run that has anything to do is at least proportional
+       to the number of distinct files in the store. It's only a
+       readdir(), though, which is much cheaper than hashing. */
+    Sync<InodeHash> inodeHash(loadInodeHash());
+
+    Sync<OptimiseStats> stats_;
+    std::atomic<uint64_t> done{0};
+
+    /* Hashing is the dominant cost, so process several paths
+       concurrently. Different store paths never share directories,
+       so the only shared state is the set of linked inodes. */
+    ThreadPool pool;
+
+    for (auto & path : paths)
+        pool.enqueue([&, path]() {
+            addTempRoot(path);
+            if (!isValidPath(path)) return; /* path was GC'ed, probably */
+
+            OptimiseStats pathStats;
+            bool complete;
+            {
+                Activity act(*logger, lvlTalkative, actUnknown, fmt("optimising path '%s'", printStorePath(path)));
+                complete = optimisePath_(&act, pathStats, realStoreDir + "/" + std::string(path.to_string()), inodeHash, NoRepair);
+            }
+
+            /* Files that were skipped (e.g. because the link count
+               was exhausted) may be linked by a later run. */
+            if (complete)
+                markPathOptimised(path);
+
+            *stats_.lock() += pathStats;
+            act.progress(++done, paths.size());
+        });
+
+    Finally addStats([&]() { stats += *stats_.lock(); });
+
+    pool.process();
 }
 
 void LocalStore::optimiseStore()
 {
     OptimiseStats stats;
 
+    auto before = std::chrono::steady_clock::now();
+
     optimiseStore(stats);
 
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - before).count();
+
     printInfo("%s freed by hard-linking %d files",
         showBytes(stats.bytesFreed),
         stats.filesLinked);
+
+    printMsg(lvlTalkative, "hashed %d files (%s) in %.1f s (%s/s)",
+        stats.filesHashed,
+        showBytes(stats.bytesHashed),
+        duration / 1000.0,
+        showBytes(duration ? stats.bytesHashed * 1000 / duration : stats.bytesHashed));
 }
 
 void LocalStore::optimisePath(const Path & path, RepairFlag repair)
 {
     OptimiseStats stats;
-    InodeHash inodeHash;
+    Sync<InodeHash> inodeHash;
 
-    if (settings.autoOptimiseStore) optimisePath_(nullptr, stats, path, inodeHash, repair);
+    if (settings.autoOptimiseStore
+        && optimisePath_(nullptr, stats, path, inodeHash, repair))
+    {
+        /* Remember that this path has been deduplicated so that
+           registerValidPaths() can record it. This is only a hint,
+           so forget about paths that never became valid (e.g. the
+           outputs of failed builds) rather than growing without
+           bound. */
+        auto optimisedUnregistered_(optimisedUnregistered.lock());
+        if (optimisedUnregistered_->size() >= maxOptimisedUnregistered)
+            optimisedUnregistered_->clear();
+        optimisedUnregistered_->insert(std::string(baseNameOf(path)));
+    }
 }
 
 
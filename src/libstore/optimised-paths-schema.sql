@@ -0,0 +1,9 @@
+-- Extension of the sql schema recording which store paths have
+-- already been deduplicated by `nix-store --optimise` or
+-- `auto-optimise-store`, so that the optimiser only has to look at
+-- new paths.
+
+create table if not exists OptimisedPaths (
+    id integer primary key not null,
+    foreign key (id) references ValidPaths(id) on delete cascade
+);
@@ -814,6 +814,10 @@ void RemoteStore::collectGarbage(const GCOptions & options, GCResults & results)
         << options.maxFreed
         /* removed options */
         << 0 << 0 << 0;
+    if (conn->features.count(WorkerProto::featureGCMaxCandidates))
+        conn->to << options.maxCandidates.value_or(0);
+    else if (options.maxCandidates)
+        warn("the daemon does not support incremental garbage collection; doing a full collection");
 
     conn.processStderr();
 
@@ -821,10 +825,7 @@ void RemoteStore::collectGarbage(const GCOptions & options, GCResults & results)
     results.bytesFreed = readLongLong(conn->from);
     readLongLong(conn->from); // obsolete
 
-    {
-        auto state_(Store::state.lock());
-        state_->pathInfoCache.clear();
-    }
+    pathInfoCache.clear();
 }
 
 
@@ -4,6 +4,9 @@
 #include "environment-variables.hh"
 #include "util.hh"
 #include "exec.hh"
+#include "hash.hh"
+#include "users.hh"
+#include "pathlocks.hh"
 
 namespace nix {
 
@@ -21,14 +24,16 @@ SSHMaster::SSHMaster(
     std::string_view host,
     std::string_view keyFile,
     std::string_view sshPublicHostKey,
-    bool useMaster, bool compress, Descriptor logFD)
+    bool useMaster, bool compress, Descriptor logFD,
+    unsigned int persist)
     : host(host)
     , fakeSSH(host == "localhost")
     , keyFile(keyFile)
     , sshPublicHostKey(parsePublicHostKey(host, sshPublicHostKey))
-    , useMaster(useMaster && !fakeSSH)
+    , useMaster((useMaster || persist) && !fakeSSH)
     , compress(compress)
     , logFD(logFD)
+    , persist(persist)
 {
     if (host == "" || hasPrefix(host, "-"))
         throw Error("invalid SSH host name '%s'", host);
@@ -72,14 +77,34 @@ void SSHMaster::addCommonSSHOpts(Strings & args)
     args.push_back("-oLocalCommand=echo started");
 }
 
-bool SSHMaster::isMasterRunning() {
-    Strings args = {"-O", "check", host};
+bool SSHMaster::isMasterRunning(const Path & socketPath) {
+    Strings args = {"-O", "check"};
+    if (socketPath != "")
+        args.insert(args.end(), {"-S", socketPath});
+    args.push_back(host);
     addCommonSSHOpts(args);
 
     auto res = runProgram(RunOptions {.program = "ssh", .args = args, .mergeStderrToStdout = true});
     return res.first == 0;
 }
 
+Path SSHMaster::getPersistentSocketPath()
+{
+    /* Only share a master connection between processes that would
+       have set it up in the same way. */
+    auto key = fmt("%s\n%s\n%s\n%d\n%s",
+        host, keyFile, sshPublicHostKey, compress, getEnv("NIX_SSHOPTS").value_or(""));
+
+    /* Keep the path short, since socket paths are limited to about
+       100 bytes. */
+    auto name = hashString(HashAlgorithm::SHA256, key).to_string(HashFormat::Nix32, false).substr(0, 32);
+
+    auto runtimeDir = getEnv("XDG_RUNTIME_DIR");
+    auto dir = runtimeDir ? *runtimeDir + "/nix/ssh" : getCacheDir() + "/ssh";
+
+    return dir + "/" + name + ".sock";
+}
+
 Strings createSSHEnv()
 {
     // Copy the environment and set SHELL=/bin/sh
@@ -189,9 +214,21 @@ Path SSHMaster::startMaster()
 
     auto state(state_.lock());
 
-    if (state->sshMaster != INVALID_DESCRIPTOR) return state->socketPath;
+    if (state->sshMaster != INVALID_DESCRIPTOR || state->persistentMaster) return state->socketPath;
 
-    state->socketPath = (Path) *state->tmpDir + "/ssh.sock";
+    AutoCloseFD persistLock;
+
+    if (persist) {
+        /* Reuse the master connection of a previous process if it's
+           still alive. This is checked once per process; while we
+           use the master, it doesn't time out. The lock prevents
+           concurrent processes from starting several masters. */
+        state->socketPath = getPersistentSocketPath();
+        createDirs(dirOf(state->socketPath));
+        persistLock = openLockFile(state->socketPath + ".lock", true);
+        lockFile(persistLock.get(), ltWrite, true);
+    } else
+        state->socketPath = (Path) *state->tmpDir + "/ssh.sock";
 
     Pipe out;
     out.create();
@@ -201,10 +238,16 @@ Path SSHMaster::startMaster()
 
     auto suspension = logger->suspend();
 
-    if (isMasterRunning())
+    if (isMasterRunning(persist ? state->socketPath : "")) {
+        state->persistentMaster = persist;
         return state->socketPath;
+    }
+
+    /* Remove the socket of a master that has died. */
+    if (persist)
+        unlink(state->socketPath.c_str());
 
-    state->sshMaster = startProcess([&]() {
+    Pid master = startProcess([&]() {
         restoreProcessContext();
 
         close(out.readSide.get());
@@ -212,7 +255,22 @@ Path SSHMaster::startMaster()
         if (dup2(out.writeSide.get(), STDOUT_FILENO) == -1)
             throw SysError("duping over stdout");
 
+        /* A persistent master outlives us, so it must not keep our
+           stderr open: that may be the pipe of a build hook, whose
+           reader would never see EOF. Log to a file next to the
+           socket instead. */
+        if (persist) {
+            auto logPath = state->socketPath + ".log";
+            AutoCloseFD log = open(logPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+            if (!log)
+                throw SysError("creating '%s'", logPath);
+            if (dup2(log.get(), STDERR_FILENO) == -1)
+                throw SysError("duping over stderr");
+        }
+
         Strings args = { "ssh", host.c_str(), "-M", "-N", "-S", state->socketPath };
+        if (persist)
+            args.insert(args.end(), {"-f", fmt("-oControlPersist=%ds", persist)});
         if (verbosity >= lvlChatty)
             args.push_back("-v");
         addCommonSSHOpts(args);
@@ -234,6 +292,15 @@ Path SSHMaster::startMaster()
         throw Error("failed to start SSH master connection to '%s'", host);
     }
 
+    if (persist) {
+        /* With `-f`, ssh moves the master connection into the
+           background once it is established, and exits. The master
+           must outlive us, so don't keep a `Pid` that would kill it. */
+        master.wait();
+        state->persistentMaster = true;
+    } else
+        state->sshMaster = master.release();
+
     return state->socketPath;
 }
 
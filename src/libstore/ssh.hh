@@ -21,6 +21,11 @@ private:
     const bool useMaster;
     const bool compress;
     const Descriptor logFD;
+    /**
+     * If non-zero, use a master connection shared with other processes
+     * that stays open for this many seconds after its last use.
+     */
+    const unsigned int persist;
 
     struct State
     {
@@ -29,12 +34,30 @@ private:
 #endif
         std::unique_ptr<AutoDelete> tmpDir;
         Path socketPath;
+
+        /**
+         * Whether the persistent master connection on `socketPath`
+         * is known to be running.
+         */
+        bool persistentMaster = false;
     };
 
     Sync<State> state_;
 
     void addCommonSSHOpts(Strings & args);
-    bool isMasterRunning();
+
+    /**
+     * Check whether the master connection listening on `socketPath`,
+     * or the one configured in the user's SSH configuration if empty,
+     * is alive.
+     */
+    bool isMasterRunning(const Path & socketPath = "");
+
+    /**
+     * @return The path of the control socket of the master connection
+     * shared by all processes that use the same SSH options.
+     */
+    Path getPersistentSocketPath();
 
 #ifndef _WIN32 // TODO re-enable on Windows, once we can start processes.
     Path startMaster();
@@ -46,7 +69,8 @@ public:
         std::string_view host,
         std::string_view keyFile,
         std::string_view sshPublicHostKey,
-        bool useMaster, bool compress, Descriptor logFD = INVALID_DESCRIPTOR);
+        bool useMaster, bool compress, Descriptor logFD = INVALID_DESCRIPTOR,
+        unsigned int persist = 0);
 
     struct Connection
     {
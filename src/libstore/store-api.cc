@@ -435,7 +435,7 @@ StringSet StoreConfig::getDefaultSystemFeatures()
 
 Store::Store(const Params & params)
     : StoreConfig(params)
-    , state({(size_t) pathInfoCacheSize})
+    , pathInfoCache((size_t) pathInfoCacheSize)
 {
     assertLibStoreInitialized();
 }
@@ -565,12 +565,21 @@ void Store::querySubstitutablePathInfos(const StorePathCAMap & paths, Substituta
 }
 
 
+static bool goodStorePath(const StorePath & expected, const StorePath & actual)
+{
+    return
+        expected.hashPart() == actual.hashPart()
+        && (expected.name() == Store::MissingName || expected.name() == actual.name());
+}
+
+
 bool Store::isValidPath(const StorePath & storePath)
 {
     {
-        auto state_(state.lock());
-        auto res = state_->pathInfoCache.get(std::string(storePath.to_string()));
-        if (res && res->isKnownNow()) {
+        auto res = pathInfoCache.get(storePath);
+        if (res && res->isKnownNow()
+            && (!res->didExist() || goodStorePath(storePath, res->value->path)))
+        {
             stats.narInfoReadAverted++;
             return res->didExist();
         }
@@ -580,8 +589,7 @@ bool Store::isValidPath(const StorePath & storePath)
         auto res = diskCache->lookupNarInfo(getUri(), std::string(storePath.hashPart()));
         if (res.first != NarInfoDiskCache::oUnknown) {
             stats.narInfoReadAverted++;
-            auto state_(state.lock());
-            state_->pathInfoCache.upsert(std::string(storePath.to_string()),
+            pathInfoCache.upsert(storePath,
                 res.first == NarInfoDiskCache::oInvalid ? PathInfoCacheValue{} : PathInfoCacheValue { .value = res.second });
             return res.first == NarInfoDiskCache::oValid;
         }
@@ -627,21 +635,15 @@ ref<const ValidPathInfo> Store::queryPathInfo(const StorePath & storePath)
 }
 
 
-static bool goodStorePath(const StorePath & expected, const StorePath & actual)
-{
-    return
-        expected.hashPart() == actual.hashPart()
-        && (expected.name() == Store::MissingName || expected.name() == actual.name());
-}
-
-
 std::optional<std::shared_ptr<const ValidPathInfo>> Store::queryPathInfoFromClientCache(const StorePath & storePath)
 {
     auto hashPart = std::string(storePath.hashPart());
 
     {
-        auto res = state.lock()->pathInfoCache.get(std::string(storePath.to_string()));
-        if (res && res->isKnownNow()) {
+        auto res = pathInfoCache.get(storePath);
+        if (res && res->isKnownNow()
+            && (!res->didExist() || goodStorePath(storePath, res->value->path)))
+        {
             stats.narInfoReadAverted++;
             if (res->didExist())
                 return std::make_optional(res->value);
@@ -654,14 +656,11 @@ std::optional<std::shared_ptr<const ValidPathInfo>> Store::queryPathInfoFromClie
         auto res = diskCache->lookupNarInfo(getUri(), hashPart);
         if (res.first != NarInfoDiskCache::oUnknown) {
             stats.narInfoReadAverted++;
-            {
-                auto state_(state.lock());
-                state_->pathInfoCache.upsert(std::string(storePath.to_string()),
-                    res.first == NarInfoDiskCache::oInvalid ? PathInfoCacheValue{} : PathInfoCacheValue{ .value = res.second });
-                if (res.first == NarInfoDiskCache::oInvalid ||
-                    !goodStorePath(storePath, res.second->path))
-                    return std::make_optional(nullptr);
-            }
+            pathInfoCache.upsert(storePath,
+                res.first == NarInfoDiskCache::oInvalid ? PathInfoCacheValue{} : PathInfoCacheValue{ .value = res.second });
+            if (res.first == NarInfoDiskCache::oInvalid ||
+                !goodStorePath(storePath, res.second->path))
+                return std::make_optional(nullptr);
             assert(res.second);
             return std::make_optional(res.second);
         }
@@ -698,10 +697,7 @@ void Store::queryPathInfo(const StorePath & storePath,
                 if (diskCache)
                     diskCache->upsertNarInfo(getUri(), hashPart, info);
 
-                {
-                    auto state_(state.lock());
-                    state_->pathInfoCache.upsert(std::string(storePath.to_string()), PathInfoCacheValue { .value = info });
-                }
+                pathInfoCache.upsert(storePath, PathInfoCacheValue { .value = info });
 
                 if (!info || !goodStorePath(storePath, info->path)) {
                     stats.narInfoMissing++;
@@ -931,10 +927,11 @@ StorePathSet Store::exportReferences(const StorePathSet & storePaths, const Stor
 
 const Store::Stats & Store::getStats()
 {
-    {
-        auto state_(state.readLock());
-        stats.pathInfoCacheSize = state_->pathInfoCache.size();
-    }
+    auto cacheStats = pathInfoCache.getStats();
+    stats.pathInfoCacheSize = cacheStats.size;
+    stats.pathInfoCacheHits = cacheStats.hits;
+    stats.pathInfoCacheMisses = cacheStats.misses;
+    stats.pathInfoCacheEvictions = cacheStats.evictions;
     return stats;
 }
 
@@ -6,7 +6,7 @@
 #include "hash.hh"
 #include "content-address.hh"
 #include "serialise.hh"
-#include "lru-cache.hh"
+#include "sharded-cache.hh"
 #include "sync.hh"
 #include "globals.hh"
 #include "config.hh"
@@ -22,6 +22,7 @@
 #include <memory>
 #include <string>
 #include <chrono>
+#include <array>
 
 
 namespace nix {
@@ -196,12 +197,38 @@ protected:
         }
     };
 
-    struct State
+    /**
+     * The hash part of a store path, which is the key of the path
+     * info cache. Unlike a string, it doesn't require an allocation.
+     */
+    struct PathInfoCacheKey
     {
-        LRUCache<std::string, PathInfoCacheValue> pathInfoCache;
+        std::array<char, StorePath::HashLen> hashPart;
+
+        PathInfoCacheKey(const StorePath & path)
+        {
+            auto s = path.hashPart();
+            std::copy(s.begin(), s.end(), hashPart.begin());
+        }
+
+        bool operator == (const PathInfoCacheKey &) const = default;
+
+        struct Hash
+        {
+            size_t operator () (const PathInfoCacheKey & key) const
+            {
+                return std::hash<std::string_view>()(std::string_view(key.hashPart.data(), key.hashPart.size()));
+            }
+        };
     };
 
-    SharedSync<State> state;
+    /**
+     * Cache of path info, keyed by hash part. Entries may be for a
+     * path with a different name than the one being looked up (see
+     * `MissingName`), so positive hits must be checked against the
+     * requested path.
+     */
+    ShardedCache<PathInfoCacheKey, PathInfoCacheValue, PathInfoCacheKey::Hash> pathInfoCache;
 
     std::shared_ptr<NarInfoDiskCache> diskCache;
 
@@ -695,6 +722,9 @@ public:
         std::atomic<uint64_t> narInfoMissing{0};
         std::atomic<uint64_t> narInfoWrite{0};
         std::atomic<uint64_t> pathInfoCacheSize{0};
+        std::atomic<uint64_t> pathInfoCacheHits{0};
+        std::atomic<uint64_t> pathInfoCacheMisses{0};
+        std::atomic<uint64_t> pathInfoCacheEvictions{0};
         std::atomic<uint64_t> narRead{0};
         std::atomic<uint64_t> narReadBytes{0};
         std::atomic<uint64_t> narReadCompressedBytes{0};
@@ -726,7 +756,7 @@ public:
      */
     void clearPathInfoCache()
     {
-        state.lock()->pathInfoCache.clear();
+        pathInfoCache.clear();
     }
 
     /**
@@ -79,6 +79,9 @@ HookInstance::HookInstance()
     sink = FdSink(toHook.writeSide.get());
     std::map<std::string, Config::SettingInfo> settings;
     globalConfig.getSettings(settings);
+    /* The trace file belongs to this process; the hook would
+       truncate it. */
+    settings.erase(loggerSettings.activityTraceFile.name);
     for (auto & setting : settings)
         sink << 1 << setting.first << setting.second.value;
     sink << 0;
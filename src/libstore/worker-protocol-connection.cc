@@ -5,7 +5,11 @@
 
 namespace nix {
 
-const std::set<WorkerProto::Feature> WorkerProto::allFeatures{};
+const WorkerProto::Feature WorkerProto::featureGCMaxCandidates = "gc-max-candidates";
+
+const std::set<WorkerProto::Feature> WorkerProto::allFeatures{
+    featureGCMaxCandidates,
+};
 
 WorkerProto::BasicClientConnection::~BasicClientConnection()
 {
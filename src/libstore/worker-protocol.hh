@@ -136,6 +136,12 @@ struct WorkerProto
 
     using Feature = std::string;
 
+    /**
+     * `CollectGarbage` takes an additional `GCOptions::maxCandidates`
+     * field (0 meaning unset).
+     */
+    static const Feature featureGCMaxCandidates;
+
     static const std::set<Feature> allFeatures;
 };
 
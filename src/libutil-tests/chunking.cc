@@ -0,0 +1,70 @@
+#include "chunking.hh"
+
+#include <gtest/gtest.h>
+
+#include <set>
+
+namespace nix {
+
+static std::string randomData(size_t size, uint64_t seed)
+{
+    std::string s;
+    s.reserve(size);
+    for (size_t i = 0; i < size; ++i) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        s.push_back((char) (seed >> 56));
+    }
+    return s;
+}
+
+static std::vector<std::string> chunk(std::string_view data, size_t feedSize, size_t avgSize = 4096)
+{
+    std::vector<std::string> chunks;
+    ChunkingSink sink(avgSize, [&](std::string_view chunk) { chunks.emplace_back(chunk); });
+    for (size_t pos = 0; pos < data.size(); pos += feedSize)
+        sink(data.substr(pos, feedSize));
+    sink.finish();
+    return chunks;
+}
+
+TEST(ChunkingSink, reassembles)
+{
+    auto data = randomData(1024 * 1024, 1);
+    auto chunks = chunk(data, 1000);
+
+    std::string s;
+    for (const auto [i, c] : enumerate(chunks)) {
+        if (i + 1 < chunks.size()) {
+            ASSERT_GE(c.size(), 1024u);
+            ASSERT_LE(c.size(), 32768u);
+        }
+        s += c;
+    }
+
+    ASSERT_EQ(s, data);
+    ASSERT_GT(chunks.size(), 100u);
+}
+
+TEST(ChunkingSink, independentOfWriteSize)
+{
+    auto data = randomData(256 * 1024, 2);
+    ASSERT_EQ(chunk(data, 1), chunk(data, 65536));
+}
+
+TEST(ChunkingSink, insertionOnlyChangesNearbyChunks)
+{
+    auto data = randomData(1024 * 1024, 3);
+    auto data2 = data.substr(0, 500000) + "inserted" + data.substr(500000);
+
+    auto chunks = chunk(data, 4096);
+    auto chunks2 = chunk(data2, 4096);
+
+    std::set<std::string> set(chunks.begin(), chunks.end());
+    size_t shared = 0;
+    for (auto & c : chunks2)
+        if (set.count(c)) shared++;
+
+    ASSERT_GE(shared + 3, chunks.size());
+}
+
+}
@@ -59,6 +59,44 @@ namespace nix {
         ASSERT_EQ(o, str);
     }
 
+    TEST(decompress, decompressLargeInputInSmallChunks) {
+        auto method = "zstd";
+        std::string str;
+        for (size_t i = 0; str.size() < 32 * 1024 * 1024; ++i)
+            str += std::to_string(i * 7919) + ";";
+        auto compressed = compress(method, str);
+
+        StringSink strSink;
+        auto sink = makeDecompressionSink(method, strSink);
+        for (size_t pos = 0; pos < compressed.size(); pos += 4096)
+            (*sink)(std::string_view(compressed).substr(pos, 4096));
+        sink->finish();
+
+        ASSERT_EQ(strSink.s, str);
+    }
+
+    TEST(decompress, autoDecompressionDetectsMethod) {
+        auto str = "slfja;sljfklsa;jfklsjfkl;sdjfkl;sadjfkl;sdjf;lsdfjsadlf";
+
+        for (auto method : {"xz", "gzip", "zstd", "bzip2"}) {
+            StringSink strSink;
+            auto sink = makeAutoDecompressionSink(strSink);
+            (*sink)(compress(method, str));
+            sink->finish();
+            ASSERT_EQ(strSink.s, str);
+        }
+    }
+
+    TEST(decompress, autoDecompressionPassesUncompressedInput) {
+        auto str = "slfja;sljfklsa;jfklsjfkl;sdjfkl;sadjfkl;sdjf;lsdfjsadlf";
+
+        StringSink strSink;
+        auto sink = makeAutoDecompressionSink(strSink);
+        (*sink)(str);
+        sink->finish();
+        ASSERT_EQ(strSink.s, str);
+    }
+
     TEST(decompress, decompressInvalidInputThrowsCompressionError) {
         auto method = "bzip2";
         auto str = "this is a string that does not qualify as valid bzip2 data";
@@ -66,6 +104,19 @@ namespace nix {
         ASSERT_THROW(decompress(method, str), CompressionError);
     }
 
+    TEST(decompress, dataAfterEndOfStreamThrows) {
+        auto method = "zstd";
+        auto str = "slfja;sljfklsa;jfklsjfkl;sdjfkl;sadjfkl;sdjf;lsdfjsadlf";
+
+        StringSink strSink;
+        auto sink = makeDecompressionSink(method, strSink);
+        ASSERT_THROW({
+            (*sink)(compress(method, str));
+            (*sink)("this is not part of the compressed stream");
+            sink->finish();
+        }, Error);
+    }
+
     /* ----------------------------------------------------------------------------
      * compression sinks
      * --------------------------------------------------------------------------*/
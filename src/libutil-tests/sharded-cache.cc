@@ -0,0 +1,80 @@
+#include "sharded-cache.hh"
+#include <gtest/gtest.h>
+
+namespace nix {
+
+    /* ----------------------------------------------------------------------------
+     * upsert / get / erase
+     * --------------------------------------------------------------------------*/
+
+    TEST(ShardedCache, getFromEmptyCache) {
+        ShardedCache<std::string, std::string> c(10);
+        ASSERT_EQ(c.get("x"), std::nullopt);
+        ASSERT_EQ(c.getStats().misses, 1);
+    }
+
+    TEST(ShardedCache, getExistingValue) {
+        ShardedCache<std::string, std::string> c(10);
+        c.upsert("foo", "bar");
+        ASSERT_EQ(c.get("foo"), "bar");
+        ASSERT_EQ(c.getStats().hits, 1);
+    }
+
+    TEST(ShardedCache, upsertReplacesValue) {
+        ShardedCache<std::string, std::string> c(10);
+        c.upsert("foo", "bar");
+        c.upsert("foo", "baz");
+        ASSERT_EQ(c.get("foo"), "baz");
+        ASSERT_EQ(c.size(), 1);
+    }
+
+    TEST(ShardedCache, eraseRemovesValue) {
+        ShardedCache<std::string, std::string> c(10);
+        c.upsert("foo", "bar");
+        c.upsert("baz", "qux");
+        ASSERT_TRUE(c.erase("foo"));
+        ASSERT_FALSE(c.erase("foo"));
+        ASSERT_EQ(c.get("foo"), std::nullopt);
+        ASSERT_EQ(c.get("baz"), "qux");
+        ASSERT_EQ(c.size(), 1);
+    }
+
+    TEST(ShardedCache, zeroCapacityDisablesCache) {
+        ShardedCache<std::string, std::string> c(0);
+        c.upsert("foo", "bar");
+        ASSERT_EQ(c.get("foo"), std::nullopt);
+        ASSERT_EQ(c.size(), 0);
+    }
+
+    TEST(ShardedCache, clearRemovesEverything) {
+        ShardedCache<int, int> c(1000);
+        for (int i = 0; i < 100; ++i)
+            c.upsert(i, i);
+        c.clear();
+        ASSERT_EQ(c.size(), 0);
+        ASSERT_EQ(c.get(1), std::nullopt);
+    }
+
+    /* ----------------------------------------------------------------------------
+     * eviction
+     * --------------------------------------------------------------------------*/
+
+    TEST(ShardedCache, sizeIsBounded) {
+        ShardedCache<int, int> c(640);
+        for (int i = 0; i < 10000; ++i)
+            c.upsert(i, i);
+        ASSERT_LE(c.size(), 640);
+        auto stats = c.getStats();
+        ASSERT_EQ(stats.evictions, 10000 - stats.size);
+    }
+
+    TEST(ShardedCache, recentlyUsedEntriesSurvive) {
+        ShardedCache<int, int> c(640);
+        for (int i = 0; i < 10000; ++i) {
+            c.upsert(i, i);
+            /* Keep using the first entry. */
+            ASSERT_EQ(c.get(0), 0);
+        }
+    }
+
+}
@@ -0,0 +1,152 @@
+#include "thread-pool.hh"
+#include <gtest/gtest.h>
+
+namespace nix {
+
+    /* ----------------------------------------------------------------------------
+     * ThreadPool
+     * --------------------------------------------------------------------------*/
+
+    TEST(ThreadPool, processesNestedWorkItems) {
+        ThreadPool pool(4);
+        std::atomic<int> count{0};
+
+        for (int i = 0; i < 100; ++i)
+            pool.enqueue([&]() {
+                for (int j = 0; j < 10; ++j)
+                    pool.enqueue([&]() { count++; });
+            });
+
+        pool.process();
+
+        ASSERT_EQ(count, 1000);
+    }
+
+    TEST(ThreadPool, propagatesException) {
+        ThreadPool pool(4);
+
+        try {
+            for (int i = 0; i < 100; ++i)
+                pool.enqueue([i]() {
+                    if (i == 50) throw Error("boom");
+                });
+        } catch (ThreadPoolShutDown &) {
+            /* Workers may already have run the failing item. */
+        }
+
+        ASSERT_THROW(pool.process(), Error);
+    }
+
+    TEST(ThreadPool, startsHighPriorityItemsFirst) {
+        ThreadPool pool(1);
+        std::vector<int> order;
+
+        pool.enqueue([&]() { order.push_back(0); }, ThreadPool::prioLow);
+        pool.enqueue([&]() { order.push_back(1); });
+        pool.enqueue([&]() { order.push_back(2); }, ThreadPool::prioHigh);
+
+        pool.process();
+
+        ASSERT_EQ(order, (std::vector<int>{2, 1, 0}));
+    }
+
+    TEST(ThreadPool, startsExternalItemsInOrder) {
+        ThreadPool pool(1);
+        std::vector<int> order;
+
+        for (int n = 0; n < 5; ++n)
+            pool.enqueue([&, n]() { order.push_back(n); });
+
+        pool.process();
+
+        ASSERT_EQ(order, (std::vector<int>{0, 1, 2, 3, 4}));
+    }
+
+    /* ----------------------------------------------------------------------------
+     * TaskGroup
+     * --------------------------------------------------------------------------*/
+
+    TEST(TaskGroup, waitsForSubtasksWithoutDeadlock) {
+        /* More waiting work items than threads would deadlock if
+           waiting blocked the thread. */
+        ThreadPool pool(2);
+        std::atomic<int> count{0};
+
+        for (int i = 0; i < 8; ++i)
+            pool.enqueue([&]() {
+                TaskGroup group(pool);
+                std::atomic<int> local{0};
+                for (int j = 0; j < 8; ++j)
+                    group.enqueue([&]() { local++; });
+                group.wait();
+                ASSERT_EQ(local, 8);
+                count += local;
+            });
+
+        pool.process();
+
+        ASSERT_EQ(count, 64);
+    }
+
+    TEST(TaskGroup, rethrowsSubtaskException) {
+        ThreadPool pool(2);
+        bool caught = false;
+
+        pool.enqueue([&]() {
+            TaskGroup group(pool);
+            group.enqueue([]() { throw Error("boom"); });
+            try {
+                group.wait();
+            } catch (Error &) {
+                caught = true;
+            }
+        });
+
+        pool.process();
+
+        ASSERT_TRUE(caught);
+    }
+
+    /* ----------------------------------------------------------------------------
+     * processGraph
+     * --------------------------------------------------------------------------*/
+
+    TEST(processGraph, processesDependenciesFirst) {
+        std::set<int> nodes;
+        for (int i = 0; i < 100; ++i)
+            nodes.insert(i);
+
+        Sync<std::vector<int>> order_;
+
+        processGraph<int>(
+            nodes,
+            [](const int & n) {
+                /* Every node depends on its divisors. */
+                std::set<int> edges;
+                for (int d = 1; d < n; ++d)
+                    if (n % d == 0) edges.insert(d);
+                return edges;
+            },
+            [&](const int & n) { order_.lock()->push_back(n); });
+
+        auto order(order_.lock());
+        ASSERT_EQ(order->size(), 100);
+        std::map<int, size_t> pos;
+        for (size_t i = 0; i < order->size(); ++i)
+            pos[(*order)[i]] = i;
+        for (int n = 2; n < 100; ++n)
+            for (int d = 1; d < n; ++d)
+                if (n % d == 0)
+                    ASSERT_LT(pos[d], pos[n]);
+    }
+
+    TEST(processGraph, detectsCycles) {
+        ASSERT_THROW(
+            processGraph<int>(
+                {1, 2},
+                [](const int & n) { return std::set<int>{n == 1 ? 2 : 1}; },
+                [](const int &) { }),
+            Error);
+    }
+
+}
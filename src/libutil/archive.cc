@@ -2,6 +2,8 @@
 #include <algorithm>
 #include <vector>
 #include <map>
+#include <queue>
+#include <thread>
 
 #include <strings.h> // for strcasecmp
 
@@ -11,6 +13,7 @@
 #include "source-path.hh"
 #include "file-system.hh"
 #include "signals.hh"
+#include "sync.hh"
 
 namespace nix {
 
@@ -33,13 +36,176 @@ static GlobalConfig::Register rArchiveSettings(&archiveSettings);
 PathFilter defaultPathFilter = [](const Path &) { return true; };
 
 
+#ifndef _WIN32
+
+/**
+ * Reads small regular files ahead of `dumpPath()` in a few
+ * background threads, so that file system I/O overlaps with whatever
+ * the sink does with the NAR (usually hashing or compressing it),
+ * which is inherently sequential.
+ */
+struct FilePrefetcher
+{
+    /**
+     * Larger files are read by the caller, since a single large read
+     * doesn't benefit much from concurrency.
+     */
+    static constexpr uint64_t maxFileSize = 1024 * 1024;
+
+    /**
+     * Upper bound on the memory used by files that have been read
+     * ahead.
+     */
+    static constexpr uint64_t maxBuffered = 64 * 1024 * 1024;
+
+    static constexpr size_t maxThreads = 4;
+
+    struct File
+    {
+        uint64_t size;
+        bool done = false;
+        std::string contents;
+        std::exception_ptr exception;
+    };
+
+    struct State
+    {
+        std::map<CanonPath, File> files;
+        std::queue<std::pair<CanonPath, std::filesystem::path>> queue;
+        uint64_t buffered = 0;
+        bool quit = false;
+    };
+
+    Sync<State> state_;
+
+    std::condition_variable wakeup, fileDone;
+
+    std::vector<std::thread> workers;
+
+    ~FilePrefetcher()
+    {
+        state_.lock()->quit = true;
+        wakeup.notify_all();
+        for (auto & thr : workers)
+            thr.join();
+    }
+
+    /**
+     * Schedule reading `path` (whose file system location is
+     * `physicalPath`). Returns `false` if too much data is already
+     * buffered.
+     */
+    bool enqueue(const CanonPath & path, const std::filesystem::path & physicalPath, uint64_t size)
+    {
+        {
+            auto state(state_.lock());
+            if (state->buffered + size > maxBuffered) return false;
+            if (!state->files.emplace(path, File { .size = size }).second) return false;
+            state->buffered += size;
+            state->queue.emplace(path, physicalPath);
+        }
+
+        if (workers.size() < maxThreads)
+            workers.emplace_back([this]() { work(); });
+
+        wakeup.notify_one();
+
+        return true;
+    }
+
+    /**
+     * Return the contents of `path` if it was scheduled by
+     * `enqueue()`, waiting for it to be read if necessary.
+     */
+    std::optional<std::string> take(const CanonPath & path)
+    {
+        auto state(state_.lock());
+
+        auto i = state->files.find(path);
+        if (i == state->files.end()) return std::nullopt;
+
+        while (!i->second.done)
+            state.wait(fileDone);
+
+        auto file = std::move(i->second);
+        state->files.erase(i);
+        state->buffered -= file.size;
+
+        if (file.exception)
+            std::rethrow_exception(file.exception);
+
+        return std::move(file.contents);
+    }
+
+private:
+
+    void work()
+    {
+        while (true) {
+            std::pair<CanonPath, std::filesystem::path> item{CanonPath::root, ""};
+
+            {
+                auto state(state_.lock());
+                while (!state->quit && state->queue.empty())
+                    state.wait(wakeup);
+                if (state->quit) return;
+                item = std::move(state->queue.front());
+                state->queue.pop();
+            }
+
+            std::string contents;
+            std::exception_ptr exception;
+
+            try {
+                AutoCloseFD fd = open(item.second.string().c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+                if (!fd)
+                    throw SysError("opening file '%1%'", item.second.string());
+                contents = readFile(fd.get());
+            } catch (...) {
+                exception = std::current_exception();
+            }
+
+            {
+                auto state(state_.lock());
+                auto & file = state->files.at(item.first);
+                file.contents = std::move(contents);
+                file.exception = exception;
+                file.done = true;
+            }
+
+            fileDone.notify_all();
+        }
+    }
+};
+
+#endif
+
 void SourceAccessor::dumpPath(
     const CanonPath & path,
     Sink & sink,
     PathFilter & filter)
 {
+    #ifndef _WIN32
+    /* Only read ahead for accessors that are backed by the file
+       system, since other accessors are not necessarily
+       thread-safe. The prefetcher bypasses the accessor, so it must
+       only be used for files that the accessor has already
+       stat'ed. */
+    std::optional<FilePrefetcher> prefetcher;
+    if (getPhysicalPath(path))
+        prefetcher.emplace();
+    #endif
+
     auto dumpContents = [&](const CanonPath & path)
     {
+        #ifndef _WIN32
+        if (prefetcher)
+            if (auto contents = prefetcher->take(path)) {
+                sink << "contents" << *contents;
+                return;
+            }
+        #endif
+
         sink << "contents";
         std::optional<uint64_t> size;
         readFile(path, sink, [&](uint64_t _size)
@@ -88,12 +254,28 @@ void SourceAccessor::dumpPath(
                 } else
                     unhacked.emplace(i.first, i.first);
 
+            std::vector<std::pair<std::string, std::string>> entries;
             for (auto & i : unhacked)
-                if (filter((path / i.first).abs())) {
-                    sink << "entry" << "(" << "name" << i.first << "node";
-                    dump(path / i.second);
-                    sink << ")";
+                if (filter((path / i.first).abs()))
+                    entries.push_back(i);
+
+            #ifndef _WIN32
+            if (prefetcher)
+                for (auto & [name, realName] : entries) {
+                    auto child = path / realName;
+                    auto st2 = lstat(child);
+                    if (st2.type != tRegular || !st2.fileSize || *st2.fileSize > FilePrefetcher::maxFileSize) continue;
+                    auto physicalPath = getPhysicalPath(child);
+                    if (!physicalPath || !prefetcher->enqueue(child, *physicalPath, *st2.fileSize))
+                        break;
                 }
+            #endif
+
+            for (auto & [name, realName] : entries) {
+                sink << "entry" << "(" << "name" << name << "node";
+                dump(path / realName);
+                sink << ")";
+            }
         }
 
         else if (st.type == tSymlink)
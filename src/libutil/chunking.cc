@@ -0,0 +1,95 @@
+#include "chunking.hh"
+
+#include <array>
+
+namespace nix {
+
+/**
+ * The "gear" table of random values used by the rolling hash. It is
+ * generated from a fixed seed since chunk boundaries (and thus chunk
+ * hashes) must be stable across Nix versions.
+ */
+static const std::array<uint64_t, 256> & gearTable()
+{
+    static auto table = []() {
+        std::array<uint64_t, 256> table;
+        /* splitmix64 */
+        uint64_t state = 0x6e69782d63686e6bULL;
+        for (auto & v : table) {
+            uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            v = z ^ (z >> 31);
+        }
+        return table;
+    }();
+    return table;
+}
+
+ChunkingSink::ChunkingSink(size_t avgSize, ChunkCallback onChunk)
+    : onChunk(std::move(onChunk))
+{
+    size_t bits = 8;
+    while (((size_t) 1 << (bits + 1)) <= avgSize) bits++;
+
+    this->avgSize = (size_t) 1 << bits;
+    minSize = this->avgSize / 4;
+    maxSize = this->avgSize * 8;
+
+    /* "Normalised chunking": use a harder condition before the
+       average size and an easier one after it, which narrows the
+       chunk size distribution. Use the high bits of the fingerprint
+       since they depend on more input bytes. */
+    maskSmall = ~(uint64_t) 0 << (64 - (bits + 1));
+    maskLarge = ~(uint64_t) 0 << (64 - (bits - 1));
+}
+
+void ChunkingSink::operator () (std::string_view data)
+{
+    auto & gear = gearTable();
+
+    buffer.append(data);
+
+    size_t start = 0;
+
+    while (true) {
+        /* Don't bother hashing the first `minSize` bytes of a chunk,
+           since there can't be a boundary there. */
+        if (scanned < start + minSize) {
+            scanned = std::min(start + minSize, buffer.size());
+            fingerprint = 0;
+        }
+
+        size_t cut = 0;
+
+        while (scanned < buffer.size()) {
+            fingerprint = (fingerprint << 1) + gear[(unsigned char) buffer[scanned++]];
+            size_t len = scanned - start;
+            if (len >= maxSize
+                || (fingerprint & (len < avgSize ? maskSmall : maskLarge)) == 0)
+            {
+                cut = scanned;
+                break;
+            }
+        }
+
+        if (!cut) break;
+
+        onChunk(std::string_view(buffer).substr(start, cut - start));
+        start = cut;
+    }
+
+    buffer.erase(0, start);
+    scanned -= start;
+}
+
+void ChunkingSink::finish()
+{
+    if (!buffer.empty())
+        onChunk(buffer);
+    buffer.clear();
+    scanned = 0;
+    fingerprint = 0;
+}
+
+}
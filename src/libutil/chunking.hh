@@ -0,0 +1,57 @@
+#pragma once
+///@file
+
+#include "serialise.hh"
+
+#include <functional>
+
+namespace nix {
+
+/**
+ * A sink that splits its input into content-defined chunks using
+ * the FastCDC algorithm, calling `onChunk` for each chunk. Chunk
+ * boundaries depend only on the nearby contents, so inserting or
+ * removing data only changes the chunks around the modification.
+ * This makes it possible to deduplicate similar files (e.g. NARs of
+ * two versions of a package) at the chunk level.
+ */
+struct ChunkingSink : FinishSink
+{
+    typedef std::function<void(std::string_view chunk)> ChunkCallback;
+
+    /**
+     * @param avgSize The desired average chunk size, rounded down to
+     * a power of two. Chunks are between a quarter and eight times
+     * this size, except for the last chunk, which may be smaller.
+     */
+    ChunkingSink(size_t avgSize, ChunkCallback onChunk);
+
+    void operator () (std::string_view data) override;
+
+    /**
+     * Emit the remaining data as the final chunk.
+     */
+    void finish() override;
+
+private:
+
+    size_t minSize, avgSize, maxSize;
+    uint64_t maskSmall, maskLarge;
+
+    ChunkCallback onChunk;
+
+    /**
+     * Data that hasn't been emitted yet. It always starts at a chunk
+     * boundary.
+     */
+    std::string buffer;
+
+    /**
+     * How much of `buffer` has been fed into `fingerprint`.
+     */
+    size_t scanned = 0;
+
+    uint64_t fingerprint = 0;
+};
+
+}
@@ -3,11 +3,14 @@
 #include "tarfile.hh"
 #include "finally.hh"
 #include "logging.hh"
+#include "sync.hh"
 
 #include <archive.h>
 #include <archive_entry.h>
 #include <cstdio>
 #include <cstring>
+#include <queue>
+#include <thread>
 
 #include <brotli/decode.h>
 #include <brotli/encode.h>
@@ -39,9 +42,11 @@ struct ArchiveDecompressionSource : Source
     std::unique_ptr<TarArchive> archive = 0;
     Source & src;
     std::optional<std::string> compressionMethod;
-    ArchiveDecompressionSource(Source & src, std::optional<std::string> compressionMethod = std::nullopt)
+    bool allowUncompressed;
+    ArchiveDecompressionSource(Source & src, std::optional<std::string> compressionMethod = std::nullopt, bool allowUncompressed = false)
         : src(src)
         , compressionMethod(std::move(compressionMethod))
+        , allowUncompressed(allowUncompressed)
     {
     }
     ~ArchiveDecompressionSource() override {}
@@ -51,7 +56,7 @@ struct ArchiveDecompressionSource : Source
         if (!archive) {
             archive = std::make_unique<TarArchive>(src, /*raw*/ true, compressionMethod);
             this->archive->check(archive_read_next_header(this->archive->archive, &ae), "failed to read header (%s)");
-            if (archive_filter_count(this->archive->archive) < 2) {
+            if (archive_filter_count(this->archive->archive) < 2 && !allowUncompressed) {
                 throw CompressionError("input compression not recognized");
             }
         }
@@ -66,6 +71,196 @@ struct ArchiveDecompressionSource : Source
     }
 };
 
+/**
+ * A sink that decompresses its input on a separate thread, so that
+ * decompression overlaps with producing the compressed data (e.g. a
+ * download) and with consuming the decompressed data (e.g. unpacking
+ * and hashing a NAR during substitution). This only pipelines the
+ * stages: the stream itself is still decompressed sequentially by a
+ * single thread. Input following the end of the compressed stream is
+ * an error. `nextSink` is only called
+ * from the thread that writes to this sink. If `method` is not set,
+ * the compression method is detected automatically, and uncompressed
+ * data is passed through unchanged.
+ */
+struct ThreadedDecompressionSink : FinishSink
+{
+    /**
+     * Maximum amount of compressed and of decompressed data buffered
+     * between the threads.
+     */
+    static constexpr size_t maxQueued = 8 * 1024 * 1024;
+
+    struct State
+    {
+        std::queue<std::string> input, output;
+        size_t inputPos = 0;
+        size_t inputSize = 0, outputSize = 0;
+        bool inputDone = false;
+        bool outputDone = false;
+        bool quit = false;
+        std::exception_ptr exception;
+    };
+
+    Sync<State> state_;
+
+    std::condition_variable wakeup;
+
+    std::optional<std::string> method;
+    Sink & nextSink;
+    std::thread thread;
+
+    ThreadedDecompressionSink(std::optional<std::string> method, Sink & nextSink)
+        : method(method)
+        , nextSink(nextSink)
+    {
+    }
+
+    ~ThreadedDecompressionSink()
+    {
+        if (thread.joinable()) {
+            state_.lock()->quit = true;
+            wakeup.notify_all();
+            thread.join();
+        }
+    }
+
+    void operator () (std::string_view data) override
+    {
+        if (data.empty()) return;
+
+        if (!thread.joinable())
+            thread = std::thread([this]() { work(); });
+
+        /* Pass on decompressed data while waiting for room in the
+           input queue, since the decompressor may be waiting for room
+           in the output queue. */
+        while (true) {
+            std::optional<std::string> chunk;
+            {
+                auto state(state_.lock());
+                if (state->exception)
+                    std::rethrow_exception(state->exception);
+                if (state->outputDone)
+                    throw CompressionError("unexpected data after the end of the compressed stream");
+                if (state->inputSize < maxQueued) {
+                    state->input.emplace(data);
+                    state->inputSize += data.size();
+                    break;
+                }
+                chunk = takeOutput(*state);
+                if (!chunk) {
+                    state.wait(wakeup);
+                    continue;
+                }
+            }
+            wakeup.notify_all();
+            nextSink(*chunk);
+        }
+
+        wakeup.notify_all();
+
+        while (auto chunk = takeOutput(*state_.lock())) {
+            wakeup.notify_all();
+            nextSink(*chunk);
+        }
+    }
+
+    void finish() override
+    {
+        if (!thread.joinable()) return;
+
+        state_.lock()->inputDone = true;
+        wakeup.notify_all();
+
+        while (true) {
+            std::optional<std::string> chunk;
+            {
+                auto state(state_.lock());
+                chunk = takeOutput(*state);
+                if (!chunk) {
+                    if (state->outputDone) break;
+                    state.wait(wakeup);
+                    continue;
+                }
+            }
+            wakeup.notify_all();
+            nextSink(*chunk);
+        }
+
+        thread.join();
+
+        auto state(state_.lock());
+        if (state->exception)
+            std::rethrow_exception(state->exception);
+        if (!state->input.empty())
+            throw CompressionError("unexpected data after the end of the compressed stream");
+    }
+
+private:
+
+    std::optional<std::string> takeOutput(State & state)
+    {
+        if (state.output.empty()) return std::nullopt;
+        auto chunk = std::move(state.output.front());
+        state.output.pop();
+        state.outputSize -= chunk.size();
+        return chunk;
+    }
+
+    void work()
+    {
+        try {
+            LambdaSource source([&](char * data, size_t len) -> size_t {
+                auto state(state_.lock());
+                while (state->input.empty() && !state->inputDone && !state->quit)
+                    state.wait(wakeup);
+                if (state->quit)
+                    throw Interrupted("decompression aborted");
+                if (state->input.empty())
+                    throw EndOfFile("unexpected end of compressed data");
+                auto & chunk = state->input.front();
+                size_t n = std::min(len, chunk.size() - state->inputPos);
+                memcpy(data, chunk.data() + state->inputPos, n);
+                state->inputPos += n;
+                if (state->inputPos == chunk.size()) {
+                    state->inputSize -= chunk.size();
+                    state->input.pop();
+                    state->inputPos = 0;
+                    wakeup.notify_all();
+                }
+                return n;
+            });
+
+            ArchiveDecompressionSource decompressionSource(source, method, !method);
+
+            std::vector<char> buf(64 * 1024);
+
+            while (true) {
+                size_t n;
+                try {
+                    n = decompressionSource.read(buf.data(), buf.size());
+                } catch (EndOfFile &) {
+                    break;
+                }
+                auto state(state_.lock());
+                while (state->outputSize >= maxQueued && !state->quit)
+                    state.wait(wakeup);
+                if (state->quit)
+                    throw Interrupted("decompression aborted");
+                state->output.emplace(buf.data(), n);
+                state->outputSize += n;
+                wakeup.notify_all();
+            }
+        } catch (...) {
+            state_.lock()->exception = std::current_exception();
+        }
+
+        state_.lock()->outputDone = true;
+        wakeup.notify_all();
+    }
+};
+
 struct ArchiveCompressionSink : CompressionSink
 {
     Sink & nextSink;
@@ -220,10 +415,12 @@ std::unique_ptr<FinishSink> makeDecompressionSink(const std::string & method, Si
     else if (method == "br")
         return std::make_unique<BrotliDecompressionSink>(nextSink);
     else
-        return sourceToSink([method, &nextSink](Source & source) {
-            auto decompressionSource = std::make_unique<ArchiveDecompressionSource>(source, method);
-            decompressionSource->drainInto(nextSink);
-        });
+        return std::make_unique<ThreadedDecompressionSink>(method, nextSink);
+}
+
+std::unique_ptr<FinishSink> makeAutoDecompressionSink(Sink & nextSink)
+{
+    return std::make_unique<ThreadedDecompressionSink>(std::nullopt, nextSink);
 }
 
 struct BrotliCompressionSink : ChunkedCompressionSink
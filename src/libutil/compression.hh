@@ -20,6 +20,13 @@ std::string decompress(const std::string & method, std::string_view in);
 
 std::unique_ptr<FinishSink> makeDecompressionSink(const std::string & method, Sink & nextSink);
 
+/**
+ * Return a sink that decompresses its input on a separate thread,
+ * detecting the compression method automatically. Input that is not
+ * compressed is passed through unchanged.
+ */
+std::unique_ptr<FinishSink> makeAutoDecompressionSink(Sink & nextSink);
+
 std::string compress(const std::string & method, std::string_view in, const bool parallel = false, int level = -1);
 
 ref<CompressionSink>
@@ -49,6 +49,19 @@ struct LoggerSettings : Config
           Whether Nix should print out a stack trace in case of Nix
           expression evaluation errors.
         )"};
+
+    Setting<Path> activityTraceFile{
+        this, "", "activity-trace-file",
+        R"(
+          If set, Nix writes a timeline of everything it does (such as
+          builds, substitutions, downloads, copies and store queries) to
+          the specified file, in the [Chrome trace event
+          format](https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU).
+          The file can be opened in [Perfetto](https://ui.perfetto.dev/)
+          or `chrome://tracing` to see where time went. Each event
+          records the thread and parent of the activity, its fields and
+          the results it reported, such as progress and byte counts.
+        )"};
 };
 
 extern LoggerSettings loggerSettings;
@@ -198,6 +211,13 @@ std::unique_ptr<Logger> makeSimpleLogger(bool printBuildLogs = true);
 
 std::unique_ptr<Logger> makeJSONLogger(Descriptor fd);
 
+/**
+ * Return a logger that forwards everything to `next`, and also writes
+ * the start and end time, thread, parent, fields and results of every
+ * activity to `path` in the Chrome trace event format.
+ */
+std::unique_ptr<Logger> makeTraceLogger(std::unique_ptr<Logger> next, const Path & path);
+
 /**
  * @param source A noun phrase describing the source of the message, e.g. "the builder".
  */
@@ -64,6 +64,9 @@ void PosixSourceAccessor::readFile(
 
     off_t left = st.st_size;
 
+    /* Let the sink copy the file within the kernel if it can. */
+    left -= sink.copyFromFile(fd.get(), left);
+
     std::array<unsigned char, 64 * 1024> buf;
     while (left) {
         checkInterrupt();
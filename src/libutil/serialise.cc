@@ -16,6 +16,10 @@
 # include <poll.h>
 #endif
 
+#ifdef __linux__
+# include <sys/sendfile.h>
+#endif
+
 
 namespace nix {
 
@@ -75,6 +79,35 @@ bool FdSink::good()
 }
 
 
+uint64_t FdSink::copyFromFile(Descriptor fromFd, uint64_t size)
+{
+#ifdef __linux__
+    flush();
+
+    uint64_t copied = 0;
+
+    while (copied < size) {
+        checkInterrupt();
+        auto n = sendfile(fd, fromFd, nullptr, std::min(size - copied, (uint64_t) 1 << 30));
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            /* Let the caller deal with the remainder (and with any
+               errors, such as the destination not supporting
+               sendfile()). */
+            break;
+        }
+        if (n == 0) break;
+        copied += n;
+        written += n;
+    }
+
+    return copied;
+#else
+    return 0;
+#endif
+}
+
+
 void Source::operator () (char * data, size_t len)
 {
     while (len) {
@@ -113,6 +146,12 @@ std::string Source::drain()
 
 size_t BufferedSource::read(char * data, size_t len)
 {
+    /* Optimisation: bypass the buffer if it's empty and the caller
+       wants at least a buffer's worth of data, e.g. when copyNAR()
+       or parseDump() forward file contents. */
+    if (!bufPosIn && len >= bufSize)
+        return readUnbuffered(data, len);
+
     if (!buffer) buffer = decltype(buffer)(new char[bufSize]);
 
     if (!bufPosIn) bufPosIn = readUnbuffered(buffer.get(), bufSize);
@@ -21,6 +21,18 @@ struct Sink
     virtual ~Sink() { }
     virtual void operator () (std::string_view data) = 0;
     virtual bool good() { return true; }
+
+    /**
+     * Write up to `size` bytes from the current offset of the regular
+     * file `fd` without copying them through user space (e.g. using
+     * `sendfile()`), and advance the file offset accordingly.
+     *
+     * @return The number of bytes written. The caller must write the
+     * remainder in the usual way. The default implementation writes
+     * nothing.
+     */
+    virtual uint64_t copyFromFile(Descriptor fd, uint64_t size)
+    { return 0; }
 };
 
 /**
@@ -145,6 +157,8 @@ struct FdSink : BufferedSink
 
     bool good() override;
 
+    uint64_t copyFromFile(Descriptor fd, uint64_t size) override;
+
 private:
     bool _good = true;
 };
@@ -0,0 +1,201 @@
+#pragma once
+///@file
+
+#include "sync.hh"
+
+#include <array>
+#include <atomic>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+namespace nix {
+
+/**
+ * A thread-safe cache of bounded size. It is split into shards by the
+ * hash of the key, each with its own lock, so that concurrent
+ * operations on different keys rarely contend.
+ *
+ * Each shard evicts entries using the CLOCK algorithm, an
+ * approximation of LRU in which a lookup only sets a flag on the
+ * entry rather than reordering a list.
+ */
+template<typename Key, typename Value, typename Hash = std::hash<Key>>
+class ShardedCache
+{
+public:
+
+    struct Stats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        size_t size = 0;
+    };
+
+private:
+
+    /**
+     * Must be 64, see `shardFor()`.
+     */
+    static constexpr size_t nrShards = 64;
+
+    struct Entry
+    {
+        Key key;
+        Value value;
+
+        /**
+         * Whether the entry was used since it was inserted or since
+         * the clock hand last passed it.
+         */
+        bool referenced;
+    };
+
+    struct Shard
+    {
+        std::vector<Entry> entries;
+        std::unordered_map<Key, size_t, Hash> index;
+        size_t hand = 0;
+    };
+
+    size_t shardCapacity;
+
+    std::array<Sync<Shard>, nrShards> shards;
+
+    std::atomic<uint64_t> hits{0}, misses{0}, evictions{0};
+
+    Sync<Shard> & shardFor(const Key & key)
+    {
+        /* Fibonacci hashing, so that the shard doesn't depend on the
+           low bits that select the bucket in the shard's index, and
+           so that weak hashes (like the identity) are spread too. */
+        uint64_t h = Hash()(key);
+        return shards[(h * 0x9e3779b97f4a7c15ULL) >> 58];
+    }
+
+public:
+
+    /**
+     * @param capacity The maximum number of entries. A capacity of
+     * zero disables the cache.
+     */
+    ShardedCache(size_t capacity)
+        : shardCapacity(capacity ? (capacity + nrShards - 1) / nrShards : 0)
+    { }
+
+    /**
+     * Insert or update an item in the cache.
+     */
+    void upsert(const Key & key, const Value & value)
+    {
+        if (shardCapacity == 0) return;
+
+        auto shard(shardFor(key).lock());
+
+        auto i = shard->index.find(key);
+        if (i != shard->index.end()) {
+            auto & entry = shard->entries[i->second];
+            entry.value = value;
+            entry.referenced = true;
+            return;
+        }
+
+        if (shard->entries.size() < shardCapacity) {
+            shard->index.emplace(key, shard->entries.size());
+            shard->entries.push_back(Entry{key, value, false});
+            return;
+        }
+
+        /* Advance the clock hand to the first entry that hasn't been
+           used since the last sweep, giving the entries it passes a
+           second chance. */
+        auto & entries = shard->entries;
+        while (entries[shard->hand].referenced) {
+            entries[shard->hand].referenced = false;
+            shard->hand = (shard->hand + 1) % entries.size();
+        }
+
+        auto & victim = entries[shard->hand];
+        shard->index.erase(victim.key);
+        victim = Entry{key, value, false};
+        shard->index.emplace(key, shard->hand);
+        shard->hand = (shard->hand + 1) % entries.size();
+        evictions++;
+    }
+
+    /**
+     * Remove an item from the cache.
+     *
+     * @return true if the item was present.
+     */
+    bool erase(const Key & key)
+    {
+        auto shard(shardFor(key).lock());
+
+        auto i = shard->index.find(key);
+        if (i == shard->index.end()) return false;
+
+        /* Fill the hole with the last entry. */
+        auto pos = i->second;
+        shard->index.erase(i);
+        auto & entries = shard->entries;
+        if (pos + 1 != entries.size()) {
+            entries[pos] = std::move(entries.back());
+            shard->index[entries[pos].key] = pos;
+        }
+        entries.pop_back();
+        if (shard->hand >= entries.size()) shard->hand = 0;
+
+        return true;
+    }
+
+    /**
+     * Look up an item in the cache, marking it as recently used.
+     */
+    std::optional<Value> get(const Key & key)
+    {
+        auto shard(shardFor(key).lock());
+
+        auto i = shard->index.find(key);
+        if (i == shard->index.end()) {
+            misses++;
+            return std::nullopt;
+        }
+
+        hits++;
+        auto & entry = shard->entries[i->second];
+        entry.referenced = true;
+        return entry.value;
+    }
+
+    size_t size()
+    {
+        size_t n = 0;
+        for (auto & shard : shards)
+            n += shard.lock()->entries.size();
+        return n;
+    }
+
+    void clear()
+    {
+        for (auto & shard_ : shards) {
+            auto shard(shard_.lock());
+            shard->entries.clear();
+            shard->index.clear();
+            shard->hand = 0;
+        }
+    }
+
+    Stats getStats()
+    {
+        return {
+            .hits = hits,
+            .misses = misses,
+            .evictions = evictions,
+            .size = size(),
+        };
+    }
+};
+
+}
@@ -1,9 +1,16 @@
 #include "thread-pool.hh"
 #include "signals.hh"
 #include "util.hh"
+#include "finally.hh"
 
 namespace nix {
 
+/**
+ * The pool whose work item the current thread is executing, and the
+ * index of the thread's queue in that pool.
+ */
+static thread_local std::pair<const ThreadPool *, size_t> currentThread{nullptr, 0};
+
 ThreadPool::ThreadPool(size_t _maxThreads)
     : maxThreads(_maxThreads)
 {
@@ -12,6 +19,8 @@ ThreadPool::ThreadPool(size_t _maxThreads)
         if (!maxThreads) maxThreads = 1;
     }
 
+    queues = std::make_unique<Queue[]>(maxThreads + 1);
+
     debug("starting pool of %d threads", maxThreads - 1);
 }
 
@@ -29,26 +38,240 @@ void ThreadPool::shutdown()
         std::swap(workers, state->workers);
     }
 
-    if (workers.empty()) return;
+    if (!workers.empty()) {
+        debug("reaping %d worker threads", workers.size());
 
-    debug("reaping %d worker threads", workers.size());
+        work.notify_all();
+
+        for (auto & thr : workers)
+            thr.join();
+    }
 
-    work.notify_all();
+    discardPending();
+}
+
+size_t ThreadPool::nrPending()
+{
+    size_t n = 0;
+    for (auto & p : pending)
+        n += p;
+    return n;
+}
 
-    for (auto & thr : workers)
-        thr.join();
+size_t ThreadPool::currentQueue()
+{
+    return currentThread.first == this ? currentThread.second : maxThreads;
 }
 
-void ThreadPool::enqueue(const work_t & t)
+void ThreadPool::enqueue(work_t t, Priority priority)
 {
-    auto state(state_.lock());
     if (quit)
         throw ThreadPoolShutDown("cannot enqueue a work item while the thread pool is shutting down");
-    state->pending.push(t);
-    /* Note: process() also executes items, so count it as a worker. */
-    if (state->pending.size() > state->workers.size() + 1 && state->workers.size() + 1 < maxThreads)
-        state->workers.emplace_back(&ThreadPool::doWork, this, false);
-    work.notify_one();
+
+    /* Count the item before it becomes visible to other threads, who
+       might otherwise finish it first. */
+    unfinished++;
+    pending[priority]++;
+
+    auto & queue = queues[currentQueue()];
+    {
+        auto items(queue.items_.lock());
+        (*items)[priority].push_back(std::move(t));
+        queue.sizes[priority]++;
+    }
+
+    /* If the pool started shutting down in the meantime, the item
+       may have missed discardPending(). */
+    if (quit) {
+        discardPending();
+        throw ThreadPoolShutDown("cannot enqueue a work item while the thread pool is shutting down");
+    }
+
+    /* Start another worker if there are more pending items than
+       threads. Note: process() also executes items, so count it as a
+       worker. */
+    if (nrQueues < maxThreads && nrPending() > nrQueues) {
+        auto state(state_.lock());
+        auto n = nrQueues.load();
+        if (!quit && n < maxThreads) {
+            nrQueues = n + 1;
+            state->workers.emplace_back(&ThreadPool::doWork, this, false, n);
+        }
+    }
+
+    /* Idle threads increment `idle` before checking for pending
+       items, and wait while holding the state lock. So either they
+       see this item, or we see them and notify them. */
+    if (idle) {
+        auto state(state_.lock());
+        work.notify_one();
+    }
+}
+
+std::optional<ThreadPool::work_t> ThreadPool::take(size_t self)
+{
+    auto n = nrQueues.load();
+
+    for (size_t prio = nrPriorities; prio-- > 0; ) {
+        if (!pending[prio]) continue;
+
+        /* Look at our own queue first, then at the queue of items
+           from outside the pool, then steal from the others. */
+        bool outside = self == maxThreads;
+        for (size_t i = 0; i <= n; ++i) {
+            auto & queue = queues[
+                outside ? (i == 0 ? maxThreads : i - 1)
+                : i == 0 ? self
+                : i == 1 ? maxThreads
+                : (self + i - 1) % n];
+            if (!queue.sizes[prio]) continue;
+            auto items(queue.items_.lock());
+            auto & deque = (*items)[prio];
+            if (deque.empty()) continue;
+            work_t w;
+            if (i == 0 && !outside) {
+                w = std::move(deque.back());
+                deque.pop_back();
+            } else {
+                w = std::move(deque.front());
+                deque.pop_front();
+            }
+            queue.sizes[prio]--;
+            pending[prio]--;
+            return w;
+        }
+    }
+
+    return std::nullopt;
+}
+
+void ThreadPool::run(work_t & w)
+{
+    try {
+        w();
+    } catch (...) {
+        auto exc = std::current_exception();
+        bool first = false;
+        {
+            auto state(state_.lock());
+            if (!state->exception) {
+                state->exception = exc;
+                // Tell the other workers to quit.
+                quit = true;
+                work.notify_all();
+                first = true;
+            }
+        }
+
+        if (first)
+            discardPending();
+        else {
+            /* Print the exception, since we can't propagate it. */
+            try {
+                std::rethrow_exception(exc);
+            } catch (const Interrupted &) {
+                // The interrupted state may be picked up by multiple
+                // workers, which is expected, so we should ignore
+                // it silently and let the first one bubble up,
+                // rethrown via the original state->exception.
+            } catch (const ThreadPoolShutDown &) {
+                // Similarly expected.
+            } catch (std::exception & e) {
+                ignoreExceptionExceptInterrupt();
+            }
+        }
+    }
+
+    if (--unfinished == 0) {
+        auto state(state_.lock());
+        work.notify_all();
+    }
+}
+
+void ThreadPool::discardPending()
+{
+    std::vector<work_t> discarded;
+
+    for (size_t i = 0; i <= maxThreads; ++i) {
+        auto & queue = queues[i];
+        auto items(queue.items_.lock());
+        for (size_t prio = 0; prio < nrPriorities; ++prio) {
+            auto & deque = (*items)[prio];
+            for (auto & w : deque)
+                discarded.push_back(std::move(w));
+            pending[prio] -= deque.size();
+            unfinished -= deque.size();
+            queue.sizes[prio] = 0;
+            deque.clear();
+        }
+    }
+
+    /* Destroy the work items without holding any locks, since they
+       may own task group tokens that notify their waiters. */
+    discarded.clear();
+}
+
+void ThreadPool::helpUntil(std::function<bool()> done)
+{
+    auto self = currentQueue();
+
+    while (!done()) {
+        if (!quit) {
+            if (auto w = take(self)) {
+                run(*w);
+                continue;
+            }
+        }
+
+        auto state(state_.lock());
+        idle++;
+        if (!done() && (quit || !nrPending()))
+            state.wait(work);
+        idle--;
+    }
+}
+
+void ThreadPool::doWork(bool mainThread, size_t self)
+{
+    ReceiveInterrupts receiveInterrupts;
+
+#ifndef _WIN32 // Does Windows need anything similar for async exit handling?
+    if (!mainThread)
+        unix::interruptCheck = [&]() { return (bool) quit; };
+#endif
+
+    auto prevThread = currentThread;
+    currentThread = {this, self};
+    Finally restoreThread([&]() { currentThread = prevThread; });
+
+    while (true) {
+        if (quit) return;
+
+        if (auto w = take(self)) {
+            run(*w);
+            continue;
+        }
+
+        /* Wait until a work item is available or we're asked to
+           quit. */
+        auto state(state_.lock());
+
+        if (quit) return;
+
+        /* If there are no active or pending items, and the main
+           thread is running process(), then no new items can be
+           added. So exit. */
+        if (!unfinished && state->draining) {
+            quit = true;
+            work.notify_all();
+            return;
+        }
+
+        idle++;
+        if (!nrPending())
+            state.wait(work);
+        idle--;
+    }
 }
 
 void ThreadPool::process()
@@ -57,7 +280,7 @@ void ThreadPool::process()
 
     /* Do work until no more work is pending or active. */
     try {
-        doWork(true);
+        doWork(true, 0);
 
         auto state(state_.lock());
 
@@ -77,87 +300,64 @@ void ThreadPool::process()
     }
 }
 
-void ThreadPool::doWork(bool mainThread)
+/**
+ * Owned by the work items of a task group. It is destroyed when the
+ * work item has finished or has been discarded.
+ */
+struct TaskGroup::Token
 {
-    ReceiveInterrupts receiveInterrupts;
+    TaskGroup & group;
 
-#ifndef _WIN32 // Does Windows need anything similar for async exit handling?
-    if (!mainThread)
-        unix::interruptCheck = [&]() { return (bool) quit; };
-#endif
-
-    bool didWork = false;
-    std::exception_ptr exc;
-
-    while (true) {
-        work_t w;
-        {
-            auto state(state_.lock());
-
-            if (didWork) {
-                assert(state->active);
-                state->active--;
-
-                if (exc) {
-
-                    if (!state->exception) {
-                        state->exception = exc;
-                        // Tell the other workers to quit.
-                        quit = true;
-                        work.notify_all();
-                    } else {
-                        /* Print the exception, since we can't
-                           propagate it. */
-                        try {
-                            std::rethrow_exception(exc);
-                        } catch (const Interrupted &) {
-                            // The interrupted state may be picked up by multiple
-                            // workers, which is expected, so we should ignore
-                            // it silently and let the first one bubble up,
-                            // rethrown via the original state->exception.
-                        } catch (const ThreadPoolShutDown &) {
-                            // Similarly expected.
-                        } catch (std::exception & e) {
-                            ignoreExceptionExceptInterrupt();
-                        }
-                    }
-                }
-            }
-
-            /* Wait until a work item is available or we're asked to
-               quit. */
-            while (true) {
-                if (quit) return;
+    ~Token()
+    {
+        group.finished();
+    }
+};
 
-                if (!state->pending.empty()) break;
+void TaskGroup::finished()
+{
+    /* Once `left` is zero, the waiter may return and destroy us, so
+       don't access any members after decrementing it. */
+    auto & pool = this->pool;
+    if (--left == 0) {
+        auto state(pool.state_.lock());
+        pool.work.notify_all();
+    }
+}
 
-                /* If there are no active or pending items, and the
-                   main thread is running process(), then no new items
-                   can be added. So exit. */
-                if (!state->active && state->draining) {
-                    quit = true;
-                    work.notify_all();
-                    return;
-                }
+TaskGroup::~TaskGroup()
+{
+    /* Work items may still reference the caller's stack frame. */
+    pool.helpUntil([&]() { return left == 0; });
+}
 
-                state.wait(work);
+void TaskGroup::enqueue(ThreadPool::work_t t, ThreadPool::Priority priority)
+{
+    left++;
+    auto token = std::make_shared<Token>(*this);
+
+    pool.enqueue(
+        [this, token{std::move(token)}, t{std::move(t)}]() {
+            try {
+                t();
+            } catch (...) {
+                auto exception(exception_.lock());
+                if (!*exception)
+                    *exception = std::current_exception();
             }
+        },
+        priority);
+}
 
-            w = std::move(state->pending.front());
-            state->pending.pop();
-            state->active++;
-        }
+void TaskGroup::wait()
+{
+    pool.helpUntil([&]() { return left == 0; });
 
-        try {
-            w();
-        } catch (...) {
-            exc = std::current_exception();
-        }
+    if (auto exception = *exception_.lock())
+        std::rethrow_exception(exception);
 
-        didWork = true;
-    }
+    if (pool.quit)
+        throw ThreadPoolShutDown("work items were discarded because the thread pool is shutting down");
 }
 
 }
-
-
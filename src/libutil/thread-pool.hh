@@ -4,19 +4,28 @@
 #include "error.hh"
 #include "sync.hh"
 
-#include <queue>
+#include <array>
+#include <deque>
 #include <functional>
 #include <thread>
 #include <map>
 #include <atomic>
+#include <optional>
 
 namespace nix {
 
 MakeError(ThreadPoolShutDown, Error);
 
 /**
- * A simple thread pool that executes a queue of work items
- * (lambdas).
+ * A work-stealing thread pool that executes work items (lambdas).
+ *
+ * Every thread has its own queue of work items for each priority.
+ * Items enqueued by a work item go to the queue of the thread running
+ * it and are taken from the back, so related work tends to stay on
+ * the same thread. Idle threads steal items from the front of the
+ * other threads' queues. Items enqueued from outside the pool go to a
+ * shared queue and are started in the order in which they were
+ * enqueued (within each priority).
  */
 class ThreadPool
 {
@@ -33,10 +42,20 @@ public:
      */
     typedef std::function<void()> work_t;
 
+    /**
+     * Pending work items with a higher priority are started before
+     * those with a lower priority. Running items are never preempted.
+     */
+    enum Priority {
+        prioLow = 0,
+        prioNormal,
+        prioHigh,
+    };
+
     /**
      * Enqueue a function to be executed by the thread pool.
      */
-    void enqueue(const work_t & t);
+    void enqueue(work_t t, Priority priority = prioNormal);
 
     /**
      * Execute work items until the queue is empty.
@@ -54,12 +73,53 @@ public:
 
 private:
 
+    friend class TaskGroup;
+
     size_t maxThreads;
 
+    static constexpr size_t nrPriorities = 3;
+
+    struct Queue
+    {
+        Sync<std::array<std::deque<work_t>, nrPriorities>> items_;
+
+        /**
+         * The size of each deque in `items_`, so that other threads
+         * can skip this queue without locking it.
+         */
+        std::array<std::atomic<size_t>, nrPriorities> sizes{};
+    };
+
+    /**
+     * One queue per thread, plus one for items enqueued from outside
+     * the pool (`queues[maxThreads]`). `queues[0]` belongs to the
+     * thread calling process().
+     */
+    std::unique_ptr<Queue[]> queues;
+
+    /**
+     * Number of threads that own a queue, including the one calling
+     * process().
+     */
+    std::atomic<size_t> nrQueues{1};
+
+    /**
+     * Number of work items waiting in `queues`, per priority.
+     */
+    std::array<std::atomic<size_t>, nrPriorities> pending{};
+
+    /**
+     * Number of work items that have been enqueued but not finished.
+     */
+    std::atomic<size_t> unfinished{0};
+
+    /**
+     * Number of threads waiting for work.
+     */
+    std::atomic<size_t> idle{0};
+
     struct State
     {
-        std::queue<work_t> pending;
-        size_t active = 0;
         std::exception_ptr exception;
         std::vector<std::thread> workers;
         bool draining = false;
@@ -71,11 +131,91 @@ private:
 
     std::condition_variable work;
 
-    void doWork(bool mainThread);
+    size_t nrPending();
+
+    /**
+     * Return the index of the queue of the current thread, or of the
+     * queue for items from outside the pool.
+     */
+    size_t currentQueue();
+
+    /**
+     * Take the highest-priority work item, preferring the one most
+     * recently added to queue `self`, then the oldest one enqueued
+     * from outside the pool.
+     */
+    std::optional<work_t> take(size_t self);
+
+    /**
+     * Execute a work item taken from the queues and record its
+     * exception, if any.
+     */
+    void run(work_t & w);
+
+    /**
+     * Execute work items until `done` returns true or the pool is
+     * shutting down.
+     */
+    void helpUntil(std::function<bool()> done);
+
+    /**
+     * Destroy all work items that haven't been started yet.
+     */
+    void discardPending();
+
+    void doWork(bool mainThread, size_t self);
 
     void shutdown();
 };
 
+/**
+ * A set of work items that a work item can enqueue and then wait for,
+ * allowing nested parallelism. While waiting, the thread executes
+ * other work items from the pool, so waiting doesn't tie up a thread
+ * and cannot deadlock the pool.
+ */
+class TaskGroup
+{
+public:
+
+    TaskGroup(ThreadPool & pool)
+        : pool(pool)
+    { }
+
+    /**
+     * Waits for the work items that are still running, ignoring
+     * their exceptions.
+     */
+    ~TaskGroup();
+
+    void enqueue(ThreadPool::work_t t, ThreadPool::Priority priority = ThreadPool::prioNormal);
+
+    /**
+     * Wait until all work items in this group have finished, and
+     * rethrow the first exception thrown by any of them.
+     *
+     * Throws `ThreadPoolShutDown` if some work items were discarded
+     * because the pool is shutting down.
+     */
+    void wait();
+
+private:
+
+    ThreadPool & pool;
+
+    /**
+     * Number of work items that have been enqueued but not finished
+     * or discarded.
+     */
+    std::atomic<size_t> left{0};
+
+    Sync<std::exception_ptr> exception_;
+
+    struct Token;
+
+    void finished();
+};
+
 /**
  * Process in parallel a set of items of type T that have a partial
  * ordering between them. Thus, any item is only processed after all
@@ -87,72 +227,79 @@ void processGraph(
     std::function<std::set<T>(const T &)> getEdges,
     std::function<void(const T &)> processNode)
 {
-    struct Graph {
-        std::set<T> left;
-        std::map<T, std::set<T>> refs, rrefs;
+    /* Every node has its own lock, so workers only contend when they
+       touch the same node. A node is processed when `refsLeft` drops
+       to zero. It starts at 1 so that this can't happen while the
+       node's dependencies are still being registered. */
+    struct Node
+    {
+        std::atomic<size_t> refsLeft{1};
+
+        struct State
+        {
+            bool done = false;
+            std::vector<std::pair<const T, Node> *> waiters;
+        };
+
+        Sync<State> state_;
     };
 
-    Sync<Graph> graph_(Graph{nodes, {}, {}});
+    using Entry = std::pair<const T, Node>;
+
+    /* The map is populated up front and never modified afterwards, so
+       it can be read without locking. */
+    std::map<T, Node> graph;
+    for (auto & node : nodes)
+        graph.try_emplace(node);
 
-    std::function<void(const T &)> worker;
+    std::atomic<size_t> nrProcessed{0};
+
+    std::function<void(Entry &)> doWork;
 
     /* Create pool last to ensure threads are stopped before other destructors
      * run */
     ThreadPool pool;
 
-    worker = [&](const T & node) {
+    doWork = [&](Entry & entry) {
+        processNode(entry.first);
+        nrProcessed++;
 
+        std::vector<Entry *> waiters;
         {
-            auto graph(graph_.lock());
-            auto i = graph->refs.find(node);
-            if (i == graph->refs.end())
-                goto getRefs;
-            goto doWork;
+            auto state(entry.second.state_.lock());
+            state->done = true;
+            std::swap(waiters, state->waiters);
         }
 
-    getRefs:
-        {
-            auto refs = getEdges(node);
-            refs.erase(node);
-
-            {
-                auto graph(graph_.lock());
-                for (auto & ref : refs)
-                    if (graph->left.count(ref)) {
-                        graph->refs[node].insert(ref);
-                        graph->rrefs[ref].insert(node);
-                    }
-                if (graph->refs[node].empty())
-                    goto doWork;
-            }
-        }
-
-        return;
-
-    doWork:
-        processNode(node);
-
         /* Enqueue work for all nodes that were waiting on this one
-           and have no unprocessed dependencies. */
-        {
-            auto graph(graph_.lock());
-            for (auto & rref : graph->rrefs[node]) {
-                auto & refs(graph->refs[rref]);
-                auto i = refs.find(node);
-                assert(i != refs.end());
-                refs.erase(i);
-                if (refs.empty())
-                    pool.enqueue(std::bind(worker, rref));
-            }
-            graph->left.erase(node);
-            graph->refs.erase(node);
-            graph->rrefs.erase(node);
+           and have no unprocessed dependencies. Give them a high
+           priority so that work that has been started is finished
+           first. */
+        for (auto waiter : waiters)
+            if (--waiter->second.refsLeft == 0)
+                pool.enqueue(std::bind(doWork, std::ref(*waiter)), ThreadPool::prioHigh);
+    };
+
+    auto getRefs = [&](Entry & entry) {
+        auto refs = getEdges(entry.first);
+        refs.erase(entry.first);
+
+        for (auto & ref : refs) {
+            auto i = graph.find(ref);
+            if (i == graph.end()) continue;
+            auto state(i->second.state_.lock());
+            if (state->done) continue;
+            entry.second.refsLeft++;
+            state->waiters.push_back(&entry);
         }
+
+        if (--entry.second.refsLeft == 0)
+            doWork(entry);
     };
 
-    for (auto & node : nodes) {
+    for (auto & entry : graph) {
         try {
-            pool.enqueue(std::bind(worker, std::ref(node)));
+            pool.enqueue(std::bind(getRefs, std::ref(entry)));
         } catch (ThreadPoolShutDown &) {
             /* Stop if the thread pool is shutting down. It means a
                previous work item threw an exception, so process()
@@ -163,7 +310,7 @@ void processGraph(
 
     pool.process();
 
-    if (!graph_.lock()->left.empty())
+    if (nrProcessed != graph.size())
         throw Error("graph processing incomplete (cyclic reference?)");
 }
 
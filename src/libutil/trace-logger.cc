@@ -0,0 +1,281 @@
+#include "logging.hh"
+#include "sync.hh"
+#include "util.hh"
+
+#include <chrono>
+#include <fstream>
+#include <set>
+#include <thread>
+
+#include <nlohmann/json.hpp>
+
+#ifndef _WIN32
+# include <unistd.h>
+#else
+# include <windows.h>
+#endif
+
+namespace nix {
+
+static std::string_view activityTypeName(ActivityType type)
+{
+    switch (type) {
+    case actCopyPath: return "copy-path";
+    case actFileTransfer: return "file-transfer";
+    case actRealise: return "realise";
+    case actCopyPaths: return "copy-paths";
+    case actBuilds: return "builds";
+    case actBuild: return "build";
+    case actOptimiseStore: return "optimise-store";
+    case actVerifyPaths: return "verify-paths";
+    case actSubstitute: return "substitute";
+    case actQueryPathInfo: return "query-path-info";
+    case actPostBuildHook: return "post-build-hook";
+    case actBuildWaiting: return "build-waiting";
+    case actFetchTree: return "fetch-tree";
+    default: return "unknown";
+    }
+}
+
+static nlohmann::json fieldsToJSON(const Logger::Fields & fields)
+{
+    auto arr = nlohmann::json::array();
+    for (auto & f : fields)
+        if (f.type == Logger::Field::tInt)
+            arr.push_back(f.i);
+        else
+            arr.push_back(f.s);
+    return arr;
+}
+
+/**
+ * A trace file in the Chrome trace event format, which can be opened
+ * in Perfetto or `chrome://tracing`.
+ *
+ * Every activity becomes a complete ("X") event, written when the
+ * activity stops. Since activities on the same thread don't
+ * necessarily nest, each activity is put on a "lane" (shown as a
+ * thread in the viewer) that no other activity occupies at the same
+ * time. The actual thread and the parent activity are recorded in the
+ * event's arguments, together with the activity's fields and the
+ * results it reported (progress, expected counts, phases, bytes).
+ */
+struct TraceFile
+{
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+#ifndef _WIN32
+    uint64_t pid = getpid();
+#else
+    uint64_t pid = GetCurrentProcessId();
+#endif
+
+    struct ActivityInfo
+    {
+        uint64_t start;
+        uint64_t lane;
+        ActivityType type;
+        std::string text;
+        nlohmann::json args;
+    };
+
+    struct State
+    {
+        std::ofstream file;
+        bool first = true;
+        std::map<ActivityId, ActivityInfo> activities;
+        std::set<uint64_t> freeLanes;
+        uint64_t nextLane = 1;
+    };
+
+    Sync<State> state_;
+
+    TraceFile(const Path & path)
+    {
+        auto state(state_.lock());
+        state->file.open(path, std::ios::out | std::ios::trunc);
+        if (!state->file)
+            throw SysError("opening trace file '%s'", path);
+        /* The closing bracket is optional in the trace event format,
+           so the file is usable even if we crash. */
+        state->file << "[\n";
+    }
+
+    ~TraceFile()
+    {
+        auto state(state_.lock());
+        for (auto & [act, info] : state->activities)
+            writeActivity(*state, act, info);
+        state->file << "\n]\n";
+    }
+
+    uint64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - epoch).count();
+    }
+
+    void write(State & state, const nlohmann::json & event)
+    {
+        if (!state.first) state.file << ",\n";
+        state.first = false;
+        state.file << event.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+        state.file.flush();
+    }
+
+    void writeActivity(State & state, ActivityId act, ActivityInfo & info)
+    {
+        info.args["id"] = act;
+        write(state, {
+            {"name", info.text.empty() ? std::string(activityTypeName(info.type)) : info.text},
+            {"cat", activityTypeName(info.type)},
+            {"ph", "X"},
+            {"ts", info.start},
+            {"dur", now() - info.start},
+            {"pid", pid},
+            {"tid", info.lane},
+            {"args", std::move(info.args)},
+        });
+    }
+};
+
+/**
+ * The trace files that are currently open. A new logger for the same
+ * path (e.g. after the log format changed) continues writing the
+ * existing trace, rather than truncating the file while the old
+ * logger still writes to it.
+ */
+static Sync<std::map<Path, std::weak_ptr<TraceFile>>> traceFiles;
+
+/**
+ * A logger that passes everything on to another logger, and
+ * additionally writes a timeline of all activities to a trace file.
+ */
+struct TraceLogger : Logger
+{
+    std::unique_ptr<Logger> next;
+
+    std::shared_ptr<TraceFile> trace;
+
+    TraceLogger(std::unique_ptr<Logger> next, std::shared_ptr<TraceFile> trace)
+        : next(std::move(next))
+        , trace(std::move(trace))
+    { }
+
+    void stop() override { next->stop(); }
+
+    void pause() override { next->pause(); }
+
+    void resume() override { next->resume(); }
+
+    bool isVerbose() override { return next->isVerbose(); }
+
+    void log(Verbosity lvl, std::string_view s) override { next->log(lvl, s); }
+
+    void logEI(const ErrorInfo & ei) override { next->logEI(ei); }
+
+    void warn(const std::string & msg) override { next->warn(msg); }
+
+    void writeToStdout(std::string_view s) override { next->writeToStdout(s); }
+
+    std::optional<char> ask(std::string_view s) override { return next->ask(s); }
+
+    void setPrintBuildLogs(bool printBuildLogs) override { next->setPrintBuildLogs(printBuildLogs); }
+
+    void startActivity(ActivityId act, Verbosity lvl, ActivityType type,
+        const std::string & s, const Fields & fields, ActivityId parent) override
+    {
+        {
+            auto state(trace->state_.lock());
+
+            uint64_t lane;
+            if (state->freeLanes.empty())
+                lane = state->nextLane++;
+            else {
+                lane = *state->freeLanes.begin();
+                state->freeLanes.erase(state->freeLanes.begin());
+            }
+
+            nlohmann::json args = nlohmann::json::object();
+            if (parent) args["parent"] = parent;
+            args["thread"] = std::hash<std::thread::id>()(std::this_thread::get_id());
+            if (!fields.empty()) args["fields"] = fieldsToJSON(fields);
+
+            state->activities.insert_or_assign(act, TraceFile::ActivityInfo {
+                .start = trace->now(),
+                .lane = lane,
+                .type = type,
+                .text = s,
+                .args = std::move(args),
+            });
+        }
+
+        next->startActivity(act, lvl, type, s, fields, parent);
+    }
+
+    void stopActivity(ActivityId act) override
+    {
+        {
+            auto state(trace->state_.lock());
+            auto i = state->activities.find(act);
+            if (i != state->activities.end()) {
+                trace->writeActivity(*state, act, i->second);
+                state->freeLanes.insert(i->second.lane);
+                state->activities.erase(i);
+            }
+        }
+
+        next->stopActivity(act);
+    }
+
+    void result(ActivityId act, ResultType type, const Fields & fields) override
+    {
+        {
+            auto state(trace->state_.lock());
+            auto i = state->activities.find(act);
+            if (i != state->activities.end()) {
+                auto & args = i->second.args;
+                if (type == resProgress && fields.size() >= 2) {
+                    args["done"] = fields[0].i;
+                    args["expected"] = fields[1].i;
+                }
+                else if (type == resSetExpected && fields.size() >= 2)
+                    args["expected-" + std::string(activityTypeName((ActivityType) fields[0].i))] = fields[1].i;
+                else if (type == resFileLinked && !fields.empty())
+                    args["bytes-linked"] = args.value("bytes-linked", (uint64_t) 0) + fields[0].i;
+                else if (type == resBuildLogLine || type == resPostBuildLogLine)
+                    args["log-lines"] = args.value("log-lines", (uint64_t) 0) + 1;
+                else if (type == resSetPhase && !fields.empty())
+                    /* Show phases as instant events on the activity's
+                       lane. */
+                    trace->write(*state, {
+                        {"name", fields[0].s},
+                        {"cat", "phase"},
+                        {"ph", "i"},
+                        {"s", "t"},
+                        {"ts", trace->now()},
+                        {"pid", trace->pid},
+                        {"tid", i->second.lane},
+                    });
+                else if (type == resFetchStatus && !fields.empty())
+                    args["status"] = fields[0].s;
+            }
+        }
+
+        next->result(act, type, fields);
+    }
+};
+
+std::unique_ptr<Logger> makeTraceLogger(std::unique_ptr<Logger> next, const Path & path)
+{
+    auto files(traceFiles.lock());
+    auto & file = (*files)[path];
+    auto trace = file.lock();
+    if (!trace) {
+        trace = std::make_shared<TraceFile>(path);
+        file = trace;
+    }
+    return std::make_unique<TraceLogger>(std::move(next), std::move(trace));
+}
+
+}
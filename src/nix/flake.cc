@@ -19,11 +19,20 @@
 #include "users.hh"
 #include "fetch-to-store.hh"
 #include "local-fs-store.hh"
+#include "build-pipeline.hh"
+#include "current-process.hh"
+#include "exit.hh"
+#include "processes.hh"
+#include "split.hh"
 
 #include <filesystem>
 #include <nlohmann/json.hpp>
 #include <iomanip>
 
+#ifndef _WIN32
+# include <poll.h>
+#endif
+
 #include "strings-inline.hh"
 
 namespace nix::fs { using namespace std::filesystem; }
@@ -330,6 +339,13 @@ struct CmdFlakeCheck : FlakeCommand
 {
     bool build = true;
     bool checkAllSystems = false;
+    size_t evalJobs = 1;
+
+    /**
+     * If set, this process was started by `--eval-jobs` to check
+     * only the outputs assigned to shard `first` of `second`.
+     */
+    std::optional<std::pair<size_t, size_t>> evalShard;
 
     CmdFlakeCheck()
     {
@@ -343,6 +359,29 @@ struct CmdFlakeCheck : FlakeCommand
             .description = "Check the outputs for all systems.",
             .handler = {&checkAllSystems, true}
         });
+        addFlag({
+            .longName = "eval-jobs",
+            .description = "Evaluate the flake outputs in *n* processes in parallel.",
+            .labels = {"n"},
+            .handler = {&evalJobs}
+        });
+
+        std::string internalCategory = "Internal options";
+        addFlag({
+            .longName = "eval-shard",
+            .description = "Only check the outputs assigned to shard *i* of *n* (used by `--eval-jobs`).",
+            .category = internalCategory,
+            .labels = {"i/n"},
+            .handler = {[&](std::string s) {
+                auto slash = s.find('/');
+                auto shard = slash != s.npos ? string2Int<size_t>(s.substr(0, slash)) : std::nullopt;
+                auto nrShards = slash != s.npos ? string2Int<size_t>(s.substr(slash + 1)) : std::nullopt;
+                if (!shard || !nrShards || *shard >= *nrShards)
+                    throw UsageError("invalid evaluation shard '%s'", s);
+                evalShard = {*shard, *nrShards};
+            }}
+        });
+        hiddenCategories.insert(internalCategory);
     }
 
     std::string description() override
@@ -441,7 +480,31 @@ struct CmdFlakeCheck : FlakeCommand
             return std::nullopt;
         };
 
-        std::vector<DerivedPath> drvPaths;
+        /* Build the checks as soon as their derivations are known,
+           rather than after evaluating the whole flake. Checks that
+           become known while earlier ones are building are built
+           together once those are done. If evaluation fails, the
+           pipeline's destructor interrupts the builds. Shards report
+           their checks to the parent process instead. */
+        std::optional<BuildPipeline> buildPipeline;
+        if (build && !evalShard)
+            buildPipeline.emplace(store);
+
+        auto buildCheck = [&](const StorePath & drvPath) {
+            buildPipeline->add({DerivedPath::Built {
+                .drvPath = makeConstantStorePathRef(drvPath),
+                .outputs = OutputsSpec::All { },
+            }});
+        };
+
+        /* Whether this process checks the output `name`, or its
+           attribute `attr` (a system or a name). Outputs are assigned
+           to shards by a hash of their name, so that every shard makes
+           the same assignment without coordination. */
+        auto inShard = [&](std::string_view name, std::string_view attr = "") {
+            return !evalShard
+                || std::hash<std::string>{}(concatStrings(name, ".", attr)) % evalShard->second == evalShard->first;
+        };
 
         auto checkApp = [&](const std::string & attrPath, Value & v, const PosIdx pos) {
             try {
@@ -605,7 +668,10 @@ struct CmdFlakeCheck : FlakeCommand
             }
         };
 
-        {
+        if (evalJobs > 1 && !evalShard)
+            evalInShards(buildCheck, omittedSystems, hasErrors);
+
+        else {
             Activity act(*logger, lvlInfo, actUnknown, "evaluating flake");
 
             auto vFlake = state->allocValue();
@@ -620,9 +686,22 @@ struct CmdFlakeCheck : FlakeCommand
                     try {
                         evalSettings.enableImportFromDerivation.setDefault(name != "hydraJobs");
 
+                        /* Errors in the output itself, and warnings
+                           about it, are reported by the shard that
+                           owns its name. */
+                        if (!inShard(name)) {
+                            try {
+                                state->forceValue(vOutput, pos);
+                            } catch (Error &) {
+                                return;
+                            }
+                            if (vOutput.type() != nAttrs) return;
+                        }
+
                         state->forceValue(vOutput, pos);
 
                         std::string_view replacement =
+                            !inShard(name) ? "" :
                             name == "defaultPackage" ? "packages.<system>.default" :
                             name == "defaultApp" ? "apps.<system>.default" :
                             name == "defaultTemplate" ? "templates.default" :
@@ -637,6 +716,7 @@ struct CmdFlakeCheck : FlakeCommand
                         if (name == "checks") {
                             state->forceAttrs(vOutput, pos, "");
                             for (auto & attr : *vOutput.attrs()) {
+                                if (!inShard(name, state->symbols[attr.name])) continue;
                                 std::string_view attr_name = state->symbols[attr.name];
                                 checkSystemName(attr_name, attr.pos);
                                 if (checkSystemType(attr_name, attr.pos)) {
@@ -645,12 +725,11 @@ struct CmdFlakeCheck : FlakeCommand
                                         auto drvPath = checkDerivation(
                                             fmt("%s.%s.%s", name, attr_name, state->symbols[attr2.name]),
                                             *attr2.value, attr2.pos);
-                                        if (drvPath && attr_name == settings.thisSystem.get()) {
-                                            auto path = DerivedPath::Built {
-                                                .drvPath = makeConstantStorePathRef(*drvPath),
-                                                .outputs = OutputsSpec::All { },
-                                            };
-                                            drvPaths.push_back(std::move(path));
+                                        if (build && drvPath && attr_name == settings.thisSystem.get()) {
+                                            if (evalShard)
+                                                writeFull(STDOUT_FILENO, "build " + store->printStorePath(*drvPath) + "\n");
+                                            else
+                                                buildCheck(*drvPath);
                                         }
                                     }
                                 }
@@ -660,6 +739,7 @@ struct CmdFlakeCheck : FlakeCommand
                         else if (name == "formatter") {
                             state->forceAttrs(vOutput, pos, "");
                             for (auto & attr : *vOutput.attrs()) {
+                                if (!inShard(name, state->symbols[attr.name])) continue;
                                 const auto & attr_name = state->symbols[attr.name];
                                 checkSystemName(attr_name, attr.pos);
                                 if (checkSystemType(attr_name, attr.pos)) {
@@ -673,6 +753,7 @@ struct CmdFlakeCheck : FlakeCommand
                         else if (name == "packages" || name == "devShells") {
                             state->forceAttrs(vOutput, pos, "");
                             for (auto & attr : *vOutput.attrs()) {
+                                if (!inShard(name, state->symbols[attr.name])) continue;
                                 const auto & attr_name = state->symbols[attr.name];
                                 checkSystemName(attr_name, attr.pos);
                                 if (checkSystemType(attr_name, attr.pos)) {
@@ -688,6 +769,7 @@ struct CmdFlakeCheck : FlakeCommand
                         else if (name == "apps") {
                             state->forceAttrs(vOutput, pos, "");
                             for (auto & attr : *vOutput.attrs()) {
+                                if (!inShard(name, state->symbols[attr.name])) continue;
                                 const auto & attr_name = state->symbols[attr.name];
                                 checkSystemName(attr_name, attr.pos);
                                 if (checkSystemType(attr_name, attr.pos)) {
@@ -703,6 +785,7 @@ struct CmdFlakeCheck : FlakeCommand
                         else if (name == "defaultPackage" || name == "devShell") {
                             state->forceAttrs(vOutput, pos, "");
                             for (auto & attr : *vOutput.attrs()) {
+                                if (!inShard(name, state->symbols[attr.name])) continue;
                                 const auto & attr_name = state->symbols[attr.name];
                                 checkSystemName(attr_name, attr.pos);
                                 if (checkSystemType(attr_name, attr.pos)) {
@@ -716,6 +799,7 @@ struct CmdFlakeCheck : FlakeCommand
                         else if (name == "defaultApp") {
                             state->forceAttrs(vOutput, pos, "");
                             for (auto & attr : *vOutput.attrs()) {
+                                if (!inShard(name, state->symbols[attr.name])) continue;
                                 const auto & attr_name = state->symbols[attr.name];
                                 checkSystemName(attr_name, attr.pos);
                                 if (checkSystemType(attr_name, attr.pos) ) {
@@ -729,55 +813,73 @@ struct CmdFlakeCheck : FlakeCommand
                         else if (name == "legacyPackages") {
                             state->forceAttrs(vOutput, pos, "");
                             for (auto & attr : *vOutput.attrs()) {
+                                if (!inShard(name, state->symbols[attr.name])) continue;
                                 checkSystemName(state->symbols[attr.name], attr.pos);
                                 checkSystemType(state->symbols[attr.name], attr.pos);
                                 // FIXME: do getDerivations?
                             }
                         }
 
-                        else if (name == "overlay")
-                            checkOverlay(name, vOutput, pos);
+                        else if (name == "overlay") {
+                            if (inShard(name))
+                                checkOverlay(name, vOutput, pos);
+                        }
 
                         else if (name == "overlays") {
                             state->forceAttrs(vOutput, pos, "");
-                            for (auto & attr : *vOutput.attrs())
+                            for (auto & attr : *vOutput.attrs()) {
+                                if (!inShard(name, state->symbols[attr.name])) continue;
                                 checkOverlay(fmt("%s.%s", name, state->symbols[attr.name]),
                                     *attr.value, attr.pos);
+                            }
                         }
 
-                        else if (name == "nixosModule")
-                            checkModule(name, vOutput, pos);
+                        else if (name == "nixosModule") {
+                            if (inShard(name))
+                                checkModule(name, vOutput, pos);
+                        }
 
                         else if (name == "nixosModules") {
                             state->forceAttrs(vOutput, pos, "");
-                            for (auto & attr : *vOutput.attrs())
+                            for (auto & attr : *vOutput.attrs()) {
+                                if (!inShard(name, state->symbols[attr.name])) continue;
                                 checkModule(fmt("%s.%s", name, state->symbols[attr.name]),
                                     *attr.value, attr.pos);
+                            }
                         }
 
                         else if (name == "nixosConfigurations") {
                             state->forceAttrs(vOutput, pos, "");
-                            for (auto & attr : *vOutput.attrs())
+                            for (auto & attr : *vOutput.attrs()) {
+                                if (!inShard(name, state->symbols[attr.name])) continue;
                                 checkNixOSConfiguration(fmt("%s.%s", name, state->symbols[attr.name]),
                                     *attr.value, attr.pos);
+                            }
                         }
 
-                        else if (name == "hydraJobs")
-                            checkHydraJobs(name, vOutput, pos);
+                        else if (name == "hydraJobs") {
+                            if (inShard(name))
+                                checkHydraJobs(name, vOutput, pos);
+                        }
 
-                        else if (name == "defaultTemplate")
-                            checkTemplate(name, vOutput, pos);
+                        else if (name == "defaultTemplate") {
+                            if (inShard(name))
+                                checkTemplate(name, vOutput, pos);
+                        }
 
                         else if (name == "templates") {
                             state->forceAttrs(vOutput, pos, "");
-                            for (auto & attr : *vOutput.attrs())
+                            for (auto & attr : *vOutput.attrs()) {
+                                if (!inShard(name, state->symbols[attr.name])) continue;
                                 checkTemplate(fmt("%s.%s", name, state->symbols[attr.name]),
                                     *attr.value, attr.pos);
+                            }
                         }
 
                         else if (name == "defaultBundler") {
                             state->forceAttrs(vOutput, pos, "");
                             for (auto & attr : *vOutput.attrs()) {
+                                if (!inShard(name, state->symbols[attr.name])) continue;
                                 const auto & attr_name = state->symbols[attr.name];
                                 checkSystemName(attr_name, attr.pos);
                                 if (checkSystemType(attr_name, attr.pos)) {
@@ -791,6 +893,7 @@ struct CmdFlakeCheck : FlakeCommand
                         else if (name == "bundlers") {
                             state->forceAttrs(vOutput, pos, "");
                             for (auto & attr : *vOutput.attrs()) {
+                                if (!inShard(name, state->symbols[attr.name])) continue;
                                 const auto & attr_name = state->symbols[attr.name];
                                 checkSystemName(attr_name, attr.pos);
                                 if (checkSystemType(attr_name, attr.pos)) {
@@ -819,7 +922,7 @@ struct CmdFlakeCheck : FlakeCommand
                             // Known but unchecked community attribute
                             ;
 
-                        else
+                        else if (inShard(name))
                             warn("unknown flake output '%s'", name);
 
                     } catch (Error & e) {
@@ -829,10 +932,18 @@ struct CmdFlakeCheck : FlakeCommand
                 });
         }
 
-        if (build && !drvPaths.empty()) {
-            Activity act(*logger, lvlInfo, actUnknown,
-                fmt("running %d flake checks", drvPaths.size()));
-            store->buildPaths(drvPaths);
+        if (evalShard) {
+            /* Let the parent process warn about these once. */
+            for (auto & system : omittedSystems)
+                writeFull(STDOUT_FILENO, "omitted " + system + "\n");
+            if (hasErrors)
+                throw Error("some errors were encountered during the evaluation");
+            return;
+        }
+
+        if (buildPipeline) {
+            auto buildResults = buildPipeline->finish();
+            throwBuildErrors(buildResults, *store);
         }
         if (hasErrors)
             throw Error("some errors were encountered during the evaluation");
@@ -846,6 +957,147 @@ struct CmdFlakeCheck : FlakeCommand
             );
         };
     };
+
+    /**
+     * Run `evalJobs` copies of this command with `--eval-shard`, pass
+     * the checks they report to `buildCheck`, and print their
+     * diagnostics in shard order, each as soon as it and the shards
+     * before it have finished.
+     */
+    void evalInShards(
+        std::function<void(const StorePath &)> buildCheck,
+        std::set<std::string> & omittedSystems,
+        bool & hasErrors)
+    {
+        #ifdef _WIN32
+        throw UnimplementedError("'--eval-jobs' is not supported on this platform");
+        #else
+        Activity act(*logger, lvlInfo, actUnknown, fmt("evaluating flake in %d processes", evalJobs));
+
+        auto selfExe = getSelfExe().value_or(savedArgv[0]);
+
+        struct Shard
+        {
+            Pid pid;
+            AutoCloseFD fromChild;
+            std::string buffer;
+            Path logPath;
+            std::optional<AutoDelete> deleteLog;
+            bool done = false;
+            int status = 0;
+        };
+
+        std::vector<Shard> shards(evalJobs);
+
+        for (size_t n = 0; n < evalJobs; ++n) {
+            auto & shard = shards[n];
+
+            auto [logFd, logPath] = createTempFile("nix-flake-check");
+            shard.logPath = logPath;
+            shard.deleteLog.emplace(logPath, false);
+
+            Pipe out;
+            out.create();
+
+            Strings args;
+            for (auto arg = savedArgv; *arg; ++arg)
+                args.push_back(*arg);
+            args.push_back("--eval-shard");
+            args.push_back(fmt("%d/%d", n, evalJobs));
+
+            shard.pid = startProcess([&]() {
+                if (dup2(out.writeSide.get(), STDOUT_FILENO) == -1)
+                    throw SysError("dupping stdout");
+                if (dup2(logFd.get(), STDERR_FILENO) == -1)
+                    throw SysError("dupping stderr");
+                execv(selfExe.c_str(), stringsToCharPtrs(args).data());
+                throw SysError("executing '%s'", selfExe);
+            });
+
+            out.writeSide.close();
+            shard.fromChild = std::move(out.readSide);
+        }
+
+        size_t running = evalJobs;
+        size_t printed = 0;
+
+        while (running) {
+            std::vector<struct pollfd> fds;
+            std::vector<size_t> fdShards;
+            for (size_t n = 0; n < evalJobs; ++n)
+                if (!shards[n].done) {
+                    fds.push_back({.fd = shards[n].fromChild.get(), .events = POLLIN, .revents = 0});
+                    fdShards.push_back(n);
+                }
+
+            if (poll(fds.data(), fds.size(), -1) == -1) {
+                if (errno != EINTR) throw SysError("waiting for evaluation processes");
+            }
+
+            checkInterrupt();
+
+            for (size_t i = 0; i < fds.size(); ++i) {
+                if (!fds[i].revents) continue;
+                auto & shard = shards[fdShards[i]];
+
+                char buf[4096];
+                auto rd = read(shard.fromChild.get(), buf, sizeof(buf));
+                if (rd == -1) {
+                    if (errno == EINTR) continue;
+                    throw SysError("reading from evaluation process");
+                }
+
+                if (rd == 0) {
+                    shard.done = true;
+                    shard.status = shard.pid.wait();
+                    running--;
+                    continue;
+                }
+
+                shard.buffer.append(buf, rd);
+
+                size_t newline;
+                while ((newline = shard.buffer.find('\n')) != std::string::npos) {
+                    auto line = shard.buffer.substr(0, newline);
+                    shard.buffer.erase(0, newline + 1);
+                    std::string_view rest(line);
+                    auto kind = splitPrefixTo(rest, ' ');
+                    if (kind == "build")
+                        buildCheck(getStore()->parseStorePath(rest));
+                    else if (kind == "omitted")
+                        omittedSystems.insert(std::string(rest));
+                }
+            }
+
+            auto printLog = [&](Shard & shard) {
+                logger->pause();
+                writeToStderr(readFile(shard.logPath));
+                logger->resume();
+            };
+
+            for (; printed < evalJobs && shards[printed].done; ++printed) {
+                auto & shard = shards[printed];
+                printLog(shard);
+                if (shard.status != 0)
+                    hasErrors = true;
+            }
+
+            /* Without `--keep-going`, stop at the first failed shard,
+               even if earlier ones are still running. The shard has
+               printed its errors already, and the destructors of the
+               other `Pid`s kill them. */
+            if (!settings.keepGoing) {
+                if (hasErrors)
+                    throw Exit(1);
+                for (auto & shard : shards)
+                    if (shard.done && shard.status != 0) {
+                        printLog(shard);
+                        throw Exit(1);
+                    }
+            }
+        }
+        #endif
+    }
 };
 
 static Strings defaultTemplateAttrPathsPrefixes{"templates."};
@@ -4,10 +4,46 @@
 #include "store-api.hh"
 #include "log-store.hh"
 
+#include <regex>
+
 using namespace nix;
 
 struct CmdLog : InstallableCommand
 {
+    std::optional<size_t> tail;
+    std::optional<std::string> grep;
+    bool follow = false;
+
+    CmdLog()
+    {
+        addFlag({
+            .longName = "tail",
+            .description = "Only show the last *n* lines of the log.",
+            .labels = {"n"},
+            .handler = {[this](std::string s) {
+                if (auto n = string2Int<size_t>(s))
+                    tail = *n;
+                else
+                    throw UsageError("'--tail' requires a non-negative integer");
+            }},
+        });
+
+        addFlag({
+            .longName = "grep",
+            .description = "Only show the lines of the log that contain a match for *regex*.",
+            .labels = {"regex"},
+            .handler = {[this](std::string s) {
+                grep = s;
+            }},
+        });
+
+        addFlag({
+            .longName = "follow",
+            .description = "If the derivation is being built, keep showing its log until the build finishes.",
+            .handler = {&follow, true},
+        });
+    }
+
     std::string description() override
     {
         return "show the build log of the specified packages or paths, if available";
@@ -43,7 +79,15 @@ struct CmdLog : InstallableCommand
         }, b.path.raw());
         auto path = resolveDerivedPath(*store, *oneUp);
 
-        RunPager pager;
+        BuildLogFilter filter {
+            .grep = grep ? std::optional(std::regex(*grep, std::regex::extended)) : std::nullopt,
+            .tail = tail,
+            .follow = follow,
+        };
+
+        std::optional<RunPager> pager;
+        if (!follow) pager.emplace();
+
         for (auto & sub : subs) {
             auto * logSubP = dynamic_cast<LogStore *>(&*sub);
             if (!logSubP) {
@@ -52,11 +96,23 @@ struct CmdLog : InstallableCommand
             }
             auto & logSub = *logSubP;
 
-            auto log = logSub.getBuildLog(path);
-            if (!log) continue;
-            logger->stop();
-            printInfo("got build log for '%s' from '%s'", installable->what(), logSub.getUri());
-            writeFull(getStandardOutput(), *log);
+            /* Only stop the progress bar once the log was found, but
+               before writing any of it. */
+            bool found = false;
+            auto start = [&]() {
+                if (found) return;
+                found = true;
+                logger->stop();
+                printInfo("got build log for '%s' from '%s'", installable->what(), logSub.getUri());
+            };
+
+            LambdaSink sink([&](std::string_view data) {
+                start();
+                writeFull(getStandardOutput(), data);
+            });
+
+            if (!logSub.readBuildLog(path, filter, sink)) continue;
+            start();
             return;
         }
 
@@ -19,6 +19,13 @@ struct CmdStoreGC : StoreCommand, MixDryRun
             .labels = {"n"},
             .handler = {&options.maxFreed}
         });
+
+        addFlag({
+            .longName = "max-paths",
+            .description = "Rather than scanning the entire store, only consider the oldest store paths that are not referenced by other store paths, until *n* of them have been found to be garbage.",
+            .labels = {"n"},
+            .handler = {&options.maxCandidates}
+        });
     }
 
     std::string description() override
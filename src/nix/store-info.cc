@@ -42,6 +42,14 @@ struct CmdPingStore : StoreCommand, MixJSON
                 res["version"] = *version;
             if (auto trusted = store->isTrustedClient())
                 res["trusted"] = *trusted;
+
+            auto & stats = store->getStats();
+            res["pathInfoCache"] = {
+                {"size", stats.pathInfoCacheSize.load()},
+                {"hits", stats.pathInfoCacheHits.load()},
+                {"misses", stats.pathInfoCacheMisses.load()},
+                {"evictions", stats.pathInfoCacheEvictions.load()},
+            };
         }
     }
 };
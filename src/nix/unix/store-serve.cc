@@ -0,0 +1,867 @@
+#include "command.hh"
+#include "shared.hh"
+#include "store-api.hh"
+#include "serialise.hh"
+#include "signals.hh"
+#include "file-system.hh"
+#include "sync.hh"
+#include "url.hh"
+#include "finally.hh"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <unordered_map>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace nix;
+
+namespace {
+
+/**
+ * An index of the `.narinfo` files in a binary cache directory, so
+ * that the common case of a narinfo lookup doesn't touch the file
+ * system. The contents of the narinfo files are copied into an
+ * unlinked temporary file that is mapped into memory, so they are
+ * backed by the page cache rather than by the heap. The index itself
+ * only maps hash parts to offsets in that file.
+ */
+struct NarInfoIndex
+{
+    struct Entry
+    {
+        uint64_t offset;
+        uint64_t size;
+        /**
+         * Replacing a narinfo file (which is done by renaming a new
+         * one over it) changes its inode number.
+         */
+        ino_t ino;
+    };
+
+    struct State
+    {
+        std::unordered_map<std::string, Entry> entries;
+
+        /**
+         * The mapping of the first `size` bytes of `fd`.
+         */
+        char * data = nullptr;
+        uint64_t size = 0;
+
+        /**
+         * Bytes of the file that belong to deleted or replaced
+         * narinfos.
+         */
+        uint64_t garbage = 0;
+
+        ~State()
+        {
+            if (data) munmap(data, size);
+        }
+    };
+
+    Path dir;
+
+    /**
+     * The temporary file. Only `refresh()` writes to it.
+     */
+    AutoCloseFD fd;
+
+    /**
+     * The modification time of `dir` at the last refresh, so that
+     * refreshing an unchanged directory is a single stat().
+     */
+    std::optional<std::pair<time_t, long>> dirMtime;
+
+    SharedSync<State> state_;
+
+    NarInfoIndex(const Path & dir) : dir(dir)
+    {
+        auto [fd, path] = createTempFile("nix-serve-narinfo");
+        unlink(path.c_str());
+        this->fd = std::move(fd);
+    }
+
+    /**
+     * Pick up the narinfo files that have been added, replaced or
+     * deleted since the previous call. Only one thread may call this.
+     */
+    void refresh()
+    {
+        struct stat st;
+        if (stat(dir.c_str(), &st) == -1)
+            throw SysError("getting status of '%s'", dir);
+#ifdef __APPLE__
+        auto mtime = std::make_pair(st.st_mtimespec.tv_sec, st.st_mtimespec.tv_nsec);
+#else
+        auto mtime = std::make_pair(st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+#endif
+        if (dirMtime == mtime) return;
+
+        /* A change within the timestamp granularity of the directory
+           wouldn't be noticed, so check it again next time. */
+        if (mtime.first >= time(nullptr) - 1)
+            dirMtime.reset();
+        else
+            dirMtime = mtime;
+
+        /* Read the inode numbers from the directory, rather than
+           lstat()ing every narinfo. */
+        std::unordered_map<std::string, ino_t> files;
+        {
+            AutoCloseDir d(opendir(dir.c_str()));
+            if (!d) throw SysError("opening directory '%s'", dir);
+            struct dirent * dirent;
+            while (errno = 0, dirent = readdir(d.get())) {
+                checkInterrupt();
+                std::string_view name = dirent->d_name;
+                if (!hasSuffix(name, ".narinfo")) continue;
+                files.emplace(name.substr(0, name.size() - 8), dirent->d_ino);
+            }
+            if (errno) throw SysError("reading directory '%s'", dir);
+        }
+
+        std::vector<std::pair<std::string, ino_t>> changed;
+        uint64_t end;
+        {
+            auto state(state_.readLock());
+            for (auto & [hashPart, ino] : files) {
+                auto i = state->entries.find(hashPart);
+                if (i == state->entries.end() || i->second.ino != ino)
+                    changed.emplace_back(hashPart, ino);
+            }
+            end = state->size;
+        }
+
+        /* Append the new narinfos to the file. Readers only look at
+           the part that is already mapped. */
+        std::vector<std::pair<std::string, Entry>> added;
+        for (auto & [hashPart, ino] : changed) {
+            checkInterrupt();
+            std::string contents;
+            try {
+                contents = readFile(dir + "/" + hashPart + ".narinfo");
+            } catch (SysError &) {
+                /* The file may have been deleted in the meantime. */
+                ignoreExceptionExceptInterrupt(lvlDebug);
+                files.erase(hashPart);
+                continue;
+            }
+            writeFull(fd.get(), contents);
+            added.emplace_back(hashPart, Entry { end, contents.size(), ino });
+            end += contents.size();
+        }
+
+        auto state(state_.lock());
+
+        for (auto i = state->entries.begin(); i != state->entries.end(); ) {
+            if (files.count(i->first)) { ++i; continue; }
+            state->garbage += i->second.size;
+            i = state->entries.erase(i);
+        }
+
+        for (auto & [hashPart, entry] : added) {
+            auto i = state->entries.find(hashPart);
+            if (i != state->entries.end()) state->garbage += i->second.size;
+            state->entries.insert_or_assign(hashPart, entry);
+        }
+
+        /* Once most of the file is garbage, copy the live narinfos
+           into a new one. */
+        if (state->garbage > end / 2 && state->garbage > 1024 * 1024) {
+            auto [newFd, path] = createTempFile("nix-serve-narinfo");
+            unlink(path.c_str());
+            uint64_t newEnd = 0;
+            {
+                auto data = map(end);
+                for (auto & [hashPart, entry] : state->entries) {
+                    writeFull(newFd.get(), {data.get() + entry.offset, entry.size});
+                    entry.offset = newEnd;
+                    newEnd += entry.size;
+                }
+            }
+            fd = std::move(newFd);
+            end = newEnd;
+            state->garbage = 0;
+        }
+
+        if (state->data) munmap(state->data, state->size);
+        state->data = nullptr;
+        state->size = end;
+        if (end) state->data = map(end).release();
+    }
+
+    size_t size()
+    {
+        return state_.readLock()->entries.size();
+    }
+
+    std::optional<std::string> lookup(const std::string & hashPart)
+    {
+        {
+            auto state(state_.readLock());
+            auto i = state->entries.find(hashPart);
+            if (i != state->entries.end())
+                return std::string(state->data + i->second.offset, i->second.size);
+        }
+
+        /* The narinfo may have been added since the last refresh. */
+        try {
+            return readFile(dir + "/" + hashPart + ".narinfo");
+        } catch (SysError &) {
+            return std::nullopt;
+        }
+    }
+
+private:
+
+    struct Unmap
+    {
+        size_t size;
+        void operator()(char * p) { munmap(p, size); }
+    };
+
+    std::unique_ptr<char, Unmap> map(uint64_t size)
+    {
+        auto p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd.get(), 0);
+        if (p == MAP_FAILED)
+            throw SysError("mapping the narinfo index");
+        return {(char *) p, Unmap { size }};
+    }
+};
+
+struct Metrics
+{
+    std::atomic<uint64_t> connections{0};
+    std::atomic<uint64_t> activeConnections{0};
+    std::atomic<uint64_t> bytesSent{0};
+    std::atomic<uint64_t> narInfoHits{0};
+    std::atomic<uint64_t> narInfoMisses{0};
+    Sync<std::map<unsigned int, uint64_t>> responses;
+};
+
+struct Request
+{
+    std::string method;
+    std::string path;
+    std::string version;
+    /**
+     * Header names are converted to lower case.
+     */
+    std::map<std::string, std::string> headers;
+
+    std::optional<std::string> header(const std::string & name) const
+    {
+        auto i = headers.find(name);
+        if (i == headers.end()) return std::nullopt;
+        return i->second;
+    }
+};
+
+/**
+ * A client connection. Between requests, it is watched by the
+ * thread that accepts connections, so idle clients don't occupy a
+ * worker thread.
+ */
+struct Connection
+{
+    AutoCloseFD fd;
+
+    /**
+     * Data received after the previous request.
+     */
+    std::string buf;
+
+    std::chrono::steady_clock::time_point lastActive;
+
+    std::atomic<uint64_t> & activeConnections;
+
+    Connection(AutoCloseFD fd, std::atomic<uint64_t> & activeConnections)
+        : fd(std::move(fd))
+        , lastActive(std::chrono::steady_clock::now())
+        , activeConnections(activeConnections)
+    {
+        activeConnections++;
+    }
+
+    ~Connection()
+    {
+        activeConnections--;
+    }
+};
+
+struct Server
+{
+    Path dir;
+    NarInfoIndex index;
+    Metrics metrics;
+
+    struct State
+    {
+        /**
+         * Connections with a request to be served.
+         */
+        std::deque<std::shared_ptr<Connection>> ready;
+
+        /**
+         * Connections that have been served and are to be watched
+         * again.
+         */
+        std::vector<std::shared_ptr<Connection>> idle;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup;
+
+    /**
+     * Written to when a connection is added to `State::idle`, to
+     * wake up the thread that watches them.
+     */
+    Pipe idlePipe;
+
+    Server(const Path & dir) : dir(dir), index(dir)
+    {
+        idlePipe.create();
+    }
+
+    /**
+     * Serve the requests in `conn`, and return it to the idle
+     * connections if it is to be kept alive.
+     */
+    void handleRequests(std::shared_ptr<Connection> conn);
+
+    /**
+     * Serve ready connections forever.
+     */
+    void worker();
+
+private:
+
+    /**
+     * Read the next request from `fd`. Returns nothing if the
+     * connection was closed or timed out.
+     */
+    std::optional<Request> readRequest(Descriptor fd, std::string & buf);
+
+    /**
+     * Serve `request`. Returns whether the connection can be kept
+     * alive.
+     */
+    bool serve(const Request & request, FdSink & out);
+
+    void sendResponse(
+        FdSink & out,
+        const Request & request,
+        unsigned int status,
+        std::string_view contentType,
+        std::string_view body,
+        const std::map<std::string, std::string> & extraHeaders = {});
+
+    void sendFile(FdSink & out, const Request & request, const Path & path);
+
+    void countResponse(unsigned int status)
+    {
+        (*metrics.responses.lock())[status]++;
+    }
+
+    std::string renderMetrics();
+};
+
+static std::string_view statusText(unsigned int status)
+{
+    switch (status) {
+    case 200: return "OK";
+    case 206: return "Partial Content";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 416: return "Range Not Satisfiable";
+    case 431: return "Request Header Fields Too Large";
+    default: return "Internal Server Error";
+    }
+}
+
+static std::string_view contentTypeFor(std::string_view path)
+{
+    if (hasSuffix(path, ".narinfo")) return "text/x-nix-narinfo";
+    if (hasSuffix(path, "/nix-cache-info")) return "text/x-nix-cache-info";
+    if (path.find("/nar/") == 0 || path.find("/chunks/") == 0) return "application/x-nix-nar";
+    if (hasSuffix(path, ".ls") || path.find("/realisations/") == 0 || path.find("/debuginfo/") == 0)
+        return "application/json";
+    return "application/octet-stream";
+}
+
+std::optional<Request> Server::readRequest(Descriptor fd, std::string & buf)
+{
+    size_t end;
+
+    while ((end = buf.find("\r\n\r\n")) == std::string::npos) {
+        if (buf.size() > 16 * 1024)
+            throw Error("request header too large");
+        char tmp[4096];
+        ssize_t n = read(fd, tmp, sizeof(tmp));
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return std::nullopt;
+        buf.append(tmp, n);
+    }
+
+    auto lines = tokenizeString<std::vector<std::string>>(buf.substr(0, end), "\r\n");
+    buf.erase(0, end + 4);
+
+    if (lines.empty())
+        throw Error("empty request");
+
+    Request request;
+
+    auto requestLine = tokenizeString<std::vector<std::string>>(lines[0], " ");
+    if (requestLine.size() != 3)
+        throw Error("invalid request line '%s'", lines[0]);
+    request.method = requestLine[0];
+    request.path = requestLine[1];
+    request.version = requestLine[2];
+
+    for (size_t i = 1; i < lines.size(); ++i) {
+        auto colon = lines[i].find(':');
+        if (colon == std::string::npos) continue;
+        request.headers.insert_or_assign(
+            toLower(lines[i].substr(0, colon)),
+            trim(lines[i].substr(colon + 1)));
+    }
+
+    return request;
+}
+
+void Server::sendResponse(
+    FdSink & out,
+    const Request & request,
+    unsigned int status,
+    std::string_view contentType,
+    std::string_view body,
+    const std::map<std::string, std::string> & extraHeaders)
+{
+    countResponse(status);
+
+    std::string head = fmt("HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %d\r\n",
+        status, statusText(status), contentType, body.size());
+    for (auto & [name, value] : extraHeaders)
+        head += name + ": " + value + "\r\n";
+    head += "\r\n";
+
+    out(head);
+    if (request.method != "HEAD")
+        out(body);
+}
+
+void Server::sendFile(FdSink & out, const Request & request, const Path & path)
+{
+    AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (!fd || fstat(fd.get(), &st) == -1 || !S_ISREG(st.st_mode)) {
+        sendResponse(out, request, 404, "text/plain", "not found\n");
+        return;
+    }
+
+    uint64_t fileSize = st.st_size;
+    uint64_t start = 0, length = fileSize;
+    unsigned int status = 200;
+    std::map<std::string, std::string> headers { {"Accept-Ranges", "bytes"} };
+
+    /* Support a single byte range ("bytes=a-b", "bytes=a-" or
+       "bytes=-n"), which is what download resumption uses. */
+    if (auto range = request.header("range"); range && hasPrefix(*range, "bytes=") && range->find(',') == std::string::npos) {
+        auto spec = range->substr(6);
+        auto dash = spec.find('-');
+        std::optional<uint64_t> first, last;
+        if (dash != std::string::npos) {
+            if (dash > 0) first = string2Int<uint64_t>(spec.substr(0, dash));
+            if (dash + 1 < spec.size()) last = string2Int<uint64_t>(spec.substr(dash + 1));
+        }
+        if (dash == std::string::npos || (!first && !last)) {
+            sendResponse(out, request, 400, "text/plain", "invalid range\n");
+            return;
+        }
+        if (!first) {
+            /* Suffix range. */
+            start = fileSize - std::min(*last, fileSize);
+            length = fileSize - start;
+        } else {
+            if (*first >= fileSize || (last && *last < *first)) {
+                sendResponse(out, request, 416, "text/plain", "range not satisfiable\n",
+                    {{"Content-Range", fmt("bytes */%d", fileSize)}});
+                return;
+            }
+            start = *first;
+            length = std::min(last ? *last + 1 : fileSize, fileSize) - start;
+        }
+        status = 206;
+        headers.emplace("Content-Range", fmt("bytes %d-%d/%d", start, start + length - 1, fileSize));
+    }
+
+    countResponse(status);
+
+    std::string head = fmt("HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %d\r\n",
+        status, statusText(status), contentTypeFor(request.path), length);
+    for (auto & [name, value] : headers)
+        head += name + ": " + value + "\r\n";
+    head += "\r\n";
+    out(head);
+
+    if (request.method == "HEAD") return;
+
+    if (start && lseek(fd.get(), start, SEEK_SET) == -1)
+        throw SysError("seeking in '%s'", path);
+
+    /* Send the file with sendfile() if possible. */
+    auto left = length - out.copyFromFile(fd.get(), length);
+
+    std::vector<char> buf(64 * 1024);
+    while (left) {
+        auto n = read(fd.get(), buf.data(), std::min(left, (uint64_t) buf.size()));
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            throw SysError("reading '%s'", path);
+        }
+        if (n == 0)
+            throw Error("file '%s' was truncated while sending it", path);
+        out({buf.data(), (size_t) n});
+        left -= n;
+    }
+}
+
+std::string Server::renderMetrics()
+{
+    std::string res;
+
+    res += "# TYPE nix_serve_connections_total counter\n";
+    res += fmt("nix_serve_connections_total %d\n", metrics.connections.load());
+    res += "# TYPE nix_serve_active_connections gauge\n";
+    res += fmt("nix_serve_active_connections %d\n", metrics.activeConnections.load());
+    res += "# TYPE nix_serve_responses_total counter\n";
+    for (auto & [status, count] : *metrics.responses.lock())
+        res += fmt("nix_serve_responses_total{status=\"%d\"} %d\n", status, count);
+    res += "# TYPE nix_serve_sent_bytes_total counter\n";
+    res += fmt("nix_serve_sent_bytes_total %d\n", metrics.bytesSent.load());
+    res += "# TYPE nix_serve_narinfo_hits_total counter\n";
+    res += fmt("nix_serve_narinfo_hits_total %d\n", metrics.narInfoHits.load());
+    res += "# TYPE nix_serve_narinfo_misses_total counter\n";
+    res += fmt("nix_serve_narinfo_misses_total %d\n", metrics.narInfoMisses.load());
+    res += "# TYPE nix_serve_narinfo_index_entries gauge\n";
+    res += fmt("nix_serve_narinfo_index_entries %d\n", index.size());
+
+    return res;
+}
+
+bool Server::serve(const Request & request, FdSink & out)
+{
+    auto connection = toLower(request.header("connection").value_or(""));
+    bool keepAlive = request.version == "HTTP/1.1"
+        ? connection != "close"
+        : connection == "keep-alive";
+
+    if (request.header("content-length").value_or("0") != "0" || request.header("transfer-encoding")) {
+        sendResponse(out, request, 400, "text/plain", "request bodies are not supported\n");
+        return false;
+    }
+
+    if (request.method != "GET" && request.method != "HEAD") {
+        sendResponse(out, request, 405, "text/plain", "method not allowed\n", {{"Allow", "GET, HEAD"}});
+        return keepAlive;
+    }
+
+    auto path = request.path.substr(0, request.path.find('?'));
+
+    if (path.empty() || path[0] != '/' || path.find('\0') != std::string::npos) {
+        sendResponse(out, request, 400, "text/plain", "invalid path\n");
+        return keepAlive;
+    }
+
+    /* Canonicalisation removes any ".." components, so the result is
+       always inside the cache directory. */
+    auto canonPath = CanonPath(percentDecode(path));
+
+    if (canonPath.abs() == "/metrics") {
+        sendResponse(out, request, 200, "text/plain; version=0.0.4", renderMetrics());
+        return keepAlive;
+    }
+
+    if (canonPath.isRoot()) {
+        sendResponse(out, request, 404, "text/plain", "not found\n");
+        return keepAlive;
+    }
+
+    if (auto parent = canonPath.parent(); parent && parent->isRoot() && hasSuffix(canonPath.abs(), ".narinfo")) {
+        auto name = std::string(*canonPath.baseName());
+        if (auto narInfo = index.lookup(name.substr(0, name.size() - 8))) {
+            metrics.narInfoHits++;
+            sendResponse(out, request, 200, contentTypeFor(canonPath.abs()), *narInfo);
+        } else {
+            metrics.narInfoMisses++;
+            sendResponse(out, request, 404, "text/plain", "not found\n");
+        }
+        return keepAlive;
+    }
+
+    sendFile(out, request, dir + canonPath.abs());
+
+    return keepAlive;
+}
+
+void Server::handleRequests(std::shared_ptr<Connection> conn)
+{
+    FdSink out(conn->fd.get());
+
+    try {
+        /* Also serve the requests that the client sent without
+           waiting for a response. */
+        do {
+            auto request = readRequest(conn->fd.get(), conn->buf);
+            if (!request) return;
+            auto written = out.written;
+            auto keepAlive = serve(*request, out);
+            out.flush();
+            metrics.bytesSent += out.written - written;
+            debug("%s %s", request->method, request->path);
+            if (!keepAlive) return;
+        } while (conn->buf.find("\r\n\r\n") != std::string::npos);
+    } catch (Error & e) {
+        debug("error handling HTTP connection: %s", e.msg());
+        /* Don't try to flush a response that may be incomplete. */
+        out.bufPos = 0;
+        return;
+    }
+
+    conn->lastActive = std::chrono::steady_clock::now();
+    state_.lock()->idle.push_back(std::move(conn));
+    writeFull(idlePipe.writeSide.get(), "x", false);
+}
+
+void Server::worker()
+{
+    while (true) {
+        std::shared_ptr<Connection> conn;
+        {
+            auto state(state_.lock());
+            while (state->ready.empty())
+                state.wait(wakeup);
+            conn = std::move(state->ready.front());
+            state->ready.pop_front();
+        }
+
+        /* An exception escaping this detached thread would terminate
+           the server. */
+        try {
+            handleRequests(std::move(conn));
+        } catch (std::exception & e) {
+            printError("error handling HTTP connection: %s", e.what());
+        } catch (...) {
+            printError("unknown error handling HTTP connection");
+        }
+    }
+}
+
+}
+
+struct CmdStoreServe : StoreCommand
+{
+    std::string listenAddress = "127.0.0.1";
+    unsigned int port = 8080;
+    unsigned int threads = 32;
+    unsigned int refreshInterval = 60;
+    unsigned int idleTimeout = 30;
+
+    CmdStoreServe()
+    {
+        addFlag({
+            .longName = "listen-address",
+            .description = "The address to listen on.",
+            .labels = {"address"},
+            .handler = {&listenAddress},
+        });
+
+        addFlag({
+            .longName = "port",
+            .description = "The TCP port to listen on.",
+            .labels = {"port"},
+            .handler = {&port},
+        });
+
+        addFlag({
+            .longName = "threads",
+            .description = "The number of worker threads, i.e. the maximum number of requests to serve concurrently. Idle keep-alive connections don't occupy a worker.",
+            .labels = {"n"},
+            .handler = {&threads},
+        });
+
+        addFlag({
+            .longName = "refresh-interval",
+            .description = "How often to check the binary cache for added, changed or deleted `.narinfo` files, in seconds.",
+            .labels = {"seconds"},
+            .handler = {&refreshInterval},
+        });
+
+        addFlag({
+            .longName = "idle-timeout",
+            .description = "Close idle keep-alive connections after this many seconds.",
+            .labels = {"seconds"},
+            .handler = {&idleTimeout},
+        });
+    }
+
+    std::string description() override
+    {
+        return "serve a local binary cache over HTTP";
+    }
+
+    std::string doc() override
+    {
+        return
+          #include "store-serve.md"
+          ;
+    }
+
+    void run(ref<Store> store) override
+    {
+        auto uri = store->getUri();
+        if (!hasPrefix(uri, "file://"))
+            throw UsageError("'nix store serve' requires a local binary cache (such as 'file:///path'), not '%s'", uri);
+
+        auto server = std::make_shared<Server>(uri.substr(7));
+
+        server->index.refresh();
+        printInfo("indexed %d narinfo files in '%s'", server->index.size(), server->dir);
+
+        struct addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        struct addrinfo * res;
+        if (auto err = getaddrinfo(listenAddress.c_str(), std::to_string(port).c_str(), &hints, &res))
+            throw Error("cannot resolve '%s': %s", listenAddress, gai_strerror(err));
+        Finally freeRes([&]() { freeaddrinfo(res); });
+
+        AutoCloseFD fdSocket = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol);
+        if (!fdSocket)
+            throw SysError("cannot create socket");
+
+        int one = 1;
+        setsockopt(fdSocket.get(), SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        if (bind(fdSocket.get(), res->ai_addr, res->ai_addrlen) == -1)
+            throw SysError("cannot bind to '%s' port %d", listenAddress, port);
+
+        if (listen(fdSocket.get(), 128) == -1)
+            throw SysError("cannot listen on '%s' port %d", listenAddress, port);
+
+        printInfo("serving '%s' on http://%s:%d/", server->dir, listenAddress, port);
+
+        /* The socket is non-blocking so that accepting every pending
+           connection doesn't block the loop below. */
+        if (fcntl(fdSocket.get(), F_SETFL, fcntl(fdSocket.get(), F_GETFL) | O_NONBLOCK) == -1)
+            throw SysError("making socket non-blocking");
+
+        /* The workers serve connections that have a request, until
+           the process exits. */
+        for (unsigned int i = 0; i < std::max(threads, 1U); ++i)
+            std::thread([server]() { server->worker(); }).detach();
+
+        /* This thread accepts connections and watches the idle ones,
+           so that they don't tie up a worker. */
+        std::vector<std::shared_ptr<Connection>> idle;
+
+        auto lastRefresh = std::chrono::steady_clock::now();
+
+        while (true) {
+            checkInterrupt();
+
+            {
+                auto state(server->state_.lock());
+                for (auto & conn : state->idle)
+                    idle.push_back(std::move(conn));
+                state->idle.clear();
+            }
+
+            std::vector<struct pollfd> fds;
+            fds.push_back({.fd = fdSocket.get(), .events = POLLIN, .revents = 0});
+            fds.push_back({.fd = server->idlePipe.readSide.get(), .events = POLLIN, .revents = 0});
+            for (auto & conn : idle)
+                fds.push_back({.fd = conn->fd.get(), .events = POLLIN, .revents = 0});
+
+            if (poll(fds.data(), fds.size(), 1000) == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("waiting for connections");
+            }
+
+            if (fds[1].revents) {
+                char buf[1024];
+                if (read(server->idlePipe.readSide.get(), buf, sizeof(buf)) == -1 && errno != EINTR)
+                    throw SysError("reading from pipe");
+            }
+
+            /* Hand the connections that have a request (or have been
+               closed) to the workers, and close the ones that have
+               been idle for too long. */
+            auto now = std::chrono::steady_clock::now();
+            std::vector<std::shared_ptr<Connection>> stillIdle;
+            {
+                auto state(server->state_.lock());
+                for (size_t i = 0; i < idle.size(); ++i) {
+                    if (fds[i + 2].revents) {
+                        state->ready.push_back(std::move(idle[i]));
+                        server->wakeup.notify_one();
+                    } else if (now - idle[i]->lastActive < std::chrono::seconds(idleTimeout))
+                        stillIdle.push_back(std::move(idle[i]));
+                }
+            }
+            idle = std::move(stillIdle);
+
+            if (fds[0].revents) {
+                while (true) {
+                    AutoCloseFD remote = accept(fdSocket.get(), nullptr, nullptr);
+                    if (!remote) {
+                        if (errno == EINTR || errno == ECONNABORTED) continue;
+                        if (errno != EAGAIN && errno != EWOULDBLOCK)
+                            printError("accepting connection: %s", strerror(errno));
+                        break;
+                    }
+
+                    /* On macOS, accepted sockets inherit the
+                       non-blocking flag from the server socket. */
+                    if (fcntl(remote.get(), F_SETFL, fcntl(remote.get(), F_GETFL) & ~O_NONBLOCK) == -1)
+                        throw SysError("making socket blocking");
+                    unix::closeOnExec(remote.get());
+
+                    /* Time out reads of partial requests and sends, so
+                       that a client that stalls can't tie up a worker
+                       forever. */
+                    struct timeval timeout = { .tv_sec = (time_t) idleTimeout, .tv_usec = 0 };
+                    setsockopt(remote.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                    setsockopt(remote.get(), SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                    int one = 1;
+                    setsockopt(remote.get(), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+                    server->metrics.connections++;
+                    idle.push_back(std::make_shared<Connection>(std::move(remote), server->metrics.activeConnections));
+                }
+            }
+
+            if (refreshInterval && now - lastRefresh >= std::chrono::seconds(refreshInterval)) {
+                server->index.refresh();
+                lastRefresh = std::chrono::steady_clock::now();
+            }
+        }
+    }
+};
+
+static auto rCmdStoreServe = registerCommand2<CmdStoreServe>({"store", "serve"});
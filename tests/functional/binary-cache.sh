@@ -26,6 +26,39 @@ for path in "${paths[@]}"; do
         || [[ "$path" =~ -dependencies-top$ ]]
 done
 
+# A path is not added to the binary cache if its references are
+# missing.
+clearCache
+expect 1 nix copy --no-recursive --to "file://$cacheDir" "$outPath" 2>&1 | grepQuiet "is not valid"
+[[ ! -e "$cacheDir/$(basename "$outPath" | cut -c1-32).narinfo" ]]
+# The references are checked before uploading, so no NAR is left behind.
+[[ -z "$(ls -A "$cacheDir/nar" 2>/dev/null)" ]]
+
+# NARs are uploaded concurrently, but every .narinfo is only written
+# after those of its references, so the closure is complete.
+nix copy --to "file://$cacheDir?upload-jobs=4" "$outPath"
+nix path-info --store "file://$cacheDir" --recursive "$outPath" > "$TEST_ROOT/cache-closure"
+nix path-info --recursive "$outPath" > "$TEST_ROOT/closure"
+diff <(sort "$TEST_ROOT/cache-closure") <(sort "$TEST_ROOT/closure")
+
+# With `use-path-index`, a path that is not in the path index is
+# reported as missing without looking up its .narinfo. Here the
+# .narinfo of input-2 exists, but the index written before it was
+# copied doesn't list it.
+input0Path=$(nix-store -qR "$outPath" | grep -- -dependencies-input-0)
+input2Path=$(nix-store -qR "$outPath" | grep -- -dependencies-input-2)
+clearCache
+clearCacheCache
+nix copy --to "file://$cacheDir?write-path-index=true" "$input0Path"
+grepQuiet "^PathIndex: " "$cacheDir/nix-cache-info"
+nix copy --to "file://$cacheDir" "$outPath"
+nix path-info --store "file://$cacheDir" "$input2Path"
+clearCacheCache
+nix path-info --store "file://$cacheDir?use-path-index=true" "$input0Path"
+expect 1 nix path-info --store "file://$cacheDir?use-path-index=true" "$input2Path"
+clearCacheCache
+nix path-info --store "file://$cacheDir?use-path-index=true" --option narinfo-cache-negative-ttl 0 "$input2Path"
+
 # Test copying build logs to the binary cache.
 expect 1 nix log --store "file://$cacheDir" "$outPath" 2>&1 | grep 'is not available'
 nix store copy-log --to "file://$cacheDir" "$outPath"
@@ -231,6 +264,36 @@ rm -rfv "$cacheDir/nar"
 (! nix store cat --store "file://$cacheDir" "$outPath/foobar")
 
 
+# Test chunked NARs and the local chunk cache.
+clearStore
+clearCache
+clearCacheCache
+outPath=$(nix-build dependencies.nix --no-out-link)
+nix copy --to "file://$cacheDir?chunked-nars=true&nar-chunk-size=64" "$outPath"
+[[ -n $(ls "$cacheDir/chunks") ]]
+
+chunkCache=$TEST_ROOT/chunk-cache
+rm -rf "$chunkCache"
+clearStore
+nix-store --substituters "file://$cacheDir?local-chunk-cache=$chunkCache" --no-require-sigs -r "$outPath"
+cat "$outPath/foobar"
+# Local chunks are named by their base-32 hash.
+[[ -n $(ls "$chunkCache") ]]
+for chunk in "$chunkCache"/*; do
+    [[ $(basename "$chunk") =~ ^[0-9a-z]{52}$ ]]
+done
+
+# The second time, the chunks aren't downloaded again.
+rm -rf "$cacheDir/chunks"
+clearStore
+clearCacheCache
+nix-store --substituters "file://$cacheDir?local-chunk-cache=$chunkCache" --no-require-sigs -r "$outPath"
+cat "$outPath/foobar"
+clearStore
+clearCacheCache
+(! nix-store --substituters "file://$cacheDir" --no-require-sigs -r "$outPath")
+
+
 # Test NAR listing generation.
 clearCache
 
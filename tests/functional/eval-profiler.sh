@@ -0,0 +1,36 @@
+#!/usr/bin/env bash
+
+source common.sh
+
+profile="$TEST_ROOT/eval.profile"
+
+nix-instantiate --eval \
+    --eval-profile-file "$profile" \
+    --eval-profiler-frequency 10000 \
+    --expr '
+      let
+        f = n: if n == 0 then 0 else 1 + f (n - 1);
+      in builtins.foldl'"'"' (acc: x: acc + f 1000) 0 (builtins.genList (x: x) 1000)
+    '
+
+# Every line is a stack followed by a sample count.
+grepQuiet -E '^[^ ].* [0-9]+$' "$profile"
+grepQuietInverse -Ev '^.* [0-9]+$' "$profile"
+
+# The recursive function shows up with its position.
+grepQuiet 'f at «string»:3:13' "$profile"
+grepQuiet 'builtins.foldl' "$profile"
+
+# Cost attribution.
+stats="$TEST_ROOT/stats.json"
+
+NIX_SHOW_STATS=1 NIX_SHOW_STATS_PATH="$stats" NIX_COUNT_COSTS=1 \
+    nix-instantiate --eval --expr '
+      let
+        f = n: if n == 0 then 0 else 1 + f (n - 1);
+      in builtins.genList (x: f 100) 100
+    ' --strict > /dev/null
+
+[[ $(jq -r '.costs.functions[] | select(.name == "f") | .calls' "$stats") = 10100 ]]
+[[ $(jq -r '.costs.primops[] | select(.name == "genList") | .calls' "$stats") = 1 ]]
+jq -e '.costs.functions[] | select(.name == "f") | .total.time >= .self.time' "$stats"
@@ -9,3 +9,47 @@ touch "$TEST_ROOT/foo" -t 202211111111
 
 # Check that we can override lastModified for "path:" inputs.
 [[ "$(nix eval --impure --expr "(builtins.fetchTree { type = \"path\"; path = \"$TEST_ROOT/foo\"; lastModified = 123; }).lastModified")" = 123 ]]
+
+# Copying a local directory to the store is cached by the metadata of
+# its files.
+dir=$TEST_ROOT/cached-dir
+rm -rf "$dir"
+mkdir -p "$dir/sub"
+echo foo > "$dir/a"
+echo bar > "$dir/sub/b"
+
+fetchDir() {
+    nix eval --impure --raw --expr "
+      builtins.path {
+        path = $dir;
+        name = \"cached-dir\";
+        filter = p: t: builtins.trace \"filter \${baseNameOf p}\" true;
+      }" -vvvvv
+}
+
+# Files modified in the last second make the tree uncacheable.
+sleep 2
+
+# The filter is called once per file, even though the tree is both
+# fingerprinted and copied.
+path1=$(fetchDir 2> "$TEST_ROOT/log")
+[[ $(grep -c "trace: filter" "$TEST_ROOT/log") = 3 ]]
+grepQuietInverse "store path cache hit" "$TEST_ROOT/log"
+
+# An unchanged tree is found in the cache.
+path2=$(fetchDir 2> "$TEST_ROOT/log")
+[[ $path1 = "$path2" ]]
+grepQuiet "store path cache hit" "$TEST_ROOT/log"
+[[ $(grep -c "trace: filter" "$TEST_ROOT/log") = 3 ]]
+
+# A change that doesn't affect the size of a file is noticed.
+echo baz > "$dir/a"
+sleep 2
+path3=$(fetchDir 2> "$TEST_ROOT/log")
+[[ $path1 != "$path3" ]]
+grepQuietInverse "store path cache hit" "$TEST_ROOT/log"
+[[ $(cat "$path3/a") = baz ]]
+
+path4=$(fetchDir 2> "$TEST_ROOT/log")
+[[ $path3 = "$path4" ]]
+grepQuiet "store path cache hit" "$TEST_ROOT/log"
@@ -135,3 +135,52 @@ EOF
 
 checkRes=$(nix flake check --all-systems $flakeDir 2>&1 && fail "nix flake check --all-systems should have failed" || true)
 echo "$checkRes" | grepQuiet "formatter.system-1"
+
+# With --eval-jobs, the outputs are evaluated in several processes,
+# and the checks they find are built.
+cp "${config_nix}" $flakeDir/
+
+cat > $flakeDir/flake.nix <<EOF
+{
+  outputs = { self }: with import ./config.nix; {
+    checks.$system = builtins.listToAttrs (map (n: {
+      name = "check-\${toString n}";
+      value = mkDerivation {
+        name = "check-\${toString n}";
+        buildCommand = "echo \${toString n} > \$out";
+      };
+    }) [ 1 2 3 4 5 6 ]);
+    packages.$system.default = mkDerivation {
+      name = "package";
+      buildCommand = "touch \$out";
+    };
+  };
+}
+EOF
+
+nix flake check --eval-jobs 3 $flakeDir
+for n in 1 2 3 4 5 6; do
+    [[ $(cat "$(nix path-info "$flakeDir#checks.$system.check-$n")") = "$n" ]]
+done
+
+# Errors from all processes are reported, in the same order every
+# time.
+cat > $flakeDir/flake.nix <<EOF
+{
+  outputs = { self }: {
+    packages.system-1.default = "foo";
+    packages.system-2.default = "bar";
+    packages.system-3.default = "baz";
+    packages.system-4.default = "qux";
+  };
+}
+EOF
+
+checkRes=$(nix flake check --all-systems --keep-going --eval-jobs 3 $flakeDir 2>&1 && fail "nix flake check --all-systems should have failed" || true)
+for n in 1 2 3 4; do
+    echo "$checkRes" | grepQuiet "packages.system-$n.default"
+done
+checkRes2=$(nix flake check --all-systems --keep-going --eval-jobs 3 $flakeDir 2>&1 && fail "nix flake check --all-systems should have failed" || true)
+[[ "$checkRes" = "$checkRes2" ]]
+
+expect 1 nix flake check --all-systems --eval-jobs 3 $flakeDir
@@ -367,6 +367,30 @@ nix build -o $TEST_ROOT/result $url
 # Building with an incorrect SRI hash should fail.
 expectStderr 102 nix build -o $TEST_ROOT/result "file://$TEST_ROOT/flake.tar.gz?narHash=sha256-qQ2Zz4DNHViCUrp6gTS7EE4+RMqFQtUfWF2UNUtJKS0=" | grep 'NAR hash mismatch'
 
+# Tarball inputs are fetched concurrently into the same tarball cache.
+rm -rf "$HOME/.cache/nix/tarball-cache"
+concurrentDir=$TEST_ROOT/concurrent
+mkdir -p "$concurrentDir"
+inputs=
+for i in $(seq 1 8); do
+    mkdir -p "$TEST_ROOT/input$i"
+    for j in $(seq 1 50); do echo "$i $j" > "$TEST_ROOT/input$i/file$j"; done
+    tar cfz "$TEST_ROOT/input$i.tar.gz" -C "$TEST_ROOT" "input$i"
+    inputs+="input$i = { url = \"file://$TEST_ROOT/input$i.tar.gz\"; flake = false; }; "
+done
+cat > "$concurrentDir/flake.nix" <<EOF
+{
+  inputs = { $inputs};
+  outputs = inputs: { files = builtins.attrNames (builtins.readDir inputs.input8); };
+}
+EOF
+nix flake lock "$concurrentDir"
+for i in $(seq 1 8); do
+    [[ $(jq -r .nodes.input$i.locked.narHash "$concurrentDir/flake.lock") =~ sha256- ]]
+done
+[[ $(nix eval --json "$concurrentDir#files" | jq length) = 50 ]]
+git -C "$HOME/.cache/nix/tarball-cache" fsck
+
 # Test --override-input.
 git -C "$flake3Dir" reset --hard
 nix flake lock "$flake3Dir" --override-input flake2/flake1 file://$TEST_ROOT/flake.tar.gz -vvvvv
@@ -0,0 +1,65 @@
+#!/usr/bin/env bash
+
+# Test that the garbage collector respects `--max-freed` when it
+# deletes paths concurrently, and never deletes a path while paths
+# that refer to it are still valid.
+
+source common.sh
+
+TODO_NixOS
+
+clearStore
+
+# A chain of paths of about 100 KB each, each referring to the
+# previous one.
+# shellcheck disable=SC2016
+top=$(nix-build --no-out-link -E '
+  with import '"${config_nix}"';
+  let
+    mk = n: mkDerivation {
+      name = "chain-${toString n}";
+      prev = if n == 0 then "" else mk (n - 1);
+      buildCommand = "mkdir $out; echo $prev > $out/prev; head -c 100000 /dev/zero > $out/data-${toString n}";
+    };
+  in mk 19
+')
+
+readarray -t chain < <(nix-store -qR "$top" | grep -- -chain-)
+[[ ${#chain[@]} -eq 20 ]]
+
+declare -A sizes
+maxSize=0
+for path in "${chain[@]}"; do
+    size=$(nix-store -q --size "$path")
+    sizes[$path]=$size
+    if (( size > maxSize )); then maxSize=$size; fi
+done
+
+maxFreed=300000
+
+remaining=${#chain[@]}
+while (( remaining > 0 )); do
+    nix-store --gc --max-freed "$maxFreed" --option gc-delete-jobs 4
+
+    freed=0
+    left=0
+    for path in "${chain[@]}"; do
+        if [[ -e $path ]]; then
+            left=$((left + 1))
+            # Everything that a remaining path refers to still exists.
+            nix-store --check-validity "$path"
+            prev=$(cat "$path/prev")
+            [[ -z $prev ]] || [[ -e $prev ]]
+        elif [[ -n ${sizes[$path]-} ]]; then
+            freed=$((freed + ${sizes[$path]}))
+            unset "sizes[$path]"
+        fi
+    done
+
+    # The limit may only be overshot by the last path.
+    (( freed > 0 ))
+    (( freed <= maxFreed + maxSize ))
+
+    (( left < remaining ))
+    remaining=$left
+done
@@ -0,0 +1,73 @@
+#!/usr/bin/env bash
+
+# Test incremental garbage collection with `--max-paths`.
+
+source common.sh
+
+TODO_NixOS
+
+clearStore
+
+addPath() {
+    echo "$1" > "$TEST_ROOT/$1"
+    nix-store --add "$TEST_ROOT/$1"
+}
+
+# Paths are considered least recently registered first, so the rooted
+# path is looked at first but doesn't count towards the limit.
+rooted=$(addPath rooted)
+ln -sfn "$rooted" "$NIX_STATE_DIR/gcroots/rooted"
+garbage=()
+for i in {0..8}; do
+    garbage+=("$(addPath "garbage-$i")")
+done
+
+nix store gc --max-paths 2
+test -e "$rooted"
+[[ ! -e ${garbage[0]} ]]
+[[ ! -e ${garbage[1]} ]]
+test -e "${garbage[2]}"
+
+# The permanent roots are cached for the next bounded collection.
+test -e "$NIX_STATE_DIR/gc-roots.cache"
+
+# A root added since then isn't missed.
+ln -sfn "${garbage[2]}" "$NIX_STATE_DIR/gcroots/new"
+nix store gc --max-paths 1
+test -e "${garbage[2]}"
+[[ ! -e ${garbage[3]} ]]
+test -e "${garbage[4]}"
+
+# Once nothing has changed for a while, the cache is used.
+nix-store --add-root "$TEST_ROOT/indirect" -r "${garbage[4]}"
+sleep 3
+nix store gc --max-paths 1
+[[ ! -e ${garbage[5]} ]]
+nix store gc --max-paths 1 -vvvvv 2>&1 | grepQuiet "using .* cached permanent GC roots"
+[[ ! -e ${garbage[6]} ]]
+test -e "${garbage[4]}"
+
+# Repointing an indirect root, which lives outside of the GC roots
+# directory, invalidates the cache as well.
+ln -sfn "${garbage[8]}" "$TEST_ROOT/indirect"
+nix store gc --max-paths 1 -vvvvv 2>&1 | grepQuietInverse "using .* cached permanent GC roots"
+[[ ! -e ${garbage[4]} ]]
+test -e "${garbage[7]}"
+test -e "${garbage[8]}"
+test -e "$rooted"
+
+# Through the daemon, the limit is passed along rather than running a
+# full collection.
+if ! isTestOnNixOS && isDaemonNewer "2.27.0pre"; then
+    more=()
+    for i in 0 1 2; do
+        more+=("$(addPath "more-$i")")
+    done
+    startDaemon
+    nix store gc --max-paths 2
+    [[ ! -e ${garbage[7]} ]]
+    [[ ! -e ${more[0]} ]]
+    test -e "${more[1]}"
+    test -e "${garbage[8]}"
+    killDaemon
+fi
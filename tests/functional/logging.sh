@@ -18,6 +18,72 @@ rm -rf $NIX_LOG_DIR
 nix-build dependencies.nix --no-out-link --compress-build-log
 [ "$(nix-store -l $path)" = FOO ]
 
+# Test filtering logs.
+[ "$(nix log --tail 1 $path)" = FOO ]
+[ "$(nix log --grep 'F.O' $path)" = FOO ]
+[ -z "$(nix log --grep BAR $path)" ]
+
+# Test indexed logs.
+clearStore
+rm -rf $NIX_LOG_DIR
+nix-build dependencies.nix --no-out-link --compress-build-log --index-build-log
+[[ -n $(find "$NIX_LOG_DIR" -name '*.zst') ]]
+[ "$(nix-store -l $path)" = FOO ]
+[ "$(nix log --tail 1 $path)" = FOO ]
+[ "$(nix log --grep 'F.O' $path)" = FOO ]
+# Following a log of a finished build returns right away.
+[ "$(timeout 10 nix log --follow $path)" = FOO ]
+
+# Follow the log of a running build. The builder prints a line, then
+# waits for $go before printing another one.
+go=$TEST_ROOT/follow-go
+followDrv() {
+    nix-instantiate -E "
+      with import ${config_nix};
+      mkDerivation {
+        name = \"$1\";
+        buildCommand = \"echo first; while ! test -e $go; do sleep 0.1; done; echo second; mkdir \$out\";
+      }"
+}
+
+# Wait until the first line of the log of $1 can be read.
+waitForFirstLine() {
+    for ((i = 0; i < 100; i++)); do
+        [[ "$(nix log "$1" 2>/dev/null)" = first ]] && return
+        sleep 0.1
+    done
+    false
+}
+
+rm -f "$go"
+drv=$(followDrv follow)
+nix-store -r "$drv" --compress-build-log --index-build-log --max-silent-time 60 &
+pid=$!
+waitForFirstLine "$drv"
+timeout 60 nix log --follow "$drv" > "$TEST_ROOT/follow.out" &
+followPid=$!
+sleep 1
+touch "$go"
+wait $pid
+wait $followPid
+[ "$(cat "$TEST_ROOT/follow.out")" = "$(printf 'first\nsecond')" ]
+[ "$(nix log "$drv")" = "$(printf 'first\nsecond')" ]
+
+# Following the log of a build that died without finishing its log
+# returns the lines that were written. Killing the client only kills
+# the build when the client runs it.
+if [[ "$NIX_REMOTE" != daemon ]]; then
+    rm -f "$go"
+    drv=$(followDrv follow-killed)
+    nix-store -r "$drv" --compress-build-log --index-build-log --max-silent-time 60 &
+    pid=$!
+    waitForFirstLine "$drv"
+    kill -9 $pid
+    wait $pid || true
+    touch "$go"
+    [ "$(timeout 10 nix log --follow "$drv")" = first ]
+fi
+
 # test whether empty logs work fine with `nix log`.
 builder="$(realpath "$(mktemp)")"
 echo -e "#!/bin/sh\nmkdir \$out" > "$builder"
@@ -33,3 +99,16 @@ if isDaemonNewer "2.26"; then
     # Build works despite ill-formed structured build log entries.
     expectStderr 0 nix build -f ./logging/unusual-logging.nix --no-link | grepQuiet 'warning: Unable to handle a JSON message from the derivation builder:'
 fi
+
+# Test the activity trace.
+clearStore
+trace="$TEST_ROOT/trace.json"
+nix-build dependencies.nix --no-out-link --activity-trace-file "$trace"
+jq -e 'map(select(.ph == "X" and .cat == "build")) | length > 0' "$trace"
+jq -e 'all(.[]; .pid != null and .ts != null)' "$trace"
+
+# Changing the log format keeps writing the same trace.
+clearStore
+rm -f "$trace"
+NIX_CONFIG="activity-trace-file = $trace" nix build -f dependencies.nix --no-link --log-format raw
+jq -e 'map(select(.ph == "X" and .cat == "build")) | length > 0' "$trace"
@@ -41,6 +41,22 @@ if [ "$inode1" != "$inode3" ]; then
     exit 1
 fi
 
+# A second run skips the paths that have already been optimised, but
+# processes new ones.
+NIX_REMOTE="" nix-store --optimise -vv 2>&1 | grepQuietInverse "optimising path '$outPath3'"
+
+outPath4=$(echo 'with import '"${config_nix}"'; mkDerivation { name = "foo4"; builder = builtins.toFile "builder" "mkdir $out; echo hello > $out/foo"; }' | nix-build - --no-out-link)
+
+NIX_REMOTE="" nix-store --optimise -vv 2> "$TEST_ROOT/optimise.log"
+grepQuiet "optimising path '$outPath4'" "$TEST_ROOT/optimise.log"
+grepQuietInverse "optimising path '$outPath3'" "$TEST_ROOT/optimise.log"
+
+inode4="$(stat --format=%i $outPath4/foo)"
+if [ "$inode1" != "$inode4" ]; then
+    echo "inodes do not match"
+    exit 1
+fi
+
 nix-store --gc
 
 if [ -n "$(ls $NIX_STORE_DIR/.links)" ]; then
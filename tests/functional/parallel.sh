@@ -56,3 +56,21 @@ wait $pid4 || fail "instance 4 failed: $?"
 
 if test "$(cat $_NIX_TEST_SHARED.cur)" != 0; then fail "wrong current process count"; fi
 if test "$(cat $_NIX_TEST_SHARED.max)" != 3; then fail "not enough parallelism"; fi
+
+
+# Third, test that `nix build` with several installables doesn't run
+# more builds than allowed by -j, even though it starts building the
+# first installables while evaluating the others.
+echo "testing nix build -j1 with several installables..."
+
+clearStore
+
+rm -f $_NIX_TEST_SHARED.cur $_NIX_TEST_SHARED.max
+
+drvPath=$(nix-instantiate parallel.nix --argstr sleepTime 1)
+mapfile -t drvPaths < <(nix-store -qR "$drvPath" | grep '\.drv$')
+
+nix build -j1 --no-link "${drvPaths[@]/%/^out}"
+
+if test "$(cat $_NIX_TEST_SHARED.cur)" != 0; then fail "wrong current process count"; fi
+if test "$(cat $_NIX_TEST_SHARED.max)" != 1; then fail "too much parallelism"; fi
@@ -34,6 +34,9 @@ expectStderr 1 nix-store --store local?read-only=true --add eval.nix | grepQuiet
 # Test a few operations that should work with the read-only store in its current state
 happy
 
+# Optimising needs to record which paths have been optimised
+expectStderr 1 nix-store --store local?read-only=true --optimise | grepQuiet "cannot optimise the Nix store in read-only mode"
+
 ## Testing read-only mode with an underlying store that is actually read-only
 
 # Ensure store is actually read-only
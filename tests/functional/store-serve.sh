@@ -0,0 +1,97 @@
+#!/usr/bin/env bash
+
+source common.sh
+
+TODO_NixOS
+
+clearStore
+clearCache
+clearCacheCache
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+
+nix copy --to "file://$cacheDir" "$outPath"
+
+port=$((20000 + RANDOM % 20000))
+cache="http://127.0.0.1:$port"
+
+nix store serve --store "file://$cacheDir" --port "$port" --threads 1 --refresh-interval 1 &
+pid=$!
+trap 'kill $pid' EXIT
+
+# Wait for the server to start.
+for ((i = 0; i < 100; i++)); do
+    if nix store info --store "$cache" > /dev/null 2>&1; then break; fi
+    sleep 0.1
+done
+
+# Fetch a narinfo.
+[[ $(nix path-info --store "$cache" "$outPath") = "$outPath" ]]
+
+# Fetch a NAR.
+nix store dump-path --store "$cache" "$outPath" > "$TEST_ROOT/served.nar"
+cmp "$TEST_ROOT/served.nar" <(nix-store --dump "$outPath")
+
+# Substitute from it.
+clearStore
+nix-store -r "$outPath" --substituters "$cache" --no-require-sigs
+[[ -e $outPath/foobar ]]
+
+# Missing files are reported as such.
+(! nix path-info --store "$cache" "$NIX_STORE_DIR/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa-missing")
+
+# Send a request with the given path and extra headers, and print the
+# response.
+httpGet() {
+    local path=$1
+    shift
+    exec 3<>"/dev/tcp/127.0.0.1/$port"
+    {
+        printf 'GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n' "$path"
+        for header in "$@"; do
+            printf '%s\r\n' "$header"
+        done
+        printf '\r\n'
+    } >&3
+    cat <&3
+    exec 3<&-
+}
+
+# An idle keep-alive connection doesn't stop the only worker thread
+# from serving other clients.
+exec 4<>"/dev/tcp/127.0.0.1/$port"
+[[ $(nix path-info --store "$cache" "$outPath") = "$outPath" ]]
+exec 4<&-
+
+# Range requests.
+nar=$(cd "$cacheDir" && ls nar/* | head -n1)
+size=$(wc -c < "$cacheDir/$nar")
+
+httpGet "/$nar" "Range: bytes=0-9" > "$TEST_ROOT/response"
+grepQuiet "^HTTP/1.1 206 " "$TEST_ROOT/response"
+grepQuiet "^Content-Range: bytes 0-9/$size" "$TEST_ROOT/response"
+cmp <(tail -c 10 "$TEST_ROOT/response") <(head -c 10 "$cacheDir/$nar")
+
+httpGet "/$nar" "Range: bytes=-5" > "$TEST_ROOT/response"
+grepQuiet "^HTTP/1.1 206 " "$TEST_ROOT/response"
+cmp <(tail -c 5 "$TEST_ROOT/response") <(tail -c 5 "$cacheDir/$nar")
+
+httpGet "/$nar" "Range: bytes=$size-" > "$TEST_ROOT/response"
+grepQuiet "^HTTP/1.1 416 " "$TEST_ROOT/response"
+grepQuiet "^Content-Range: bytes \*/$size" "$TEST_ROOT/response"
+
+# Narinfos added or deleted while the server is running are noticed.
+narInfo=$(basename "$outPath" | cut -c1-32).narinfo
+mv "$cacheDir/$narInfo" "$TEST_ROOT/$narInfo"
+sleep 3
+httpGet "/$narInfo" | grepQuiet "^HTTP/1.1 404 "
+mv "$TEST_ROOT/$narInfo" "$cacheDir/$narInfo"
+httpGet "/$narInfo" | grepQuiet "^HTTP/1.1 200 "
+
+# Metrics.
+httpGet /metrics > "$TEST_ROOT/metrics"
+grepQuiet '^nix_serve_responses_total{status="206"} 2$' "$TEST_ROOT/metrics"
+grepQuiet '^nix_serve_responses_total{status="416"} 1$' "$TEST_ROOT/metrics"
+grepQuiet '^nix_serve_narinfo_hits_total [1-9]' "$TEST_ROOT/metrics"
+grepQuiet '^nix_serve_narinfo_misses_total [1-9]' "$TEST_ROOT/metrics"
+grepQuiet '^nix_serve_active_connections 1$' "$TEST_ROOT/metrics"